@@ -0,0 +1,26 @@
+#ifndef _SCHED_H_
+#define _SCHED_H_
+
+/* log2 histograms of microseconds: bucket 0 counts [0, 2) us, bucket i
+ * [2^i, 2^(i+1)) us, the last one everything above */
+#define NR_HIST     20
+
+/* run queue depth: 0 .. NR_DEPTH - 1 waiting tasks, the last bucket is NR_DEPTH - 1 or more */
+#define NR_DEPTH    16
+
+/* scheduler statistics of all processors */
+struct schedstat {
+    unsigned int wakeup[NR_HIST];   /* wakeup latency: woken up => running */
+    unsigned int wait[NR_HIST];     /* time on a run queue before running */
+    unsigned int slice[NR_HIST];    /* time running before a switch */
+    unsigned int depth[NR_DEPTH];   /* waiting tasks, sampled on every tick */
+    unsigned int nr_switches;       /* context switches */
+    unsigned int nr_voluntary;      /* switches because the task slept or exited */
+    unsigned int nr_involuntary;    /* switches because the task was preempted */
+    unsigned int nr_wakeups;        /* tasks woken up */
+};
+
+int schedstat(struct schedstat *st);
+
+
+#endif /* _SCHED_H_ */
@@ -5,13 +5,27 @@
 #define stdout 1
 #define stderr 2
 
+#include <type.h>
+
+#define EOF (-1)
+#define BUFSIZ 512          /* size of a stream buffer */
+#define FOPEN_MAX 8         /* streams with a buffer, one per file descriptor */
+
+/* buffering modes of setvbuf() */
+#define _IOFBF 0            /* fully buffered */
+#define _IOLBF 1            /* line buffered */
+#define _IONBF 2            /* written at the end of each call */
+
 int printf(const char *format, ...);
 int puts(char *s);
 void putc(unsigned char c);
 int sprintf(char *str, const char *format, ...);
+int snprintf(char *str, size_t size, const char *format, ...);
 int fprintf(int fd, const char *format, ...);
 int scanf(const char *format, ...);
 int fputs(int fd, const char *s);
 char *fgets(char *s, int size, int stream);
+int fflush(int fd);
+int setvbuf(int fd, int mode);
 
 #endif /* _STDIO_H_ */
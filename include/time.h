@@ -0,0 +1,19 @@
+#ifndef _TIME_H_
+#define _TIME_H_
+
+#include <type.h>
+
+/* clocks */
+#define CLOCK_REALTIME  0       /* seconds since the epoch */
+#define CLOCK_MONOTONIC 1       /* time since boot */
+
+struct timespec {
+    unsigned long tv_sec;       /* seconds */
+    unsigned long tv_nsec;      /* nanoseconds, below one second */
+};
+
+int nanosleep(const struct timespec *req, struct timespec *rem);
+int clock_gettime(int clock, struct timespec *tp);
+
+
+#endif /* _TIME_H_ */
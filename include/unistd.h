@@ -25,9 +25,19 @@ typedef enum {
     SYS_SBRK,
     SYS_MMAP,
     SYS_MUNMAP,
-    SYS_STAT
+    SYS_STAT,
+    SYS_SCHED_SETSCHEDULER,
+    SYS_NANOSLEEP,
+    SYS_ALARM,
+    SYS_CLOCK_GETTIME,
+    SYS_SCHEDSTAT
 } sysnum;
 
+/* scheduling policies */
+#define SCHED_NORMAL    0
+#define SCHED_FIFO      1
+#define SCHED_RR        2
+
 
 int syscall(sysnum sysnum, int arg0, int arg1, int arg2);
 
@@ -41,6 +51,11 @@ pid_t waitpid(pid_t pid, int *wstatus);
 pid_t getpid(void);
 pid_t getppid(void);
 int getargs (char* buf, int nbytes);
+int sched_setscheduler(pid_t pid, int policy, int priority);
+
+/* time */
+unsigned int alarm(unsigned int seconds);
+unsigned int sleep(unsigned int seconds);
 
 /* Debug */
 int stat(char *info[]);
@@ -4,6 +4,34 @@
 #include <string.h>
 
 
+/* buffer of an output stream, one per file descriptor */
+typedef struct {
+    int mode;               /* _IOFBF, _IOLBF or _IONBF */
+    int len;                /* number of bytes waiting in buf */
+    char buf[BUFSIZ];
+} stream_t;
+
+/* destination of the formatting engine */
+typedef struct {
+    int fd;                 /* stream to write to, -1 to write into str */
+    char *str;              /* string to write to */
+    int size;               /* size of str, including the null byte */
+    int count;              /* number of characters produced */
+} out_t;
+
+/* the terminal is line buffered, errors are written at the end of each call */
+static stream_t streams[FOPEN_MAX] = {
+    [stdout] = { _IOLBF, 0 },
+    [stderr] = { _IONBF, 0 },
+};
+
+static void stream_putc(int fd, char c);
+static void stream_end(int fd);
+static void out_char(out_t *out, char c);
+static void out_str(out_t *out, const char *s);
+static int __printf(out_t *out, const char *format, int *esp);
+
+
 /**
  * @brief Write output to stdout.
  * 
@@ -14,14 +42,85 @@
  * to end output to strings).
  */
 int printf(const char *format, ...) {
+    out_t out = { stdout, NULL, 0, 0 };
+    int count = __printf(&out, format, (int *)&format + 1);
+
+    stream_end(stdout);
+    return count;
+}
+
+
+/**
+ * @brief Write to the character string str.
+ * 
+ * @param str : buffer large enough for the output
+ * @param format : format of the string
+ * @param ... : arguments matched to the format
+ * @return int : number of characters written (excluding the null byte)
+ */
+int sprintf(char *str, const char *format, ...) {
+    out_t out = { -1, str, 0x7FFFFFFF, 0 };
+    int count = __printf(&out, format, (int *)&format + 1);
+
+    str[count] = '\0';
+    return count;
+}
+
+
+/**
+ * @brief Write at most size bytes (including the null byte) to the 
+ * character string str.
+ * 
+ * @param str : output buffer
+ * @param size : size of str
+ * @param format : format of the string
+ * @param ... : arguments matched to the format
+ * @return int : number of characters the full output has (excluding the 
+ * null byte), a value of size or more means that the output was truncated.
+ */
+int snprintf(char *str, size_t size, const char *format, ...) {
+    out_t out = { -1, str, (int)size, 0 };
+    int count = __printf(&out, format, (int *)&format + 1);
+
+    if (size > 0)
+        str[count < (int)size ? count : (int)size - 1] = '\0';
+    return count;
+}
+
+
+/**
+ * @brief write output to the given output stream;
+ *
+ * @param fd : file descriptor
+ * @param format : format of the string
+ * @param ... : arguments matched to the format
+ * @return int : Upon successful return, these functions return 
+ * the number of characters printed (excluding the null byte used 
+ * to end output to strings). 
+ */
+int fprintf(int fd, const char *format, ...) {
+    out_t out = { fd, NULL, 0, 0 };
+    int count = __printf(&out, format, (int *)&format + 1);
+
+    stream_end(fd);
+    return count;
+}
+
+
+/**
+ * @brief Formatting engine of the printf family, the arguments are
+ * read from the stack starting at esp.
+ * 
+ * @param out : destination of the output
+ * @param format : format of the string
+ * @param esp : pointer to the first argument after format
+ * @return int : number of characters produced
+ */
+static int __printf(out_t *out, const char *format, int *esp) {
 
     /* Pointer to the format string */
     char *buf = (char *)format;
 
-    /* Stack pointer for the other parameters */
-    int *esp = (void *)&format;
-    esp++;
-
     while (*buf != '\0') {
         switch (*buf) {
             case '%':
@@ -34,7 +133,7 @@ format_char_switch:
                     switch (*buf) {
                         /* Print a literal '%' character */
                         case '%':
-                            putc('%');
+                            out_char(out, '%');
                             break;
 
                         /* Use alternate formatting */
@@ -52,7 +151,7 @@ format_char_switch:
                                 char conv_buf[64];
                                 if (alternate == 0) {
                                     itoa(*((unsigned int *)esp), conv_buf, 16);
-                                    puts(conv_buf);
+                                    out_str(out, conv_buf);
                                 } else {
                                     int starting_index;
                                     int i;
@@ -62,7 +161,7 @@ format_char_switch:
                                         conv_buf[i] = '0';
                                         i++;
                                     }
-                                    puts(&conv_buf[starting_index]);
+                                    out_str(out, &conv_buf[starting_index]);
                                 }
                                 esp++;
                             }
@@ -73,7 +172,7 @@ format_char_switch:
                             {
                                 char conv_buf[36];
                                 itoa(*((unsigned int *)esp), conv_buf, 10);
-                                puts(conv_buf);
+                                out_str(out, conv_buf);
                                 esp++;
                             }
                             break;
@@ -89,20 +188,20 @@ format_char_switch:
                                 } else {
                                     itoa(value, conv_buf, 10);
                                 }
-                                puts(conv_buf);
+                                out_str(out, conv_buf);
                                 esp++;
                             }
                             break;
 
                         /* Print a single character */
                         case 'c':
-                            putc((unsigned char) *((int *)esp));
+                            out_char(out, (char) *((int *)esp));
                             esp++;
                             break;
 
                         /* Print a NULL-terminated string */
                         case 's':
-                            puts(*((char **)esp));
+                            out_str(out, *((char **)esp));
                             esp++;
                             break;
 
@@ -114,18 +213,18 @@ format_char_switch:
                 break;
 
             default:
-                putc(*buf);
+                out_char(out, *buf);
                 break;
         }
         buf++;
     }
-    return (buf - format);
+    return out->count;
 }
 
 
 
 /**
- * @brief writes the string s and a trailing newline to stdout.
+ * @brief writes the string s to stdout.
  * 
  * @param s : string s
  * @return int : return a nonnegative number on success, or EOF on error.
@@ -133,9 +232,10 @@ format_char_switch:
 int puts(char *s) {
     register int index = 0;
     while (s[index] != '\0') {
-        putc(s[index]);
+        stream_putc(stdout, s[index]);
         index++;
     }
+    stream_end(stdout);
     return index;
 }
 
@@ -146,36 +246,56 @@ int puts(char *s) {
  * @param c : char to write
  */
 void putc(unsigned char c) {
-    char s[2];
-    s[0] = (char) c;
-    write(1, s, 1);
+    stream_putc(stdout, (char) c);
+    stream_end(stdout);
 }
 
 
 /**
- * @brief Write to the character string str.
+ * @brief Write the pending output of a stream with as few write() calls 
+ * as possible.
  * 
- * @param str 
- * @param format 
- * @param ... 
- * @return int 
+ * @param fd : file descriptor, a negative value flushes every stream
+ * @return int : 0 on success, EOF on error (the pending output is dropped)
  */
-int sprintf(char *str, const char *format, ...) {
-    return 0;
+int fflush(int fd) {
+    int i, n, rtn = 0;
+    stream_t *s;
+
+    if (fd < 0) {
+        for (i = 0; i < FOPEN_MAX; i++) {
+            if (fflush(i) < 0)
+                rtn = EOF;
+        }
+        return rtn;
+    }
+    if (fd >= FOPEN_MAX)
+        return 0;
+
+    s = &streams[fd];
+    for (i = 0; i < s->len; i += n) {
+        if ((n = write(fd, s->buf + i, s->len - i)) <= 0) {
+            rtn = EOF;
+            break;
+        }
+    }
+    s->len = 0;
+    return rtn;
 }
 
 
 /**
- * @brief write output to the given output stream;
- *
+ * @brief Change the buffering of a stream, pending output is flushed first.
+ * 
  * @param fd : file descriptor
- * @param format : format of the string
- * @param ... : arguments matched to the format
- * @return int : Upon successful return, these functions return 
- * the number of characters printed (excluding the null byte used 
- * to end output to strings). 
+ * @param mode : _IOFBF (full), _IOLBF (line) or _IONBF (per call)
+ * @return int : 0 on success, -1 on a bad stream or mode
  */
-int fprintf(int fd, const char *format, ...) {
+int setvbuf(int fd, int mode) {
+    if (fd < 0 || fd >= FOPEN_MAX || mode < _IOFBF || mode > _IONBF)
+        return -1;
+    fflush(fd);
+    streams[fd].mode = mode;
     return 0;
 }
 
@@ -204,7 +324,13 @@ int scanf(const char *format, ...) {
  * @return int : number of bytes write
  */
 int fputs(int fd, const char *s) {
-    return write(fd, (void*)s, strlen(s));
+    register int index = 0;
+    while (s[index] != '\0') {
+        stream_putc(fd, s[index]);
+        index++;
+    }
+    stream_end(fd);
+    return index;
 }
 
 
@@ -224,6 +350,7 @@ int fputs(int fd, const char *s) {
 char *fgets(char *s, int size, int stream) {
     /* EOP unimplemented due to lack of signal module */
 
+    fflush(stdout);     /* show the prompt before blocking */
     if (read(stream, (void *)s, size) < 0) {
         return NULL;
     }
@@ -232,3 +359,62 @@ char *fgets(char *s, int size, int stream) {
 }
 
 
+/**
+ * @brief Append a character to the buffer of a stream, the buffer is 
+ * written when full or, for line buffered streams, at a newline.
+ * 
+ * @param fd : file descriptor
+ * @param c : character to write
+ */
+static void stream_putc(int fd, char c) {
+    stream_t *s;
+
+    if (fd < 0 || fd >= FOPEN_MAX) {
+        write(fd, &c, 1);
+        return;
+    }
+
+    s = &streams[fd];
+    s->buf[s->len++] = c;
+    if (s->len == BUFSIZ || (c == '\n' && s->mode == _IOLBF))
+        fflush(fd);
+}
+
+
+/**
+ * @brief End of one stdio call on a stream, unbuffered streams are 
+ * written now.
+ * 
+ * @param fd : file descriptor
+ */
+static void stream_end(int fd) {
+    if (fd >= 0 && fd < FOPEN_MAX && streams[fd].mode == _IONBF)
+        fflush(fd);
+}
+
+
+/**
+ * @brief Emit one character of formatted output.
+ * 
+ * @param out : destination of the output
+ * @param c : character
+ */
+static void out_char(out_t *out, char c) {
+    if (out->fd >= 0)
+        stream_putc(out->fd, c);
+    else if (out->count < out->size - 1)
+        out->str[out->count] = c;
+    out->count++;
+}
+
+
+/**
+ * @brief Emit a string of formatted output.
+ * 
+ * @param out : destination of the output
+ * @param s : NULL-terminated string
+ */
+static void out_str(out_t *out, const char *s) {
+    while (*s != '\0')
+        out_char(out, *s++);
+}
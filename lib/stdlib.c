@@ -330,11 +330,12 @@ static void transferring_data(void *src, void *dst, size_t size) {
 
 
 /**
- * @brief exit the process
+ * @brief exit the process, the pending output of all streams is written
  * 
  * @param status : status message
  */
 void exit(int status) {
+    fflush(-1);
     _exit(status);
 }
 
@@ -1,4 +1,7 @@
 #include <unistd.h>
+#include <stdio.h>
+#include <time.h>
+#include <sched.h>
 
 
 /**
@@ -14,6 +17,7 @@
  * and errno is set appropriately.
  */
 pid_t fork(void) {
+    fflush(-1);     /* the child must not repeat pending output */
     return (pid_t) syscall(SYS_FORK, 0, 0, 0);
 }
 
@@ -35,6 +39,7 @@ pid_t fork(void) {
  * returned, and errno is set appropriately.
  */
 int execv(const char *pathname, char *const argv[]) {
+    fflush(-1);     /* the new program does not keep the buffers */
     return syscall(SYS_EXECV, (int) pathname, (int) argv, 0);
 }
 
@@ -47,6 +52,7 @@ int execv(const char *pathname, char *const argv[]) {
  * error -1 is returned, and errno is set appropriately.
  */
 int execute(const char *cmd) {
+    fflush(-1);     /* keep the output in order with the child's */
     return syscall(SYS_EXECUTE, (int) cmd, 0, 0);
 }
 
@@ -119,6 +125,88 @@ pid_t getppid(void) {
 }
 
 
+/**
+ * @brief Set the scheduling policy and the real-time priority of a 
+ * process. SCHED_FIFO and SCHED_RR processes always run before the 
+ * SCHED_NORMAL ones, the highest priority first.
+ * 
+ * @param pid : pid of the process, 0 for the calling process
+ * @param policy : SCHED_NORMAL, SCHED_FIFO or SCHED_RR
+ * @param priority : 1 (lowest) to 31 for SCHED_FIFO and SCHED_RR, 
+ * 0 for SCHED_NORMAL
+ * @return int : 0 on success, a negative value on error.
+ */
+int sched_setscheduler(pid_t pid, int policy, int priority) {
+    return syscall(SYS_SCHED_SETSCHEDULER, (int) pid, policy, priority);
+}
+
+
+
+/**
+ * @brief Suspends the calling process until the time in req has 
+ * elapsed or an alarm fires. The process does not use the CPU 
+ * meanwhile.
+ * 
+ * @param req : time to sleep, tv_nsec below 1000000000
+ * @param rem : if not NULL and the sleep is interrupted, the time 
+ * left is stored here
+ * @return int : 0 when the time has elapsed, -EINTR if interrupted 
+ * by an alarm, another negative value on error.
+ */
+int nanosleep(const struct timespec *req, struct timespec *rem) {
+    return syscall(SYS_NANOSLEEP, (int) req, (int) rem, 0);
+}
+
+
+
+/**
+ * @brief Arranges for an alarm in seconds seconds, replacing any 
+ * previous one. With no signals yet, the alarm interrupts a 
+ * nanosleep() (or sleep()) of the process.
+ * 
+ * @param seconds : seconds until the alarm, 0 cancels a pending one
+ * @return unsigned int : seconds that remained of the previous 
+ * alarm, 0 if there was none.
+ */
+unsigned int alarm(unsigned int seconds) {
+    return (unsigned int) syscall(SYS_ALARM, (int) seconds, 0, 0);
+}
+
+
+
+/**
+ * @brief Sleeps for seconds seconds or until an alarm fires.
+ * 
+ * @param seconds : seconds to sleep
+ * @return unsigned int : 0 if the time has elapsed, the seconds 
+ * left otherwise.
+ */
+unsigned int sleep(unsigned int seconds) {
+    struct timespec req, rem;
+
+    req.tv_sec = seconds;
+    req.tv_nsec = 0;
+
+    if (nanosleep(&req, &rem) < 0)
+        return rem.tv_sec + (rem.tv_nsec ? 1 : 0);
+    return 0;
+}
+
+
+
+/**
+ * @brief Retrieves the time of the clock clock.
+ * 
+ * @param clock : CLOCK_REALTIME (seconds since the epoch) or 
+ * CLOCK_MONOTONIC (time since boot)
+ * @param tp : the time is stored here
+ * @return int : 0 on success, a negative value on error.
+ */
+int clock_gettime(int clock, struct timespec *tp) {
+    return syscall(SYS_CLOCK_GETTIME, clock, (int) tp, 0);
+}
+
+
 
 /**
  * @brief Stores the program arguments of the running process into buf
@@ -158,6 +246,7 @@ int open(const char *pathname) {
  * and errno is set appropriately
  */
 int close(int fd) {
+    fflush(fd);     /* pending output belongs to the old file */
     return syscall(SYS_CLOSE, fd, 0, 0);
 }
 
@@ -282,3 +371,18 @@ int munmap(void *addr, size_t size) {
 int stat(char *info[]) {
     return syscall(SYS_STAT, (int) info, 0, 0);
 }
+
+
+
+/**
+ * @brief Reads the scheduler statistics of all processors: log2 
+ * histograms of the wakeup latency, of the time on a run queue and 
+ * of the time running before a switch, the run queue depth sampled 
+ * on every tick and the switch counters.
+ * 
+ * @param st : the statistics are stored here
+ * @return int : 0 on success, a negative value on error.
+ */
+int schedstat(struct schedstat *st) {
+    return syscall(SYS_SCHEDSTAT, (int) st, 0, 0);
+}
@@ -5,6 +5,10 @@
  * as the current user and associated with the same terminal as the invoker.  
  * It displays the process ID (pid=PID), the terminal associated with the 
  * process (tname=TTY).
+ * 
+ * ps -s also displays the scheduler statistics: histograms of the wakeup
+ * latency, of the time on a run queue, of the time slices and of the run
+ * queue depth.
  * @version 0.1
  * @date 2022-11-09
  * 
@@ -16,20 +20,25 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <sched.h>
 
 #define BUFSIZE     128
 #define NUMPROC     100
-#define HEADERY     6
+#define HEADERY     9
 #define HEADERX     32
 #define NSPACE      5
+#define ARGSIZE     33
+#define BARWIDTH    40
 
 
 
 void print_stat(int nproc, char *info[]) {
     int i;
     const char header[HEADERY][HEADERX] = { 
-        "PID", "PPID", "CMD", "NICE", "STATE", "RUNTIME" 
+        "PID", "PPID", "CMD", "NICE", "STATE", "RUNTIME(us)",
+        "WAIT(us)", "VCSW", "ICSW"
     };
+    char *field, *sep;
 
 
     for (i = 0; i < HEADERY; ++i) {
@@ -39,10 +48,65 @@ void print_stat(int nproc, char *info[]) {
     }
     printf("\n");
 
-    // for (i = 0; i < nproc; ++i) {
-    //     printf("%s\n", info[i]);
+    /* one row per process, fields are separated by ',' */
+    for (i = 0; i < nproc; ++i) {
+        for (field = info[i]; (sep = strchr(field, ',')); field = sep + 1) {
+            *sep = '\0';
+            printf("%s     ", field);
+        }
+        printf("%s\n", field);
+    }
+}
 
-    // }
+
+/* print the non empty buckets of a histogram with a bar scaled to the largest */
+void print_hist(const char *title, const unsigned int *hist, int n, int log2) {
+    int i, j;
+    unsigned int max = 0, scale, bar;
+
+    printf("%s\n", title);
+
+    for (i = 0; i < n; ++i)
+        if (hist[i] > max)
+            max = hist[i];
+
+    /* at most BARWIDTH characters per bar */
+    scale = (max + BARWIDTH - 1) / BARWIDTH;
+
+    for (i = 0; i < n; ++i) {
+        if (!hist[i])
+            continue;
+
+        if (!log2)
+            printf("  %d%s", i, (i == n - 1) ? "+" : "");
+        else if (!i)
+            printf("  <2us");
+        else
+            printf("  %dus%s", 1 << i, (i == n - 1) ? "+" : "");
+
+        printf("  %u  ", hist[i]);
+        bar = hist[i] / scale;
+        for (j = 0; j < (bar ? bar : 1); ++j)
+            printf("#");
+        printf("\n");
+    }
+}
+
+
+void print_schedstat(void) {
+    struct schedstat st;
+
+    if (schedstat(&st) < 0) {
+        printf("ps: cannot read the scheduler statistics\n");
+        return;
+    }
+
+    printf("\nswitches %u (voluntary %u, involuntary %u), wakeups %u\n",
+           st.nr_switches, st.nr_voluntary, st.nr_involuntary, st.nr_wakeups);
+    print_hist("wakeup latency", st.wakeup, NR_HIST, 1);
+    print_hist("run queue wait", st.wait, NR_HIST, 1);
+    print_hist("time slice", st.slice, NR_HIST, 1);
+    print_hist("run queue depth (ticks)", st.depth, NR_DEPTH, 0);
 }
 
 
@@ -50,18 +114,23 @@ int main(void) {
     int i;
     int nproc;
     int sum_proc = NUMPROC;
+    char arg[ARGSIZE];
 
     printf("????\n");
     char **info = malloc(sum_proc * sizeof(char*));
 
     for (i = 0; i < sum_proc; ++i) {
         info[i] = malloc(BUFSIZE * sizeof(char));
+        info[i][0] = '\0';     /* the kernel appends to it */
     }
 
     // while(1) {
         nproc = stat(info);
         print_stat(nproc, info);
 
+        if (!getargs(arg, ARGSIZE) && !strcmp(arg, "-s"))
+            print_schedstat();
+
         // if (nproc >= sum_proc / 2) {
 
         // }
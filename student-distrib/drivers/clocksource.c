@@ -0,0 +1,243 @@
+#include <drivers/clocksource.h>
+#include <drivers/time.h>
+#include <boot/smp.h>
+#include <spinlock.h>
+#include <lib.h>
+#include <io.h>
+
+static uint64_t tsc_read(void);
+static uint64_t tsc_calibrate(void);
+static int32_t has_tsc(void);
+static void clocksource_set_freq(clocksource_t *cs, uint64_t cycles, uint64_t ns);
+
+/* the PIT counts its 1.193182 MHz input clock between timer interrupts */
+static clocksource_t pit_clocksource = {
+    .name = "pit",
+    .rating = 110,
+    .read = pit_clock_read,
+    .shift = 20,
+};
+
+/* the time-stamp counter, calibrated against the PIT at boot */
+static clocksource_t tsc_clocksource = {
+    .name = "tsc",
+    .rating = 300,
+    .read = tsc_read,
+    .shift = 22,
+};
+
+/* sched_clock() = clock_ns + the time since the counter was clock_last.
+ * The base is moved forward by the timer interrupt of the boot processor
+ * (clocksource_update()), readers retry while clock_seq is odd or changed */
+static clocksource_t *clock;        /* the clocksource in use */
+static uint64_t clock_last;         /* counter value at the base */
+static uint64_t clock_ns;           /* nanoseconds since boot at the base */
+static volatile uint32_t clock_seq; /* odd while the base is written */
+static DEFINE_SPINLOCK(clock_lock); /* writers of the base */
+
+/* the last sched_clock() of each processor, which it never goes below */
+static uint64_t clock_prev[NR_CPUS];
+
+static void clock_set_base(clocksource_t *cs);
+
+
+/**
+ * @brief register the boot clocksources: the PIT always, the TSC when
+ * the CPU has one. The best rated one is used.
+ *
+ */
+void clocksource_init(void) {
+    clocksource_set_freq(&pit_clocksource, CLOCK_TICK_RATE, NSEC_PER_SEC);
+    clocksource_register(&pit_clocksource);
+
+    if (has_tsc()) {
+        clocksource_set_freq(&tsc_clocksource, tsc_calibrate(), CALIBRATE_NS);
+        clocksource_register(&tsc_clocksource);
+    }
+
+    printf("clocksource: %s, %d kHz\n", clock->name, clock->khz);
+}
+
+
+/**
+ * @brief make cs available, switch to it if it is rated better than the
+ * clocksource in use. The time already counted is kept.
+ *
+ * @param cs : a clocksource whose mult and shift are set
+ */
+void clocksource_register(clocksource_t *cs) {
+    uint32_t flags;
+
+    if (!cs->mult) return;
+
+    spin_lock_irqsave(&clock_lock, flags);
+    if (!clock || cs->rating > clock->rating)
+        clock_set_base(cs);
+    spin_unlock_irqrestore(&clock_lock, flags);
+}
+
+
+/**
+ * @brief move the base of sched_clock() to now, called by the timer
+ * interrupt of the boot processor: the time since the base stays short
+ * enough for (delta * mult) to fit in 64 bits
+ *
+ */
+void clocksource_update(void) {
+    uint32_t flags;
+
+    if (unlikely(!clock)) return;
+
+    spin_lock_irqsave(&clock_lock, flags);
+    clock_set_base(clock);
+    spin_unlock_irqrestore(&clock_lock, flags);
+}
+
+
+/**
+ * @brief read the clocksource in use, without a lock
+ *
+ * @return uint64_t : nanoseconds since the clocksource was registered
+ */
+uint64_t sched_clock(void) {
+    clocksource_t *cs;
+    uint64_t last, ns, delta;
+    uint32_t seq, cpu, flags;
+
+    if (unlikely(!clock)) return 0;
+
+    do {
+        while ((seq = clock_seq) & 1)
+            cpu_relax();
+        asm volatile ("" : : : "memory");
+        cs = clock;
+        last = clock_last;
+        ns = clock_ns;
+        asm volatile ("" : : : "memory");
+    } while (seq != clock_seq);
+
+    /* the counters of two processors may be slightly apart */
+    delta = cs->read() - last;
+    if ((int64_t)delta > 0)
+        ns += (delta * cs->mult) >> cs->shift;
+
+    /* never go back on this processor, an interrupt may read the clock
+     * between the check and the store */
+    cpu = smp_processor_id();
+    cli_and_save(flags);
+    if (ns < clock_prev[cpu])
+        ns = clock_prev[cpu];
+    else
+        clock_prev[cpu] = ns;
+    restore_flags(flags);
+
+    return ns;
+}
+
+
+/**
+ * @brief make cs the clocksource and its current value the base, keeping
+ * the time counted so far. clock_lock must be held.
+ *
+ * @param cs : clocksource
+ */
+static void clock_set_base(clocksource_t *cs) {
+    uint64_t now = cs->read();
+    uint64_t delta;
+
+    clock_seq++;
+    asm volatile ("" : : : "memory");
+
+    if (clock) {
+        delta = ((clock == cs) ? now : clock->read()) - clock_last;
+        if ((int64_t)delta > 0)
+            clock_ns += (delta * clock->mult) >> clock->shift;
+    }
+    clock = cs;
+    clock_last = now;
+
+    asm volatile ("" : : : "memory");
+    clock_seq++;
+}
+
+
+/**
+ * @brief set mult so that cycles counts of cs last ns nanoseconds
+ *
+ * @param cs : clocksource, its shift is set
+ * @param cycles : counter cycles measured
+ * @param ns : nanoseconds they took
+ */
+static void clocksource_set_freq(clocksource_t *cs, uint64_t cycles, uint64_t ns) {
+    uint64_t mult = ns << cs->shift;
+    uint64_t khz = cycles * 1000000ULL;
+
+    if (!cycles || (cycles >> 32)) return;
+
+    do_div(&mult, (uint32_t)cycles);
+    do_div(&khz, (uint32_t)ns);
+    if (mult >> 32) return;
+
+    cs->mult = (uint32_t)mult;
+    cs->khz = (uint32_t)khz;
+}
+
+
+/**
+ * @brief count TSC cycles while PIT channel 2 counts down 10 ms
+ *
+ * @return uint64_t : TSC cycles in CALIBRATE_NS
+ */
+static uint64_t tsc_calibrate(void) {
+    uint32_t flags;
+    uint64_t start, end;
+
+    cli_and_save(flags);
+    start = rdtsc();
+    pit_delay(CALIBRATE_LATCH);
+    end = rdtsc();
+    restore_flags(flags);
+
+    return end - start;
+}
+
+
+/**
+ * @brief busy wait on PIT channel 2, which is free for timing: channel
+ * 0 is the system tick
+ *
+ * @param count : PIT input cycles to wait (at most 0xFFFF)
+ */
+void pit_delay(uint32_t count) {
+    /* enable the gate of channel 2, keep the speaker off */
+    outb((inb(PIT_GATE_PORT) & ~0x02) | 0x01, PIT_GATE_PORT);
+
+    outb(PIT_CH2_ONESHOT, CMD_REG);
+    outb(count & 0xff, PIT_CH2);
+    outb((count >> 8) & 0xff, PIT_CH2);
+
+    /* the output of channel 2 goes high at terminal count */
+    while (!(inb(PIT_GATE_PORT) & 0x20));
+}
+
+
+/**
+ * @brief read the time-stamp counter
+ *
+ * @return uint64_t : TSC value
+ */
+static uint64_t tsc_read(void) {
+    return rdtsc();
+}
+
+
+/**
+ * @brief check whether the CPU has a time-stamp counter
+ *
+ * @return int32_t : 1 if it has, 0 otherwise
+ */
+static int32_t has_tsc(void) {
+    uint32_t eax = 1, ebx, ecx, edx;
+    asm volatile ("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    return !!(edx & CPUID_TSC);
+}
@@ -6,12 +6,14 @@
 #include <lib.h>
 #include <boot/x86_desc.h>
 #include <boot/page.h>
+#include <elf.h>
 
 fs_t *fs;        /* Stores the file system. */
 
 
 static int32_t validate_inode(uint32_t inode);
 static int32_t validate_fname(const int8_t *fname);
+static int32_t load_segment(thread_t *curr, vm_area_t *area, uint32_t inode, elf32_phdr_t *phdr);
 
 
 /**
@@ -180,51 +182,145 @@ uint32_t get_size(uint32_t index) {
 
 
 /**
- * @brief Load program image into user vitural address space
+ * @brief Load program image into user vitural address space.
+ * Every PT_LOAD segment becomes a memory area with its own access rights.
+ * The file system module stays resident, so full data blocks are mapped
+ * straight into the process (copy-on-write if writable), pages only partly
+ * backed by the file are copied into private zero filled frames, and the
+ * remaining bss is reserved and populated on first touch.
  * 
  * @param fname file name of the program
  * @param EIP: the address of the user program eip register
+ * @param curr: the process to load into
  * @return int32_t : positive or 0 denote success, negative values denote an error condition
  */
 int32_t pro_loader(const int8_t *fname, uint32_t *EIP, thread_t* curr) {
     int i;
     int32_t errno;
     int32_t inode;
-    inode_t file;
-    uint8_t header[40];
-    uint8_t eip_buf[4];
-    uint8_t magic_number[4] = { 0x7f, 0x45, 0x4c, 0x46 };
+    elf32_ehdr_t ehdr;
+    elf32_phdr_t phdr;
+    vm_area_t *area, *prev, **link;
 
     /* check if the file is a user-level executable file */
     if ((inode = validate_fname(fname)) < 0)
         return inode;
-    
-    /* get the file inode */
-    file = fs->inodes[inode];            /* Get the file inode. */
 
     /* read header from the program image */
-    if ((errno = read_data(inode, 0, header, 40)) < 0)
-        return errno;
+    if (read_data(inode, 0, (uint8_t *)&ehdr, sizeof(ehdr)) != sizeof(ehdr))
+        return -1;
 
-    /* check magic number */
-    for (i = 0; i < 4; ++i) {
-        if (header[i] != magic_number[i])
-            return -1;
-        eip_buf[i] = header[i + 24];
+    /* check magic number and type */
+    if (strncmp((int8_t *)ehdr.e_ident, ELFMAG, SELFMAG) || ehdr.e_type != ET_EXEC ||
+        ehdr.e_machine != EM_386 || ehdr.e_phentsize != sizeof(elf32_phdr_t))
+        return -1;
+
+    *EIP = ehdr.e_entry;
+
+    /* drop the old image when execv replaces the program */
+    link = &curr->vm.map_list;
+    while ((area = *link)) {
+        if (area->vmflag & VM_IMAGE) {
+            vmdealloc(area, area->vmend - area->vmstart, 1);
+            *link = area->next;
+            kmem_cache_free(vm_area_cachep, area);
+        } else {
+            link = &area->next;
+        }
     }
 
-    *EIP = *(uint32_t*)eip_buf;
+    /* segments are placed in front of heap and stack, sorted by address */
+    prev = NULL;
+    curr->vm.file_length = 0;
 
-    curr->vm.file_length = (file.size + PAGE_SIZE - 1) / PAGE_SIZE;
-    vmalloc(curr->vm.map_list, curr->vm.file_length * PAGE_SIZE, PTE_RW | PTE_US);
-    /* map the virtual memory space to to child */
-    
+    for (i = 0; i < ehdr.e_phnum; ++i) {
+        if (read_data(inode, ehdr.e_phoff + i * sizeof(phdr), (uint8_t *)&phdr, sizeof(phdr)) != sizeof(phdr))
+            return -1;
+        if (phdr.p_type != PT_LOAD || !phdr.p_memsz)
+            continue;
+
+        if ((area = kmem_cache_alloc(vm_area_cachep)) == NULL)
+            return -ENOMEM;
+        area->mmap = NULL;
+        area->vmstart = area->vmend = ADDR_TO_PTE(phdr.p_vaddr);
+        area->vmflag = VM_IMAGE | VM_READ | ((phdr.p_flags & PF_W) ? VM_WRITE : 0) | 
+                       ((phdr.p_flags & PF_X) ? VM_EXEC : 0);
+
+        if (prev) {
+            area->next = prev->next;
+            prev->next = area;
+        } else {
+            area->next = curr->vm.map_list;
+            curr->vm.map_list = area;
+        }
+
+        /* segments must be ordered, in user space and below the heap */
+        if (phdr.p_filesz > phdr.p_memsz || phdr.p_vaddr < VIR_MEM_BEGIN ||
+            phdr.p_vaddr + phdr.p_memsz > HEAP_START || (prev && area->vmstart < prev->vmend) ||
+            (phdr.p_offset & (PAGE_SIZE - 1)) != (phdr.p_vaddr & (PAGE_SIZE - 1)))
+            return -1;
+        prev = area;
 
+        if ((errno = load_segment(curr, area, inode, &phdr)) < 0)
+            return errno;
 
-    if ((errno = read_data(inode, 0, (uint8_t *)PROGRAM_IMG_BEGIN, file.size)) < 0) {
-        return errno;
+        curr->vm.file_length += (area->vmend - area->vmstart) / PAGE_SIZE;
     }
-    
+
+    return 0;
+}
+
+/**
+ * @brief Fill a memory area with a PT_LOAD segment.
+ * 
+ * @param curr : process that owns the area
+ * @param area : empty memory area of the segment
+ * @param inode : inode of the program
+ * @param phdr : program header of the segment
+ * @return int32_t : positive or 0 denote success, negative values denote an error condition
+ */
+static int32_t load_segment(thread_t *curr, vm_area_t *area, uint32_t inode, elf32_phdr_t *phdr) {
+    uint32_t va, pa, off, start, end, fend;
+    data_block *block;
+    uint8_t *p;
+    inode_t *file = &fs->inodes[inode];
+
+    fend = phdr->p_vaddr + phdr->p_filesz;          /* end of the bytes backed by the file */
+    off = phdr->p_offset - (phdr->p_vaddr - area->vmstart);
+
+    for (va = area->vmstart; va < fend; va += PAGE_SIZE, off += PAGE_SIZE) {
+        start = (va < phdr->p_vaddr) ? phdr->p_vaddr : va;
+        end = (va + PAGE_SIZE > fend) ? fend : va + PAGE_SIZE;
+
+        /* a full data block is shared with the file system */
+        if (start == va && end == va + PAGE_SIZE && off + PAGE_SIZE <= file->size) {
+            block = &fs->data_block_addr[file->data_block[off / BLOCK_SIZE]];
+            if (!((uint32_t)block & (PAGE_SIZE - 1))) {
+                if (vmattach(&curr->vm, area, (uint32_t)block, 1) < 0)
+                    return -ENOMEM;
+                continue;
+            }
+        }
+
+        /* otherwise copy the file bytes into a private frame */
+        if ((pa = get_user_page(0)) == 0)
+            return -ENOMEM;
+        p = kmap(pa);
+        memset(p, 0, PAGE_SIZE);
+        read_data(inode, off + (start - va), p + (start - va), end - start);
+        kunmap(p);
+        if (vmattach(&curr->vm, area, pa, 0) < 0) {
+            user_page_put(pa);
+            return -ENOMEM;
+        }
+    }
+
+    /* the rest of bss is zero filled on demand */
+    end = PAGE_ALIGN(phdr->p_vaddr + phdr->p_memsz);
+    if (end > area->vmend && vmreserve(area, end - area->vmend, PTE_US | 
+                                       ((area->vmflag & VM_WRITE) ? PTE_RW : 0)) < 0)
+        return -ENOMEM;
+
     return 0;
 }
 
@@ -39,6 +39,7 @@ void keyboard_init(void) {
 void do_keyboard(void) {
     terminal_t *terminal;
     uint32_t scancode;
+    uint8_t newline;
 
     /* Critical section begins. */
     cli();
@@ -49,11 +50,23 @@ void do_keyboard(void) {
 
     terminal = current->task->terminal;
 
+    spin_lock(&terminal->lock);
+
     if (scancode < SCANCODES_SIZE)              /* key press (make) */
         key_press(scancode, terminal);
     else                                        /* key release (break) */
         key_release(scancode - SCANCODES_SIZE, terminal);
 
+    newline = terminal->newline;
+    terminal->newline = 0;
+
+    spin_unlock(&terminal->lock);
+
+    /* readers check for a line with the wait queue locked, 
+     * the terminal lock is never held while taking it */
+    if (newline)
+        wake_up(&terminal->wait);
+
     /* Critical section ends. */
     sti();
 }
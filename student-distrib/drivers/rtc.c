@@ -3,18 +3,35 @@
 #include <vfs/file.h>
 #include <vfs/vfs.h>
 #include <pro/process.h>
+#include <pro/wait.h>
 #include <drivers/fs.h>
 #include <access.h>
+#include <spinlock.h>
 #include <lib.h>
 #include <io.h>
 
 
-/* Claimed as volatile to let it change base on interrupts. */
-volatile int global_interrupt_flag;
+/* Claimed as volatile to let it change base on interrupts. 
+ * Hardware interrupts since boot, the chip always runs at RTC_MAX_freq. */
+static volatile uint32_t rtc_ticks;
+
+/* tasks blocked in rtc_read() until their next virtual tick */
+static DECLARE_WAIT_QUEUE_HEAD(rtc_wait);
+
+/* earliest tick a sleeping reader is waiting for, valid when rtc_armed */
+static uint32_t rtc_wake_at;
+static uint8_t rtc_armed;
+
+/* open RTC files, the chip only interrupts while there is one */
+static uint32_t rtc_users;
+static DEFINE_SPINLOCK(rtc_lock);
 
 /* local helper functions*/
 static void set_rtc_freq(int32_t frequency);
 static char log2_of(int32_t frequency);
+static void set_virtual_freq(file_t *file, int32_t frequency);
+static int32_t rtc_due(file_t *file);
+static void set_rtc_pie(uint8_t on);
 
 /* RTC operation. */
 static file_op rtc_op = {
@@ -25,20 +42,43 @@ static file_op rtc_op = {
 };
 
 /**
- * @brief Initialize RTC and enable RTC interrupt.
+ * @brief Initialize RTC. The rate is set once, the periodic interrupt
+ * is only turned on while an RTC file is open (see rtc_get()).
  * 
  */
 void rtc_init() {
-    /* Reference from https://wiki.osdev.org/RTC#Turning_on_IRQ_8 and Linux source code.
-     * might neeed to turn off interrupts if multiprocessor involved
-     */
-    outb(RTC_B_reg, RTC_CMD_port);	    /* Select register B, and disable NMI. */
-    char prev = inb(RTC_DATA_port);	    /* Read the current value of register B */
-    outb(RTC_B_reg, RTC_CMD_port);	    /* Set the index again (a read will reset the index to register D) */
-    outb(prev | 0x40, RTC_DATA_port);   /* Write the previous value ORed with 0x40. This turns on bit 6 of register B */
-    enable_irq(RTC_IRQ);
+    set_rtc_pie(0);
     set_rtc_freq(RTC_MAX_freq);
-    global_interrupt_flag = 0;
+}
+
+
+/**
+ * @brief An RTC file is opened or copied: the first one turns the 
+ * periodic interrupt on.
+ * 
+ */
+void rtc_get(void) {
+    uint32_t flags;
+
+    spin_lock_irqsave(&rtc_lock, flags);
+    if (!rtc_users++)
+        set_rtc_pie(1);
+    spin_unlock_irqrestore(&rtc_lock, flags);
+}
+
+
+/**
+ * @brief An RTC file is closed or dropped with its table: the last one 
+ * turns the periodic interrupt off.
+ * 
+ */
+void rtc_put(void) {
+    uint32_t flags;
+
+    spin_lock_irqsave(&rtc_lock, flags);
+    if (rtc_users && !--rtc_users)
+        set_rtc_pie(0);
+    spin_unlock_irqrestore(&rtc_lock, flags);
 }
 
 /**
@@ -47,28 +87,39 @@ void rtc_init() {
  */
 void do_rtc() {
     cli();
-    global_interrupt_flag = 1;
+    rtc_ticks++;
     send_eoi(RTC_IRQ);
 
     outb(RTC_C_reg, RTC_CMD_port);     /* read from register C and ensure all interrupts are properly generated */
 
     inb(RTC_DATA_port);                /* discard the value for now. */
+
+    /* only wake readers when the earliest virtual tick is due */
+    if (rtc_armed && (int32_t)(rtc_ticks - rtc_wake_at) >= 0) {
+        rtc_armed = 0;
+        wake_up(&rtc_wait);
+    }
     sti();
 }
 
 /**
- * @brief Open the RTC.
+ * @brief Open the RTC. The hardware is left untouched, the new file 
+ * gets its own virtual frequency of 2 Hz.
  * 
  * @param filename : A filename.
- * @return int32_t : 0 on success, -1 otherwise.
+ * @return int32_t : file descriptor on success, -1 otherwise.
  */
 int32_t rtc_open(const int8_t* filename) {
     thread_t *curr;
+    int32_t fd;
+
     GETPRO(curr);
-    /* initialize the RTC and set initial frequency to 2 as instructed */
-    rtc_init();
-    set_rtc_freq(2);
-    return __open(2, filename, RTC, &rtc_op, curr);
+    if ((fd = __open(2, filename, RTC, &rtc_op, curr)) < 0)
+        return -1;
+
+    rtc_get();
+    set_virtual_freq(&curr->fds->fd[fd], RTC_MIN_freq);
+    return fd;
 }
 
 /**
@@ -78,11 +129,15 @@ int32_t rtc_open(const int8_t* filename) {
  * @return int32_t : 0 on success, -1 otherwise.
 */
 int32_t rtc_close(int32_t fd) {
-    return file_close(fd);
+    if (file_close(fd) < 0)
+        return -1;
+
+    rtc_put();
+    return 0;
 }
 
 /**
- * @brief Wait for interrupt on RTC
+ * @brief Wait for the next virtual tick of this file
  * 
  * @param fd : The file descriptor.
  * @param buffer : address of the target frequency.
@@ -92,15 +147,28 @@ int32_t rtc_close(int32_t fd) {
  * 
 */
 int32_t rtc_read(int32_t fd, void* buffer, int32_t nbytes) {
-    /* wait on interrupt generation */
-    while(!global_interrupt_flag);
-    global_interrupt_flag = 0;
+    thread_t *curr;
+    file_t *file;
+
+    if (fd < 0 || fd >= OPEN_MAX) 
+        return -1;
+
+    GETPRO(curr);
+    file = &curr->fds->fd[fd];
+
+    /* sleep until this file's virtual tick is due */
+    wait_event(rtc_wait, rtc_due(file));
+
+    /* schedule the next one, dropping the ticks missed while not reading */
+    file->f_rtc_next += file->f_rtc_div;
+    if ((int32_t)(rtc_ticks - file->f_rtc_next) >= 0)
+        file->f_rtc_next = rtc_ticks + file->f_rtc_div;
     return 0;
 }
 
 
 /**
- * @brief Set the RTC frequency based on buffer
+ * @brief Set the virtual frequency of this file based on buffer
  * 
  * @param fd : The file descriptor.
  * @param buffer : address of the target frequency.
@@ -120,15 +188,84 @@ int32_t rtc_write(int32_t fd, const void* buffer, int32_t nbytes){
         return -1;                      
     }
     /* check if the new frequency is power of 2*/
-    if (new_freq & 0x1) {
+    if (new_freq & (new_freq - 1)) {
+        return -1;
+    }
+    if (fd < 0 || fd >= OPEN_MAX) {
         return -1;
     }
 
-	set_rtc_freq(new_freq);
+    thread_t *curr;
+    GETPRO(curr);
+    set_virtual_freq(&curr->fds->fd[fd], new_freq);
     return 0;
 }
 
 
+/**
+ * @brief Local helper function that sets the virtual frequency of an RTC 
+ * file. The chip keeps running at RTC_MAX_freq, the file sees one tick every 
+ * RTC_MAX_freq / frequency interrupts.
+ * 
+ * @param file : an RTC file object
+ * @param frequency : a power of 2 in [RTC_MIN_freq, RTC_MAX_freq]
+ */
+static void set_virtual_freq(file_t *file, int32_t frequency) {
+    uint32_t flags;
+    cli_and_save(flags);
+    file->f_rtc_div = RTC_MAX_freq / frequency;
+    file->f_rtc_next = rtc_ticks + file->f_rtc_div;
+    restore_flags(flags);
+}
+
+
+/**
+ * @brief Local helper function that checks whether the next virtual tick of 
+ * a file is due. If not, arm do_rtc() to wake readers at that tick. Called 
+ * with interrupts disabled.
+ * 
+ * @param file : an RTC file object
+ * @return int32_t : 1 if due, 0 otherwise.
+ */
+static int32_t rtc_due(file_t *file) {
+    if ((int32_t)(rtc_ticks - file->f_rtc_next) >= 0)
+        return 1;
+
+    if (!rtc_armed || (int32_t)(file->f_rtc_next - rtc_wake_at) < 0)
+        rtc_wake_at = file->f_rtc_next;
+    rtc_armed = 1;
+    return 0;
+}
+
+
+
+/**
+ * @brief Local helper function that turns the periodic interrupt (PIE, bit 6
+ * of register B) and IRQ 8 on or off. Reference from 
+ * https://wiki.osdev.org/RTC#Turning_on_IRQ_8 and Linux source code.
+ * 
+ * @param on : 1 to turn the interrupt on, 0 to turn it off
+ */
+static void set_rtc_pie(uint8_t on) {
+    uint32_t interrupt_flag;
+    char prev;
+
+    cli_and_save(interrupt_flag);
+    outb(RTC_B_reg, RTC_CMD_port);	    /* Select register B, and disable NMI. */
+    prev = inb(RTC_DATA_port);	        /* Read the current value of register B */
+    outb(RTC_B_reg, RTC_CMD_port);	    /* Set the index again (a read will reset the index to register D) */
+    outb(on ? (prev | RTC_PIE) : (prev & ~RTC_PIE), RTC_DATA_port);
+
+    outb(RTC_C_reg, RTC_CMD_port);      /* drop an interrupt flagged meanwhile */
+    inb(RTC_DATA_port);
+    restore_flags(interrupt_flag);
+
+    if (on)
+        enable_irq(RTC_IRQ);
+    else
+        disable_irq(RTC_IRQ);
+}
+
 
 /**
  * @brief Local helper function that set the RTC frequency to the given value.
@@ -13,15 +13,20 @@
 /* Local functions, see headers for descriptions. */
 
 static void in(uint32_t scancode, uint8_t caps, terminal_t *terminal);
-static void out(const void *buf, int32_t nbytes);
+static void out(const void *buf, int32_t nbytes, terminal_t *terminal);
 static void out_tab(uint32_t n, terminal_t *terminal);
 static void backspace(terminal_t *terminal);
 static void bufcpy(void *dest, const void *src, uint32_t nbytes, uint8_t bufhd);
 static int isletter(uint32_t scancode);
 static inline void terminal_switch(uint32_t scancode, terminal_t *terminal, int idx);
+static void scrollback(terminal_t *terminal, int32_t lines);
+static int32_t line_ready(terminal_t *terminal, int32_t *nread);
 
 
 
+/* CRTC start address of a terminal's screen */
+#define SCREEN_START(t)     (((t)->vidmem - video_mem) / 2)
+
 /* 1 when terminal driver is booted */
 int8_t terminal_boot = 0;
 
@@ -32,7 +37,7 @@ int8_t terminal_boot = 0;
  */
 terminal_t *terminal_create(void) {
     /* create a new terminal */
-    terminal_t *terminal = kmalloc(sizeof(terminal_t));
+    terminal_t *terminal = kmem_cache_alloc(terminal_cachep);
 
     /* init terminal state */
     terminal->capslock = 0;                     /* capsLock is not pressed. */
@@ -43,9 +48,14 @@ terminal_t *terminal_create(void) {
     terminal->buftl = 0;                        /* 0 characters read. */
     terminal->size = 0;                         /* No character yet. */
     terminal->exit = 0;                         /* \n is not read. */
+    terminal->newline = 0;                      /* no reader to wake up. */
     terminal->buffer = kmalloc(TERBUF_SIZE);    /* create buffer */
-    // terminal->saved_vidmem = VIDEO_BUF_1 + i*TERBUF_SIZE;       /* create video memory */
-    // terminal->vidmem = terminal->saved_vidmem;  /* save back up video memory */
+    terminal->history = kmalloc(SCROLLBACK_LINES * LINE_SIZE);  /* NULL: no scrollback */
+    terminal->hist_head = 0;
+    terminal->hist_size = 0;
+    terminal->hist_view = 0;                    /* showing the live screen */
+    init_waitqueue_head(&terminal->wait);       /* no reader yet */
+    spin_lock_init(&terminal->lock);
     // memset((void*)terminal->buffer, 0, TERBUF_SIZE);
     // vga_clear(terminal->vidmem);
     return terminal;
@@ -59,17 +69,32 @@ terminal_t *terminal_create(void) {
 void terminal_free(terminal_t *terminal) {
     if (!terminal) return;
     kfree(terminal->buffer);
-    kfree(terminal);
+    kfree(terminal->history);
+    kmem_cache_free(terminal_cachep, terminal);
 }
 
 
 /**
- * @brief Parse key when the a key is pressed.
+ * @brief Parse key when the a key is pressed. Called by the keyboard 
+ * interrupt with the lock of the terminal held.
  * 
  * @param scancode : The scancode of the key.
  */
 void key_press(uint32_t scancode, terminal_t *terminal) {
+    /* Any other key goes back to the live screen. */
+    if (terminal->hist_view && scancode != PGUP && scancode != PGDN 
+        && scancode != LSHIFT && scancode != RSHIFT)
+        scrollback(terminal, -terminal->hist_view);
+
     switch (scancode) {
+    case PGUP:
+        if (terminal->shift)
+            scrollback(terminal, SCROLLBACK_STEP);
+        return;
+    case PGDN:
+        if (terminal->shift)
+            scrollback(terminal, -SCROLLBACK_STEP);
+        return;
     case CAPSLOCK:
         terminal->capslock = !(terminal->capslock);  /* Reverse capslock. */
         return;
@@ -128,10 +153,12 @@ void key_press(uint32_t scancode, terminal_t *terminal) {
     case L:
         if (terminal->ctrl) {                    /* If ctrl is hold and CTRL-L is pressed. */
             char buf[terminal->size];
-            clear(); 
-            puts("391OS> ");
+            vga_clear(terminal->vidmem);
+            terminal->screen_x = 0;
+            terminal->screen_y = 0;
+            out("391OS> ", 7, terminal);
             bufcpy((void*)buf, (void*)terminal->buffer, terminal->size, terminal->bufhd);
-            out(buf, terminal->size);
+            out(buf, terminal->size, terminal);
         } else {
             if (terminal->shift) {                   
                 in(scancode, 1 - (terminal->capslock & isletter(scancode)), terminal);
@@ -152,60 +179,120 @@ void key_press(uint32_t scancode, terminal_t *terminal) {
     }
 }
 
-void switch_vidmap(int src, int dest)
-{
-    thread_t *prev, *next;
-    prev = consoles[src]->task;
-    next = consoles[dest]->task;
-
-    vidmap_table[(VIDEO >> PDE_OFFSET_4KB) + src] = PTE_PRESENT | PTE_RW | PTE_US | ADDR_TO_PTE((uint32_t)consoles[src]->task->terminal->saved_vidmem);
-    vidmap_table[(VIDEO >> PDE_OFFSET_4KB) + dest] = PTE_PRESENT | PTE_RW | PTE_US | ADDR_TO_PTE(VIDEO);
-    
-
-    flush_tlb();
-
-}
-
-
+/**
+ * @brief Display another terminal. Every terminal draws into its own page 
+ * of VGA memory, the switch only moves the CRTC start address, nothing is 
+ * copied and no mapping changes.
+ */
 static inline void terminal_switch(uint32_t scancode, terminal_t *terminal, int idx) {
     terminal_t *next_terminal;
     thread_t *next;
 
     if (scancode == current->fkey) return; 
 
+    scrollback(terminal, -terminal->hist_view);
+
     next = consoles[idx]->task;
     
     next_terminal = next->terminal;
 
-    /* set its vidmem to back up */
-    memcpy((void*)terminal->saved_vidmem, (void*)video_mem, VIDMEM_SIZE);
-    terminal->vidmem = terminal->saved_vidmem;
-
     terminal->alt = 0;
-    
-    memcpy((void*)video_mem, (void*)next_terminal->saved_vidmem, VIDMEM_SIZE);
 
     if (next->state == UNUSED) {
         next->state = RUNNABLE;
         sched_fork(next);
         activate_task(next);
-        vga_clear(video_mem);
     } 
 
-    if (next->state == SLEEPING) {
-        next->state = RUNNABLE;
-        enqueue_task(next, 1);
-    }   
+    if (next->state == SLEEPING)
+        try_to_wake_up(next);
     
-    next_terminal->vidmem = video_mem;
-
+    vga_set_start(SCREEN_START(next_terminal));
     vga_update_cursor(next_terminal->screen_x, next_terminal->screen_y);
-    
-    switch_vidmap(current->id, idx);
         
     current = consoles[idx];
 }
 
+/**
+ * @brief Move the view of the displayed terminal into its scrollback. The 
+ * view is drawn into a second VGA page and shown by moving the CRTC start 
+ * address, the live screen keeps receiving output underneath.
+ * 
+ * @param terminal : the displayed terminal
+ * @param lines : lines to scroll back, negative to scroll forward
+ */
+static void scrollback(terminal_t *terminal, int32_t lines) {
+    int32_t view, row, back;
+
+    view = terminal->hist_view + lines;
+    if (view > terminal->hist_size)
+        view = terminal->hist_size;
+    if (view < 0)
+        view = 0;
+    if (view == terminal->hist_view)
+        return;
+    terminal->hist_view = view;
+
+    if (!view) {
+        vga_set_start(SCREEN_START(terminal));
+        vga_enable_cursor(SCANSTART, SCANEND);
+        vga_update_cursor(terminal->screen_x, terminal->screen_y);
+        return;
+    }
+
+    /* row r of the view is view - r lines above the top of the screen */
+    for (row = 0; row < NUM_ROWS; row++) {
+        back = view - row;
+        if (back > 0)
+            memcpy((char*)VIDEO_VIEW + row * LINE_SIZE, history_line(terminal, back), LINE_SIZE);
+        else
+            memcpy((char*)VIDEO_VIEW + row * LINE_SIZE, terminal->vidmem + (-back) * LINE_SIZE, LINE_SIZE);
+    }
+    vga_set_start((VIDEO_VIEW - VIDEO) / 2);
+    vga_disable_cursor();
+}
+
+
+/**
+ * @brief Save a line that leaves the top of the screen, the oldest line 
+ * is dropped when the ring is full.
+ * 
+ * @param terminal : terminal of the screen
+ * @param line : LINE_SIZE bytes of video memory, NULL for a blank line
+ */
+void history_push(terminal_t *terminal, const char *line) {
+    char *dest;
+
+    if (!terminal || !terminal->history)
+        return;
+
+    dest = terminal->history + terminal->hist_head * LINE_SIZE;
+    if (line)
+        memcpy(dest, line, LINE_SIZE);
+    else
+        memset_word(dest, (ATTRIB << 8) | ' ', LINE_SIZE / 2);
+
+    terminal->hist_head = (terminal->hist_head + 1) % SCROLLBACK_LINES;
+    if (terminal->hist_size < SCROLLBACK_LINES)
+        terminal->hist_size++;
+}
+
+
+/**
+ * @brief Get a line of the scrollback.
+ * 
+ * @param terminal : terminal of the screen
+ * @param back : 1 for the last line pushed, 2 for the one before, ...
+ * @return char* : LINE_SIZE bytes of the line, NULL if it is not kept
+ */
+char *history_line(terminal_t *terminal, uint32_t back) {
+    if (!terminal || !terminal->history || back == 0 || back > terminal->hist_size)
+        return NULL;
+    return terminal->history + 
+        ((terminal->hist_head + SCROLLBACK_LINES - back) % SCROLLBACK_LINES) * LINE_SIZE;
+}
+
+
 /**
  * @brief Parse key when the a key is release.
  * 
@@ -243,7 +330,7 @@ static void in(uint32_t scancode, uint8_t caps, terminal_t *terminal) {
     uint8_t character = scancodes[scancode][caps];  /* Get character. */
     if (character == '\r') character = '\n';
     if (character) {
-        _putc(character, terminal);
+        __putbuf((int8_t*)&character, 1, terminal);
         if (terminal->size  == TERBUF_SIZE)   
             terminal->bufhd = (terminal->bufhd + 1) % TERBUF_SIZE;
 
@@ -253,24 +340,23 @@ static void in(uint32_t scancode, uint8_t caps, terminal_t *terminal) {
         if (terminal->size != TERBUF_SIZE)   
             terminal->size++;            
         /* otherwise the size does not change. (always as same as TERBUF_SIZE) */
+
+        /* a line is complete: its readers are woken up once the 
+         * terminal is unlocked (see do_keyboard()) */
+        if (character == '\n')
+            terminal->newline = 1;
     }
 }
 
 /**
- * @brief Print the character to stdout that specified by the given keyboard 
- * scancode.
+ * @brief Print a buffer to a terminal, whose lock is held.
  * 
  * @param buf : The buffer to print to the screen.
  * @param nbytes : The number of bytes need to print to the screen.
+ * @param terminal : terminal to print to
  */
-static void out(const void *buf, int32_t nbytes) {
-    int i;
-    char c;
-    
-    for (i = 0; i < nbytes; ++i) {
-        c = ((char*)buf)[i];
-        putc(c);
-    }
+static void out(const void *buf, int32_t nbytes, terminal_t *terminal) {
+    __putbuf((const int8_t*)buf, nbytes, terminal);
 }
 
 
@@ -338,13 +424,12 @@ int32_t terminal_close(int32_t fd) {
  *                    number of bytes read on success.
  */
 int32_t terminal_read(int32_t fd, void *buf, int32_t nbytes) {
-    uint32_t intr_flag;
     int32_t nread;
-    uint8_t start = 0;
     thread_t *curr;
     terminal_t *terminal;
+    uint32_t flags;
 
-    curr = current->task;
+    GETPRO(curr);
     terminal = curr->terminal;
 
     if (!terminal) return -1;
@@ -364,27 +449,16 @@ int32_t terminal_read(int32_t fd, void *buf, int32_t nbytes) {
     /* Init to zero. (read is not stopped) */
     terminal->exit = 0;
 
-    while (!terminal->exit) {
-
-        /* sleep and waiting for an IO operation */
-        // sched_sleep(curr);
-
-        /* Waiting for intrrupt occurs... */
-
-        /* Critical section begins. */
-        cli_and_save(intr_flag);
-
-        for (nread = 0, start = terminal->bufhd; nread < terminal->size; nread++) {
-            if ((terminal->buffer[start] == '\n') || (terminal->buffer[start] == '\r')) {
-                nread++;
-                terminal->exit = 1;
-                break;
-            }
-            start = (start + 1) % TERBUF_SIZE;
-        }
+    /* sleep until the keyboard completes a line. The wait queue is checked
+     * without the terminal lock, another task of the console may take the 
+     * line first: check again with the lock held */
+    for (;;) {
+        wait_event(terminal->wait, line_ready(terminal, &nread));
 
-        /* Critical section ends. */
-        restore_flags(intr_flag);
+        spin_lock_irqsave(&terminal->lock, flags);
+        if (line_ready(terminal, &nread))
+            break;
+        spin_unlock_irqrestore(&terminal->lock, flags);
     }
 
     /* new-line character has been detected! */
@@ -402,10 +476,37 @@ int32_t terminal_read(int32_t fd, void *buf, int32_t nbytes) {
     /* change the bufhd points to next part. */
     terminal->bufhd = (terminal->bufhd + nread) % TERBUF_SIZE;
     terminal->size -= nread;
+    spin_unlock_irqrestore(&terminal->lock, flags);
+
     return nread;
 }
 
 
+/**
+ * @brief Check whether the terminal buffer holds a complete line. 
+ * Called with interrupts disabled, the answer only holds while the 
+ * terminal lock is held.
+ * 
+ * @param terminal : terminal to check
+ * @param nread : set to the length of the line, including the new-line
+ * @return int32_t : 1 when a line is ready, 0 otherwise.
+ */
+static int32_t line_ready(terminal_t *terminal, int32_t *nread) {
+    uint8_t start;
+    int32_t n;
+
+    for (n = 0, start = terminal->bufhd; n < terminal->size; n++) {
+        if ((terminal->buffer[start] == '\n') || (terminal->buffer[start] == '\r')) {
+            *nread = n + 1;
+            terminal->exit = 1;
+            return 1;
+        }
+        start = (start + 1) % TERBUF_SIZE;
+    }
+    return 0;
+}
+
+
 
 /**
  * @brief Write data to stdout.
@@ -416,20 +517,24 @@ int32_t terminal_read(int32_t fd, void *buf, int32_t nbytes) {
  * @return int32_t 
  */
 int32_t terminal_write(int32_t fd, const void *buf, int32_t nbytes) {
-    uint32_t intr_flag;
+    thread_t *curr;
+    terminal_t *terminal;
+    uint32_t flags;
+
     if (!buf)
         return -1;
 
     if (fd != stdout)
         return -1;
-    
-    /* Critical section begins. */
-    cli_and_save(intr_flag);
-
-    out(buf, nbytes);
 
-    /* Critical section ends. */
-    restore_flags(intr_flag);
+    GETPRO(curr);
+    terminal = curr->terminal;
+    
+    /* tasks of the console on other processors and the keyboard 
+     * interrupt print to the same screen */
+    spin_lock_irqsave(&terminal->lock, flags);
+    out(buf, nbytes, terminal);
+    spin_unlock_irqrestore(&terminal->lock, flags);
 
     return nbytes;
 }
@@ -1,11 +1,33 @@
 #include <drivers/time.h>
+#include <drivers/timer.h>
+#include <drivers/rtc.h>
 #include <boot/i8259.h>
 #include <pro/process.h>
+#include <drivers/clocksource.h>
+#include <boot/smp.h>
+#include <spinlock.h>
+#include <errno.h>
 #include <lib.h>
 #include <io.h>
 
 volatile uint32_t sys_ticks;  /* stores the number of elapsed ticks since the system was started (up to 50 days) */
 timespec sys_clock;           /* current time and date */
+static uint32_t boot_time;    /* seconds since the epoch when the system was started */
+
+static uint32_t tick_count;             /* PIT count of the running one-shot period */
+static uint8_t tick_state;              /* TICK_PERIODIC, TICK_ONESHOT or TICK_STOPPED */
+static uint64_t pit_cycles;             /* PIT input cycles of all finished periods */
+static uint64_t pit_last;               /* last value returned by pit_clock_read() */
+static DEFINE_SPINLOCK(pit_lock);       /* the PIT state, read by every processor */
+
+static uint32_t pit_read(void);
+static int32_t oneshot_expired(void);
+static int32_t pit_irq_pending(void);
+static void update_wall_time(void);
+static uint32_t cmos_read_time(void);
+static uint8_t cmos_read(uint8_t reg);
+static uint32_t mktime(uint32_t year, uint32_t mon, uint32_t day,
+                       uint32_t hour, uint32_t min, uint32_t sec);
 
 /**
  * @brief init PIT (Programmable Interval Timer)
@@ -15,10 +37,12 @@ timespec sys_clock;           /* current time and date */
  */
 void pit_init(void) {
     /* init sys_time */
-    // TODO
+    boot_time = cmos_read_time();
+    sys_clock.tv_sec = boot_time;
+    sys_clock.tv_nsec = 0;
 
     /* set up PIT*/
-    outb_p(0x34, CMD_REG);                /* binary, mode 2, LSB/MSB, ch 0 */
+    outb_p(PIT_PERIODIC, CMD_REG);        /* binary, mode 2, LSB/MSB, ch 0 */
     outb_p(LATCH & 0xff, TIMER_CHANNEL);  /* LSB */
     outb(LATCH >> 8, TIMER_CHANNEL);      /* MSB */
     sys_ticks = 0;
@@ -30,24 +54,305 @@ void pit_init(void) {
  * 
  */
 void do_timer(void) {
-    thread_t *current;
     uint32_t intr_flag;
 
-    cli_and_save(intr_flag);
+    spin_lock_irqsave(&pit_lock, intr_flag);
 
-    rq->clock +=  TICKUNIT;
+    if (tick_state == TICK_ONESHOT) {
+        if (unlikely(!oneshot_expired())) {
+            /* raised by the periodic mode just left, already accounted */
+            send_eoi(TIMER_IRQ);
+            spin_unlock_irqrestore(&pit_lock, intr_flag);
+            return;
+        }
+        /* the one-shot period is over and the PIT is stopped */
+        pit_cycles += tick_count;
+        tick_state = TICK_STOPPED;
+    } else {
+        pit_cycles += LATCH;
+    }
+
+    spin_unlock(&pit_lock);
 
     send_eoi(TIMER_IRQ);       
 
+    /* the ticks elapsed since the last interrupt (more than one if the
+     * tick was stopped) run the timers that expired meanwhile */
+    clocksource_update();
+    update_wall_time();
+    run_timers(sys_ticks);
+
+    scheduler_tick();
+
+    restore_flags(intr_flag);
+
+}
+
+
+/**
+ * @brief the part of the timer interrupt every processor runs: the PIT
+ * on the boot processor, the local APIC timer on the others
+ * 
+ */
+void scheduler_tick(void) {
+    thread_t *current;
+
+    /* read the clocksource at least once per tick */
+    this_rq()->clock = sched_clock();
+
     GETPRO(current);
 
     /* update vruntime of current task and reschedule when needed */
     task_tick(current);
 
-    if (current->flag == NEED_RESCHED) {
+    /* program the next tick before a possible switch: a task running 
+     * alone gets its whole timeslice, an idle CPU the longest period */
+    tick_program(sched_tick_length());
+
+    /* never reschedule from inside an idling pick_next_task() */
+    if (this_rq()->running && current->flag == NEED_RESCHED) {
         schedule();
     }
+}
 
-    restore_flags(intr_flag);
 
+/**
+ * @brief program the length of the next timer tick. One tick unit keeps
+ * the PIT periodic at HZ, anything longer programs a one-shot period 
+ * (at most TICK_MAX_NS). The part of a period cut short is added to 
+ * the PIT cycles before the PIT is reprogrammed. The PIT interrupts 
+ * the boot processor only, the others keep their periodic APIC timer.
+ * 
+ * @param ns : nanoseconds until the next timer interrupt
+ */
+void tick_program(uint64_t ns) {
+    uint32_t flags;
+    uint32_t count;
+
+    if (smp_processor_id()) return;
+
+    spin_lock_irqsave(&pit_lock, flags);
+
+    if (tick_state == TICK_PERIODIC && ns <= TICKUNIT) {
+        spin_unlock_irqrestore(&pit_lock, flags);
+        return;
+    }
+
+    /* a period has ended with its interrupt pending: do_timer() will 
+     * account it and program the next tick */
+    if ((tick_state == TICK_ONESHOT && oneshot_expired()) ||
+        (tick_state == TICK_PERIODIC && pit_irq_pending())) {
+        spin_unlock_irqrestore(&pit_lock, flags);
+        return;
+    }
+
+    if (tick_state == TICK_ONESHOT)
+        pit_cycles += tick_count - pit_read();
+    else if (tick_state == TICK_PERIODIC)
+        pit_cycles += LATCH - pit_read();
+
+    if (ns <= TICKUNIT) {
+        outb_p(PIT_PERIODIC, CMD_REG);
+        outb_p(LATCH & 0xff, TIMER_CHANNEL);
+        outb(LATCH >> 8, TIMER_CHANNEL);
+        tick_state = TICK_PERIODIC;
+    } else {
+        if (ns > TICK_MAX_NS) ns = TICK_MAX_NS;
+        count = (uint32_t)ns * 10 / PIT_NS_X10;
+        outb_p(PIT_ONESHOT, CMD_REG);
+        outb_p(count & 0xff, TIMER_CHANNEL);
+        outb(count >> 8, TIMER_CHANNEL);
+        tick_count = count;
+        tick_state = TICK_ONESHOT;
+    }
+
+    spin_unlock_irqrestore(&pit_lock, flags);
+}
+
+
+/**
+ * @brief the PIT as a clocksource: input cycles counted since boot
+ * 
+ * @return uint64_t : PIT cycles
+ */
+uint64_t pit_clock_read(void) {
+    uint32_t flags;
+    uint64_t now;
+
+    spin_lock_irqsave(&pit_lock, flags);
+
+    now = pit_cycles;
+    if (tick_state == TICK_PERIODIC) {
+        now += LATCH - pit_read();
+    } else if (tick_state == TICK_ONESHOT) {
+        if (oneshot_expired())
+            now += tick_count;
+        else
+            now += tick_count - pit_read();
+    }
+
+    /* a period ended but its interrupt is still pending */
+    if (now < pit_last) now = pit_last;
+    pit_last = now;
+
+    spin_unlock_irqrestore(&pit_lock, flags);
+    return now;
+}
+
+
+/**
+ * @brief A system call service routine for reading a clock
+ *
+ * @param clock : CLOCK_REALTIME or CLOCK_MONOTONIC
+ * @param tp : the time is stored here
+ * @return int32_t : 0 on success, -EINVAL for an unknown clock,
+ * -EFAULT if tp is NULL
+ */
+int32_t do_clock_gettime(uint32_t clock, timespec *tp) {
+    uint64_t ns;
+    uint32_t nsec;
+
+    if (!tp)
+        return -EFAULT;
+
+    if (clock != CLOCK_REALTIME && clock != CLOCK_MONOTONIC)
+        return -EINVAL;
+
+    ns = sched_clock();
+    nsec = do_div(&ns, NSEC_PER_SEC);
+
+    tp->tv_sec = (uint32_t)ns + ((clock == CLOCK_REALTIME) ? boot_time : 0);
+    tp->tv_nsec = nsec;
+
+    return 0;
+}
+
+
+/**
+ * @brief bring sys_ticks and sys_clock up to the clocksource
+ *
+ */
+static void update_wall_time(void) {
+    uint64_t ns = sched_clock();
+    uint32_t nsec = do_div(&ns, NSEC_PER_SEC);
+
+    sys_ticks = (uint32_t)ns * HZ + nsec / TICKUNIT;
+    sys_clock.tv_sec = boot_time + (uint32_t)ns;
+    sys_clock.tv_nsec = nsec;
+}
+
+
+/**
+ * @brief read the date kept by the CMOS real-time clock
+ *
+ * @return uint32_t : seconds since the epoch
+ */
+static uint32_t cmos_read_time(void) {
+    uint32_t sec, min, hour, day, mon, year;
+    uint8_t status;
+
+    /* the registers are not valid during an update (once a second) */
+    while (cmos_read(CMOS_STATUS_A) & CMOS_UIP);
+
+    sec  = cmos_read(CMOS_SECONDS);
+    min  = cmos_read(CMOS_MINUTES);
+    hour = cmos_read(CMOS_HOURS);
+    day  = cmos_read(CMOS_DAY);
+    mon  = cmos_read(CMOS_MONTH);
+    year = cmos_read(CMOS_YEAR);
+    status = cmos_read(CMOS_STATUS_B);
+
+    if (!(status & CMOS_BINARY)) {
+        sec  = bcd2bin(sec);
+        min  = bcd2bin(min);
+        hour = bcd2bin(hour & ~CMOS_PM) | (hour & CMOS_PM);
+        day  = bcd2bin(day);
+        mon  = bcd2bin(mon);
+        year = bcd2bin(year);
+    }
+
+    /* 12 hour mode: 12 AM is 0, 12 PM is 12 */
+    if (!(status & CMOS_24H)) {
+        if (hour & CMOS_PM)
+            hour = (hour & ~CMOS_PM) % 12 + 12;
+        else
+            hour %= 12;
+    }
+
+    /* no century register is read, assume 2000 .. 2099 */
+    return mktime(year + 2000, mon, day, hour, min, sec);
+}
+
+
+/**
+ * @brief read a CMOS register
+ *
+ * @param reg : register index
+ * @return uint8_t : value
+ */
+static uint8_t cmos_read(uint8_t reg) {
+    outb(CMOS_NMI_OFF | reg, RTC_CMD_port);
+    return inb(RTC_DATA_port);
+}
+
+
+/**
+ * @brief date => seconds since the epoch (Gauss' algorithm, as in
+ * Linux's mktime64)
+ *
+ * @param year : 1970 ..
+ * @param mon : 1 .. 12
+ * @param day : 1 .. 31
+ * @param hour : 0 .. 23
+ * @param min : 0 .. 59
+ * @param sec : 0 .. 59
+ * @return uint32_t : seconds since 1970-01-01 00:00:00 UTC
+ */
+static uint32_t mktime(uint32_t year, uint32_t mon, uint32_t day,
+                       uint32_t hour, uint32_t min, uint32_t sec) {
+    /* months from March: February (and its leap day) comes last */
+    if ((int32_t)(mon -= 2) <= 0) {
+        mon += 12;
+        year -= 1;
+    }
+
+    return ((((year / 4 - year / 100 + year / 400 + 367 * mon / 12 + day) +
+              year * 365 - 719499) * 24 + hour) * 60 + min) * 60 + sec;
+}
+
+
+/**
+ * @brief read the current count of PIT channel 0
+ * 
+ * @return uint32_t : the count left in this period
+ */
+static uint32_t pit_read(void) {
+    uint32_t lo, hi;
+
+    outb(PIT_LATCH_CMD, CMD_REG);
+    lo = inb(TIMER_CHANNEL);
+    hi = inb(TIMER_CHANNEL);
+    return (hi << 8) | lo;
+}
+
+
+/**
+ * @brief check whether the one-shot period has reached terminal count
+ * 
+ * @return int32_t : 1 if expired, 0 otherwise
+ */
+static int32_t oneshot_expired(void) {
+    outb(PIT_STATUS_CMD, CMD_REG);
+    return !!(inb(TIMER_CHANNEL) & PIT_OUT);
+}
+
+
+/**
+ * @brief check whether a timer interrupt is waiting in the master PIC
+ * 
+ * @return int32_t : 1 if pending, 0 otherwise
+ */
+static int32_t pit_irq_pending(void) {
+    outb(PIC_READ_IRR, PIC_MASTER_CMD);
+    return !!(inb(PIC_MASTER_CMD) & (1 << TIMER_IRQ));
 }
@@ -0,0 +1,396 @@
+/**
+ * @file timer.c
+ * @brief Kernel timers and the sleeping system calls built on them.
+ * @overview:
+ * Timers are kept in a hierarchical timer wheel (as in Linux 2.6). The
+ * first level has a slot for each of the next 256 ticks, the four other
+ * levels have 64 slots each, a slot of a level covering a whole turn of
+ * the level below. Adding and deleting a timer is a list operation; when
+ * the first level wraps around, the next slot of the second level is
+ * cascaded down into it (and so on for the higher levels).
+ *
+ * The wheel turns in the timer interrupt of the boot processor, once for
+ * every tick (1 ms) elapsed: with the tick stopped (see time.c), one
+ * interrupt may run several ticks. The next slot with a timer bounds how
+ * long the tick can be stopped (next_timer_event()).
+ *
+ */
+
+#include <drivers/timer.h>
+#include <drivers/time.h>
+#include <drivers/clocksource.h>
+#include <pro/process.h>
+#include <boot/smp.h>
+#include <spinlock.h>
+#include <errno.h>
+#include <lib.h>
+
+#define INDEX(n)  ((timer_jiffies >> (TVR_BITS + (n) * TVN_BITS)) & TVN_MASK)
+
+static list_head tv1[TVR_SIZE];                 /* the next 256 ticks */
+static list_head tvn[TVN_LEVELS][TVN_SIZE];     /* later ticks */
+static uint32_t timer_jiffies;                  /* next tick the wheel has to run */
+static DEFINE_SPINLOCK(timer_lock);             /* the wheel */
+
+static void internal_add_timer(timer_list *timer);
+static uint32_t cascade(uint32_t level, uint32_t index);
+static void timer_kick(timer_list *timer);
+static void sleep_timeout(uint32_t data);
+static void alarm_timeout(uint32_t data);
+
+
+/**
+ * @brief init the timer wheel
+ *
+ */
+void timer_init(void) {
+    uint32_t i, j;
+
+    for (i = 0; i < TVR_SIZE; ++i)
+        INIT_LIST_HEAD(&tv1[i]);
+
+    for (i = 0; i < TVN_LEVELS; ++i)
+        for (j = 0; j < TVN_SIZE; ++j)
+            INIT_LIST_HEAD(&tvn[i][j]);
+
+    timer_jiffies = sys_ticks;
+}
+
+
+/**
+ * @brief init a timer, which is not pending
+ *
+ * @param timer : timer
+ */
+void init_timer(timer_list *timer) {
+    timer->entry.next = NULL;
+    timer->entry.prev = NULL;
+}
+
+
+/**
+ * @brief start a timer. timer->function is called with timer->data in
+ * the first timer interrupt once sys_ticks reached timer->expires.
+ *
+ * @param timer : a timer that is not pending
+ */
+void add_timer(timer_list *timer) {
+    uint32_t flags;
+
+    spin_lock_irqsave(&timer_lock, flags);
+    internal_add_timer(timer);
+    spin_unlock_irqrestore(&timer_lock, flags);
+
+    timer_kick(timer);
+}
+
+
+/**
+ * @brief stop a timer. Callbacks run with the timer lock held, so once
+ * this returns the callback of the timer is not running either.
+ *
+ * @param timer : timer
+ * @return int32_t : 1 if the timer was pending, 0 otherwise
+ */
+int32_t del_timer(timer_list *timer) {
+    uint32_t flags;
+    int32_t ret = 0;
+
+    spin_lock_irqsave(&timer_lock, flags);
+    if (timer_pending(timer)) {
+        list_del(&timer->entry);
+        ret = 1;
+    }
+    spin_unlock_irqrestore(&timer_lock, flags);
+
+    return ret;
+}
+
+
+/**
+ * @brief (re)start a timer with a new expiration time
+ *
+ * @param timer : timer, pending or not
+ * @param expires : new expiration time in ticks
+ * @return int32_t : 1 if the timer was pending, 0 otherwise
+ */
+int32_t mod_timer(timer_list *timer, uint32_t expires) {
+    uint32_t flags;
+    int32_t ret = 0;
+
+    spin_lock_irqsave(&timer_lock, flags);
+    if (timer_pending(timer)) {
+        list_del(&timer->entry);
+        ret = 1;
+    }
+    timer->expires = expires;
+    internal_add_timer(timer);
+    spin_unlock_irqrestore(&timer_lock, flags);
+
+    timer_kick(timer);
+    return ret;
+}
+
+
+/**
+ * @brief run the expired timers, called by the timer interrupt of the
+ * boot processor with interrupts disabled
+ *
+ * @param now : current tick
+ */
+void run_timers(uint32_t now) {
+    list_head *head;
+    timer_list *timer;
+
+    spin_lock(&timer_lock);
+
+    while ((int32_t)(now - timer_jiffies) >= 0) {
+        head = &tv1[timer_jiffies & TVR_MASK];
+
+        /* first level wrapped: bring the next slot of the levels above down */
+        if (!(timer_jiffies & TVR_MASK) &&
+            !cascade(0, INDEX(0)) && !cascade(1, INDEX(1)) && !cascade(2, INDEX(2)))
+            cascade(3, INDEX(3));
+
+        ++timer_jiffies;
+
+        while (head->next != head) {
+            timer = list_entry(head->next, timer_list, entry);
+            list_del(&timer->entry);
+            timer->function(timer->data);
+        }
+    }
+
+    spin_unlock(&timer_lock);
+}
+
+
+/**
+ * @brief how many ticks from now the wheel has work to do: a slot with
+ * timers or a cascade. Read without the lock, a timer added meanwhile
+ * programs the tick again (see timer_kick()).
+ *
+ * @param max : ticks to look ahead at most
+ * @return uint32_t : ticks until the next timer event, 1 .. max
+ */
+uint32_t next_timer_event(uint32_t max) {
+    uint32_t j = timer_jiffies;
+    uint32_t i, ticks;
+    list_head *head;
+
+    for (i = 0; i < TVR_SIZE && (int32_t)(j - sys_ticks) < (int32_t)max; ++i, ++j) {
+        head = &tv1[j & TVR_MASK];
+        if (!(j & TVR_MASK) || head->next != head)
+            break;
+    }
+
+    ticks = j - sys_ticks;
+    if ((int32_t)ticks < 1) return 1;
+    return (ticks > max) ? max : ticks;
+}
+
+
+/**
+ * @brief nanoseconds => ticks, rounded up
+ *
+ * @param ns : nanoseconds
+ * @return uint32_t : ticks, at most a quarter turn of sys_ticks
+ */
+uint32_t ns_to_ticks(uint64_t ns) {
+    ns += TICKUNIT - 1;
+    do_div(&ns, TICKUNIT);
+    return (ns >> 30) ? 0x3fffffff : (uint32_t)ns;
+}
+
+
+/**
+ * @brief put the running task to sleep for some time. It leaves the run
+ * queue until the time is over or an alarm fires.
+ *
+ * @param ns : nanoseconds to sleep
+ * @param rem : nanoseconds left when interrupted by an alarm (may be NULL)
+ * @return int32_t : 0 when the time is over, -EINTR if interrupted
+ */
+int32_t do_nanosleep(uint64_t ns, uint64_t *rem) {
+    thread_t *curr;
+    timer_list timer;
+    uint64_t now, end;
+    uint32_t flags;
+    uint8_t alarm;
+
+    GETPRO(curr);
+
+    end = sched_clock() + ns;
+
+    init_timer(&timer);
+    timer.function = sleep_timeout;
+    timer.data = (uint32_t)curr;
+
+    /* an alarm that fired before the sleep interrupts nothing */
+    spin_lock_irqsave(&curr->timer_wait.lock, flags);
+    curr->timer_flags = 0;
+    spin_unlock_irqrestore(&curr->timer_wait.lock, flags);
+
+    /* sys_ticks lags behind while the tick is stopped and a long sleep 
+     * may not fit in the wheel: sleep again until the end is reached */
+    while ((now = sched_clock()) < end) {
+        /* one more tick: the current one has partly elapsed */
+        timer.expires = sys_ticks + ns_to_ticks(end - now) + 1;
+        add_timer(&timer);
+
+        wait_event(curr->timer_wait, curr->timer_flags);
+
+        del_timer(&timer);
+
+        /* the flags are set under the wait queue lock: an alarm firing 
+         * now is either seen here or wakes up the next wait_event */
+        spin_lock_irqsave(&curr->timer_wait.lock, flags);
+        alarm = curr->timer_flags & TIMER_ALARM;
+        curr->timer_flags &= ~TIMER_EXPIRED;
+        spin_unlock_irqrestore(&curr->timer_wait.lock, flags);
+
+        if (alarm) {
+            if (rem) {
+                now = sched_clock();
+                *rem = (now < end) ? end - now : 0;
+            }
+            return -EINTR;
+        }
+    }
+
+    return 0;
+}
+
+
+/**
+ * @brief arrange for an alarm in some seconds, replacing the previous
+ * one. There are no signals yet: an alarm interrupts a nanosleep() of
+ * the task, nothing else.
+ *
+ * @param seconds : seconds until the alarm, 0 cancels the pending one
+ * @return uint32_t : seconds that were left of the previous alarm, 0 if none
+ */
+uint32_t do_alarm(uint32_t seconds) {
+    thread_t *curr;
+    timer_list *timer;
+    uint32_t left = 0;
+
+    GETPRO(curr);
+    timer = &curr->real_timer;
+
+    if (del_timer(timer)) {
+        left = timer->expires - sys_ticks;
+        if ((int32_t)left <= 0)
+            left = 1;
+        else
+            left = (left + HZ - 1) / HZ;
+    }
+
+    if (seconds) {
+        if (seconds > ALARM_MAX)
+            seconds = ALARM_MAX;
+        timer->function = alarm_timeout;
+        timer->data = (uint32_t)curr;
+        mod_timer(timer, sys_ticks + seconds * HZ);
+    }
+
+    return left;
+}
+
+
+/**
+ * @brief put a timer in the slot of its expiration time. The timer
+ * lock must be held.
+ *
+ * @param timer : timer
+ */
+static void internal_add_timer(timer_list *timer) {
+    uint32_t expires = timer->expires;
+    uint32_t idx = expires - timer_jiffies;
+    uint32_t level;
+    list_head *vec;
+
+    if ((int32_t)idx < 0) {
+        /* already expired: the next tick runs it */
+        vec = &tv1[timer_jiffies & TVR_MASK];
+    } else if (idx < TVR_SIZE) {
+        vec = &tv1[expires & TVR_MASK];
+    } else {
+        for (level = 0; level < TVN_LEVELS - 1; ++level)
+            if (idx < 1U << (TVR_BITS + (level + 1) * TVN_BITS))
+                break;
+        vec = &tvn[level][(expires >> (TVR_BITS + level * TVN_BITS)) & TVN_MASK];
+    }
+
+    list_add_tail(&timer->entry, vec);
+}
+
+
+/**
+ * @brief move the timers of a slot of a level to the levels below
+ *
+ * @param level : 0 .. TVN_LEVELS - 1
+ * @param index : slot
+ * @return uint32_t : index, 0 if the level wrapped too
+ */
+static uint32_t cascade(uint32_t level, uint32_t index) {
+    list_head *head = &tvn[level][index];
+    timer_list *timer;
+
+    while (head->next != head) {
+        timer = list_entry(head->next, timer_list, entry);
+        list_del(&timer->entry);
+        internal_add_timer(timer);
+    }
+
+    return index;
+}
+
+
+/**
+ * @brief a new timer may expire before the tick of the boot processor,
+ * stopped for a longer period: program the tick again
+ *
+ * @param timer : timer just added
+ */
+static void timer_kick(timer_list *timer) {
+    if ((int32_t)(timer->expires - sys_ticks) > (int32_t)(TICK_MAX_NS / TICKUNIT))
+        return;
+
+    if (!smp_processor_id())
+        tick_program(sched_tick_length());
+    else
+        smp_send_reschedule(0);
+}
+
+
+/**
+ * @brief the time of a nanosleep() is over
+ *
+ * @param data : sleeping task
+ */
+static void sleep_timeout(uint32_t data) {
+    thread_t *task = (thread_t *)data;
+    uint32_t flags;
+
+    spin_lock_irqsave(&task->timer_wait.lock, flags);
+    task->timer_flags |= TIMER_EXPIRED;
+    spin_unlock_irqrestore(&task->timer_wait.lock, flags);
+    wake_up(&task->timer_wait);
+}
+
+
+/**
+ * @brief the alarm of a task fired
+ *
+ * @param data : task
+ */
+static void alarm_timeout(uint32_t data) {
+    thread_t *task = (thread_t *)data;
+    uint32_t flags;
+
+    spin_lock_irqsave(&task->timer_wait.lock, flags);
+    task->timer_flags |= TIMER_ALARM;
+    spin_unlock_irqrestore(&task->timer_wait.lock, flags);
+    wake_up(&task->timer_wait);
+}
@@ -5,6 +5,13 @@
 /* video memory pointer */
 char *video_mem = (char *)VIDEO;
 
+/* CRTC start address, the cursor position is counted from VIDEO too */
+static uint16_t vga_start = 0;
+
+/* a character with its attribute, one text mode cell */
+#define VGA_CELL(c)     ((uint16_t)(uint8_t)(c) | (ATTRIB << 8))
+#define VGA_BLANK2      (VGA_CELL(' ') | (VGA_CELL(' ') << 16))     /* two blank cells */
+
 
 /**
  * @brief init the vga driver
@@ -27,16 +34,34 @@ void vga_write(char *vidmem, uint8_t x, uint8_t y, int8_t c) {
 }
 
 
+/**
+ * @brief write a run of chars to one row of the screen, two cells per store
+ * 
+ * @param x : col position of the first char
+ * @param y : row position
+ * @param s : chars to write, x + n must not pass the end of the row
+ * @param n : number of chars
+ */
+void vga_write_run(char *vidmem, uint8_t x, uint8_t y, const int8_t *s, uint32_t n) {
+    uint16_t *cell = (uint16_t *)vidmem + VGA_WIDTH * y + x;
+
+    if (n && ((uint32_t)cell & 2)) {            /* align to a 4 byte boundary */
+        *cell++ = VGA_CELL(*s++);
+        n--;
+    }
+    for (; n >= 2; n -= 2, s += 2, cell += 2)
+        *(uint32_t *)cell = VGA_CELL(s[0]) | ((uint32_t)VGA_CELL(s[1]) << 16);
+    if (n)
+        *cell = VGA_CELL(*s);
+}
+
+
 /**
  * @brief clear the screen
  * 
  */
 void vga_clear(char *vidmem) {
-	int32_t i;
-    for (i = 0; i < VGA_HEIGHT * VGA_WIDTH; i++) {
-        *(uint8_t *)(vidmem + (i << 1)) = ' ';
-        *(uint8_t *)(vidmem + (i << 1) + 1) = ATTRIB;
-    }
+    memset_dword(vidmem, VGA_BLANK2, VGA_WIDTH * VGA_HEIGHT / 2);
 }
 
 
@@ -46,17 +71,21 @@ void vga_clear(char *vidmem) {
  * 
  */
 void vga_scrolling(char *vidmem) {
-	int32_t i;
+    vga_scroll(vidmem, 1);
+}
 
-    for (i = 0; i < VGA_WIDTH * (VGA_HEIGHT - 1); ++i) {
-        *(uint8_t *)(vidmem + (i << 1)) = *(uint8_t *)(vidmem + ((i + VGA_WIDTH) << 1));
-        *(uint8_t *)(vidmem + (i << 1) + 1) = ATTRIB;
-    }
 
-    for (i = VGA_WIDTH * (VGA_HEIGHT - 1); i < VGA_WIDTH * VGA_HEIGHT; ++i) {
-        *(uint8_t *)(vidmem + (i << 1)) = ' ';
-        *(uint8_t *)(vidmem + (i << 1) + 1) = ATTRIB;
-    }
+/**
+ * @brief vertical scrolling down the screen by several lines at once
+ * 
+ * @param lines : number of lines, the screen is cleared if it is not less than VGA_HEIGHT
+ */
+void vga_scroll(char *vidmem, uint32_t lines) {
+    if (lines > VGA_HEIGHT)
+        lines = VGA_HEIGHT;
+
+    memmove(vidmem, vidmem + ((VGA_WIDTH * lines) << 1), (VGA_WIDTH * (VGA_HEIGHT - lines)) << 1);
+    memset_dword(vidmem + ((VGA_WIDTH * (VGA_HEIGHT - lines)) << 1), VGA_BLANK2, VGA_WIDTH * lines / 2);
 }
 
 /**
@@ -99,6 +128,21 @@ void vga_disable_cursor(void) {
 
 
 
+/**
+ * @brief set the first cell shown on the screen (CRTC start address),
+ * the screen moves without copying video memory
+ * 
+ * @param offset : offset of the first cell from VIDEO, in cells
+ */
+void vga_set_start(uint16_t offset) {
+    vga_start = offset;
+	outb(0x0C, 0x3D4);
+	outb((uint8_t) ((offset >> 8) & 0xFF), 0x3D5);
+	outb(0x0D, 0x3D4);
+	outb((uint8_t) (offset & 0xFF), 0x3D5);
+}
+
+
 /**
  * @brief update cursor to row y and col y
  * 
@@ -106,7 +150,7 @@ void vga_disable_cursor(void) {
  * @param y : row position
  */
 void vga_update_cursor(uint8_t x, uint8_t y) {
-	uint16_t pos = y * VGA_WIDTH + x;
+	uint16_t pos = vga_start + y * VGA_WIDTH + x;
  
 	outb(0x0F, 0x3D4);
 	outb((uint8_t) (pos & 0xFF), 0x3D5);
@@ -0,0 +1,91 @@
+#ifndef _APIC_H_
+#define _APIC_H_
+
+#include <types.h>
+
+#define APIC_BASE           0xFEE00000      /* physical (and virtual) address of the local APIC */
+#define APIC_PDE            (APIC_BASE >> 22)   /* 4 MB page directory entry mapping it */
+
+/* local APIC registers, offsets from APIC_BASE */
+#define APIC_ID             0x020           /* bits 31:24: local APIC id */
+#define APIC_TPR            0x080           /* task priority */
+#define APIC_EOI            0x0B0           /* end of interrupt */
+#define APIC_SVR            0x0F0           /* spurious interrupt vector */
+#define APIC_ICR_LOW        0x300           /* interrupt command, writing it sends the IPI */
+#define APIC_ICR_HIGH       0x310           /* bits 31:24: destination APIC id */
+#define APIC_LVT_TIMER      0x320
+#define APIC_LVT_LINT0      0x350
+#define APIC_LVT_LINT1      0x360
+#define APIC_TIMER_INIT     0x380           /* initial count */
+#define APIC_TIMER_CUR      0x390           /* current count */
+#define APIC_TIMER_DIV      0x3E0           /* divide configuration */
+
+#define APIC_SVR_ENABLE     0x100           /* software enable */
+#define APIC_LVT_MASKED     0x10000
+#define APIC_TIMER_PERIODIC 0x20000
+#define APIC_DIV_16         0x3
+#define APIC_EXTINT         0x700           /* LINT0: let the 8259 deliver through this APIC */
+#define APIC_NMI            0x400
+
+/* interrupt command */
+#define ICR_INIT            0x500
+#define ICR_STARTUP         0x600
+#define ICR_FIXED           0x000
+#define ICR_LEVEL_ASSERT    0x4000
+#define ICR_LEVEL_TRIGGER   0x8000
+#define ICR_BUSY            0x1000          /* delivery status: send pending */
+#define ICR_ALL_BUT_SELF    0xC0000         /* destination shorthand */
+
+#define CPUID_APIC          0x200           /* cpuid(1).edx: on-chip local APIC */
+
+#define INIT_DELAY          11932           /* PIT counts in 10 ms */
+#define SIPI_DELAY          239             /* PIT counts in 200 us */
+
+/* vectors, above the ones of the 8259 and the system call */
+#define APIC_TIMER_INTR     0xEF
+#define RESCHEDULE_INTR     0xF0
+#define SPURIOUS_INTR       0xFF
+
+
+/**
+ * @brief read a local APIC register
+ *
+ * @param reg : register offset
+ * @return uint32_t : register value
+ */
+static inline uint32_t apic_read(uint32_t reg) {
+    return *(volatile uint32_t *)(APIC_BASE + reg);
+}
+
+
+/**
+ * @brief write a local APIC register
+ *
+ * @param reg : register offset
+ * @param val : value to write
+ */
+static inline void apic_write(uint32_t reg, uint32_t val) {
+    *(volatile uint32_t *)(APIC_BASE + reg) = val;
+}
+
+
+/**
+ * @brief acknowledge the interrupt being handled
+ *
+ */
+static inline void apic_eoi(void) {
+    apic_write(APIC_EOI, 0);
+}
+
+
+extern uint8_t apic_present;
+
+int32_t apic_init(void);
+void apic_setup(void);
+uint32_t apic_id(void);
+void apic_send_ipi(uint32_t apicid, uint32_t icr);
+void apic_broadcast_ipi(uint32_t icr);
+void do_apic_timer(void);
+void do_reschedule(void);
+
+#endif /* _APIC_H_ */
@@ -9,6 +9,9 @@
 void keyboard_handler(void);
 void rtc_handler(void);
 void timer_handler(void);
+void apic_timer_handler(void);
+void reschedule_handler(void);
+void spurious_handler(void);
 
 
 #endif /*_INTERRUPT_H_ */
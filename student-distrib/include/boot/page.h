@@ -9,18 +9,21 @@
 #define GETBIT_10           0x3FF
 #define VIDEO               0xB8000
 
-#define VIDEO_BUF_1         0xD0000
-#define VIDEO_BUF_2         0xD1000
-#define VIDEO_BUF_3         0xD2000
+#define VIDEO_VIEW          0xBB000         /* VGA text page after the terminals' screens, shows the scrollback */
 
 #define CR4_EXTENSION_FLAG  0x10
+#define CR4_GLOBAL_FLAG     0x80
 #define CR0_PAGE_FLAG       0x80000000
+#define CR0_WP_FLAG         0x10000         /* supervisor writes honour read-only PTEs */
 #define KERNEL_INDEX        1
 #define USER_MEM            0x8000000
 #define VIR_VID_MEM         0x8400000
 #define HEAP_START          0x8800000
 #define KERNEL_PAGES        16
-#define MAX_PHYS_PAGES      64
+#define KMAP_BEGIN          0x3F0000        /* temporary kernel window for user frames */
+#define KMAP_NR             4               /* pages of the window per processor (NR_CPUS of them) */
+#define DEMAND_PAGING       1               /* 1: areas are populated on first touch */
+#define FAULT_AROUND_PAGES  4               /* pages populated per fault, 1 disables fault-around */
 
 
 #define PTE_PRESENT 0x1
@@ -33,18 +36,25 @@
 #define PTE_PAT 0x80
 #define PDE_MB 0x80
 #define PTE_GLO 0x100
+#define PTE_COW 0x200       /* software bit: writable page shared by fork */
+
+#define PF_PROT  0x1        /* page fault error code: protection violation */
+#define PF_WRITE 0x2        /* page fault error code: caused by a write */
+#define PF_USER  0x4        /* page fault error code: from user mode */
 
 #define VM_EXEC 0x01
 #define VM_WRITE 0x02
 #define VM_READ 0x04
 #define VM_HEAP 0x08
 #define VM_STACK 0x010
+#define VM_IMAGE 0x020      /* segment of the program image */
 
 #define PTE_ADDR(x) ((x) >> 12)
 #define PDE_MB_ADDR(x) ((x) >> 22)
 
 #define ADDR_TO_PTE(a) ((a) & 0xFFFFF000)
 #define ADDR_TO_4MB(a) ((a) & 0xFFC00000)
+#define PAGE_ALIGN(a) (((a) + 0xFFF) & 0xFFFFF000)
 
 #define GETBIT_12(a) ((a) & 0xFFF )
 
@@ -59,18 +69,36 @@ typedef struct user_page_t {
     struct user_page_t* last;
 } user_page_t;
 
+extern pagedir_t cpu_pgdir[NR_CPUS];
+
+/* page directory loaded in CR3 of this processor */
+#define cur_pgdir   (cpu_pgdir[smp_processor_id()])
+
 void page_init();
 void enable_paging();
 void flush_tlb();
+void flush_tlb_page(uint32_t va);
+void set_pgdir(pagedir_t pgdir);
+pagedir_t pgdir_create(void);
+void pgdir_free(pagedir_t pgdir);
+void* kmap(uint32_t pa);
+void kunmap(void* p);
 
 void do_mmap(int size);
 
+uint32_t* _walk(pagedir_t pgdir, uint32_t va, uint32_t flags, int alloc);
+int __mmap(pagedir_t pgdir, uint32_t va, uint32_t pa, int size, int flags);
+int __freemap(pagedir_t pgdir, uint32_t va, int size);
 int mmap(uint32_t va, uint32_t pa, int size, int flags);
 int freemap(uint32_t va, int size);
 void free_uvmdir(int size);
 
 void process_vm_init(vmem_t* vm);
 int vmalloc(vm_area_t* vm, int incrsize, int flags);
+int vmreserve(vm_area_t* vm, int incrsize, int flags);
+int vmgrow_down(vm_area_t* vm, uint32_t newstart);
+int vmattach(vmem_t* vm, vm_area_t* area, uint32_t pa, int shared);
+int do_no_page(vmem_t* vm, uint32_t va);
 void vmdealloc(vm_area_t* vm, int decsize, int mapping);
 int vmcopy(vmem_t* dest, vmem_t* src);
 
@@ -79,13 +107,11 @@ int32_t do_vidmap(uint8_t **screen_start);
 void user_mem_init();
 uint32_t get_user_page(int order);
 void free_user_page(uint32_t addr, int order);
+void user_page_dup(uint32_t pa);
+void user_page_put(uint32_t pa);
+int user_page_count(uint32_t pa);
+uint32_t user_page_unshare(uint32_t pa);
+int do_wp_page(vmem_t* vm, uint32_t va);
 void show_mmap(vmem_t* vm);
 
-typedef struct pg_descriptor_t {
-    uint32_t flags;
-    int count;
-}pd_descriptor_t;
-
-
-
 #endif /* _PAGE_H */
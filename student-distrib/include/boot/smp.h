@@ -0,0 +1,43 @@
+#ifndef _SMP_H_
+#define _SMP_H_
+
+#include <types.h>
+#include <boot/x86_desc.h>
+
+#define AP_TRAMPOLINE       0x7000          /* real mode entry of the application processors */
+#define AP_SIPI_VECTOR      (AP_TRAMPOLINE >> 12)   /* startup IPI: start at vector * 4 KB */
+
+extern volatile uint32_t nr_cpus;           /* processors online */
+extern volatile uint32_t smp_started;       /* set once the run queues exist */
+extern tss_t *cpu_tss[NR_CPUS];             /* task state segment of each processor */
+extern uint8_t cpu_apic_id[NR_CPUS];        /* local APIC id of each processor */
+
+
+/**
+ * @brief number of the processor running this code. Every processor
+ * loads its own TSS, so the task register tells them apart (even on
+ * the boot stack, before any thread exists).
+ *
+ * @return uint32_t : 0 for the boot processor, 1 .. NR_CPUS - 1 otherwise
+ */
+static inline uint32_t smp_processor_id(void) {
+    uint32_t sel = store_tr();
+
+    if (sel == KERNEL_TSS) return 0;
+    return (sel - KERNEL_LDT) >> 3;
+}
+
+
+void smp_init(void);
+void ap_start(uint32_t cpu);
+void smp_send_reschedule(uint32_t cpu);
+
+/* implemented in trampoline.S */
+
+extern uint8_t ap_trampoline[];
+extern uint8_t ap_trampoline_end[];
+extern uint8_t ap_gdtr[];
+extern uint32_t ap_stacks[NR_CPUS];
+extern volatile uint32_t ap_count;
+
+#endif /* _SMP_H_ */
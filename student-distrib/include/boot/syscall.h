@@ -2,6 +2,8 @@
 #define _SYSCALL_H
 
 #include <types.h>
+#include <drivers/time.h>
+#include <pro/schedstat.h>
 
 #define SYSCALL 0x80
 #define asmlinkage __attribute__((regparm(0)))
@@ -34,6 +36,11 @@ asmlinkage void   *sys_sbrk(uint32_t size);
 asmlinkage int32_t sys_mmap(void *addr, uint32_t size);
 asmlinkage int32_t sys_munmap(void *addr);
 asmlinkage int32_t sys_stat(int8_t *info[]);
+asmlinkage int32_t sys_sched_setscheduler(pid_t pid, int32_t policy, int32_t priority);
+asmlinkage int32_t sys_nanosleep(const timespec *req, timespec *rem);
+asmlinkage uint32_t sys_alarm(uint32_t seconds);
+asmlinkage int32_t sys_clock_gettime(uint32_t clock, timespec *tp);
+asmlinkage int32_t sys_schedstat(schedstat_t *buf);
 
 
 
@@ -49,7 +56,6 @@ asmlinkage int32_t sys_stat(int8_t *info[]);
 // asmlinkage int32_t getgid(void);
 // asmlinkage int32_t kill(pid_t pid, int sig);
 // asmlinkage int32_t signal(int signum, sighandler_t handler);
-// asmlinkage int32_t alarm(unsigned int seconds);
 
 
 // /* -----------------------------Virtual Memory----------------------------- */
@@ -16,6 +16,12 @@
 #define KERNEL_TSS  0x0030
 #define KERNEL_LDT  0x0038
 
+/* Each application processor has its own TSS, following the LDT entry */
+#define AP_TSS(cpu) (KERNEL_LDT + ((cpu) << 3))
+
+/* Max number of processors brought up (the boot processor included) */
+#define NR_CPUS     4
+
 /* Size of the task state segment (TSS) */
 #define TSS_SIZE    104
 
@@ -128,6 +134,7 @@ extern uint32_t ldt;
 extern uint32_t tss_size;
 extern seg_desc_t tss_desc_ptr;
 extern tss_t tss;
+extern seg_desc_t ap_tss_desc_ptr[NR_CPUS - 1];
 
 /* Sets runtime-settable parameters in the GDT entry for the LDT */
 #define SET_LDT_PARAMS(str, addr, lim)                          \
@@ -180,6 +187,16 @@ do {                                                             \
 } while (0)
 
 
+/* Store task register: the selector of the TSS of this processor */
+#define store_tr()                      \
+({                                      \
+    uint32_t __sel;                     \
+    asm volatile ("str %w0"             \
+            : "=r" (__sel)              \
+    );                                  \
+    __sel & 0xFFFF;                     \
+})
+
 /* Load task register.  This macro takes a 16-bit index into the GDT,
  * which points to the TSS entry.  x86 then reads the GDT's TSS
  * descriptor and loads the base address specified in that descriptor
@@ -202,7 +219,7 @@ do {                                    \
 do {                                    \
     asm volatile ("lidt (%0)"           \
             :                           \
-            : "g" (desc)                \
+            : "r" (desc)                \
             : "memory"                  \
     );                                  \
 } while (0)
@@ -0,0 +1,32 @@
+#ifndef _CLOCKSOURCE_H_
+#define _CLOCKSOURCE_H_
+
+#include <types.h>
+
+#define NSEC_PER_SEC        1000000000UL
+
+#define PIT_CH2             0x42            /* PIT channel 2, gated by port 0x61 */
+#define PIT_GATE_PORT       0x61            /* bit 0: ch 2 gate, bit 1: speaker, bit 5: ch 2 output */
+#define PIT_CH2_ONESHOT     0xB0            /* binary, mode 0, LSB/MSB, ch 2 */
+#define CALIBRATE_LATCH     11932           /* PIT counts in 10 ms */
+#define CALIBRATE_NS        10000000ULL     /* 10 ms */
+
+#define CPUID_TSC           0x10            /* cpuid(1).edx: time-stamp counter present */
+
+/* a free running counter the kernel can tell time with */
+typedef struct {
+    const int8_t *name;
+    int32_t  rating;                        /* the best rated clocksource is used */
+    uint64_t (*read)(void);                 /* current value of the counter */
+    uint32_t mult;                          /* ns = (cycles * mult) >> shift */
+    uint32_t shift;
+    uint32_t khz;                           /* counter frequency, for display */
+} clocksource_t;
+
+void clocksource_init(void);
+void clocksource_register(clocksource_t *cs);
+void clocksource_update(void);
+uint64_t sched_clock(void);
+void pit_delay(uint32_t count);
+
+#endif /* _CLOCKSOURCE_H_ */
@@ -25,6 +25,8 @@
 #define L               0x26                /* L key */
 #define D               0x20                /* D key */
 #define Z               0x2c                /* C key */     
+#define PGUP            0x49                /* Page up key */
+#define PGDN            0x51                /* Page down key */
 
 
 extern const char scancodes[KEYBOARD_SIZE][2];
@@ -14,6 +14,7 @@
 #define RTC_MIN_freq 2
 #define prev_mask 0xF0
 #define rate_mask 0x0F
+#define RTC_PIE   0x40      /* register B: periodic interrupt enable */
 
 #define RTC_IRQ 8
 
@@ -22,6 +23,8 @@
 
 void rtc_init();
 void do_rtc();
+void rtc_get(void);
+void rtc_put(void);
 int32_t rtc_open(const int8_t* filename);
 int32_t rtc_close(int32_t fd);
 
@@ -2,9 +2,14 @@
 #define _TERMAINL_H
 
 #include <drivers/keyboard.h>
+#include <pro/wait.h>
+#include <spinlock.h>
 
 #define TERBUF_SIZE 128                 /* max buffer size */
 #define VIDMEM_SIZE 4096                /* video memory size */
+#define SCROLLBACK_LINES 200            /* lines kept after leaving the screen (8 screens) */
+#define SCROLLBACK_STEP 12              /* lines moved by Shift+PgUp/PgDn */
+#define LINE_SIZE 160                   /* bytes of one screen line */
 
 typedef struct {
     uint8_t capslock;                   /* 0 if capslock is not pressed, 1 otherwise. */
@@ -16,10 +21,16 @@ typedef struct {
     uint8_t size;                       /* The current size of the buffer. */
     uint8_t *buffer;                    /* Line buffer input. */
     uint8_t exit;                       /* A flag for stdin, 1 if \n is detected. */
+    uint8_t newline;                    /* a line was completed, its readers are not woken up yet */
     uint8_t screen_x;                   /* cursor column index */
     uint8_t screen_y;                   /* cursor row index */
-    char *vidmem;                    /* 4KB video memory for this terminal */ 
-    char *saved_vidmem;              /* saved video memory address for backing up */
+    char *vidmem;                       /* its own page of VGA memory, shown when displayed */ 
+    char *history;                      /* ring of lines scrolled off the screen */
+    uint16_t hist_head;                 /* next line of the ring to write */
+    uint16_t hist_size;                 /* number of lines in the ring */
+    uint16_t hist_view;                 /* lines the view is scrolled back, 0 when live */
+    wait_queue_head_t wait;             /* readers waiting for a complete line */
+    spinlock_t lock;                    /* the screen, the scrollback and the line buffer */
 } terminal_t;
 
 extern int8_t terminal_boot;
@@ -33,6 +44,8 @@ int32_t terminal_open(const int8_t *fname);
 int32_t terminal_close(int32_t fd);
 int32_t terminal_read(int32_t fd, void *buf, int32_t nbytes);
 int32_t terminal_write(int32_t fd, const void *buf, int32_t nbytes);
+void history_push(terminal_t *terminal, const char *line);
+char *history_line(terminal_t *terminal, uint32_t back);
 
 
 #endif /*_TERMAINL_H */
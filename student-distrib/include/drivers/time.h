@@ -1,6 +1,8 @@
 #ifndef _TIME_H_
 #define _TIME_H_
 
+#include <types.h>
+
 #define HZ                  1000            /* 100 timer interrupts per second (10 ms) */
 #define TICKUNIT            1000000UL       /* 1 ms = 1000,000 nanoseconds */
 #define CLOCK_TICK_RATE     1193182         /* 8254 chip's internal oscillator frequency */
@@ -9,6 +11,37 @@
 #define TIMER_CHANNEL   0x40
 #define TIMER_IRQ       0
 
+#define PIT_PERIODIC    0x34            /* binary, mode 2 (rate generator), LSB/MSB, ch 0 */
+#define PIT_ONESHOT     0x30            /* binary, mode 0 (interrupt on terminal count), LSB/MSB, ch 0 */
+#define PIT_LATCH_CMD   0x00            /* latch the count of ch 0 */
+#define PIT_STATUS_CMD  0xE2            /* read-back the status of ch 0 */
+#define PIT_OUT         0x80            /* status: output pin, set once a one-shot expired */
+#define PIC_READ_IRR    0x0A            /* OCW3: next read of the command port returns the IRR */
+#define PIT_MAX_COUNT   0xFFFF          /* largest count of a one-shot period */
+#define PIT_NS_X10      8381            /* nanoseconds per PIT count, times 10 */
+#define TICK_MAX_NS     ((PIT_MAX_COUNT * PIT_NS_X10) / 10)    /* ~55 ms */
+
+#define TICK_PERIODIC   0               /* PIT interrupts at HZ */
+#define TICK_ONESHOT    1               /* PIT runs a single longer period */
+#define TICK_STOPPED    2               /* the one-shot period has expired */
+
+/* CMOS real-time clock registers (the RTC keeps the date while powered off) */
+#define CMOS_SECONDS    0x00
+#define CMOS_MINUTES    0x02
+#define CMOS_HOURS      0x04
+#define CMOS_DAY        0x07
+#define CMOS_MONTH      0x08
+#define CMOS_YEAR       0x09
+#define CMOS_STATUS_A   0x0A
+#define CMOS_STATUS_B   0x0B
+#define CMOS_NMI_OFF    0x80            /* keep NMIs off while selecting a register */
+#define CMOS_UIP        0x80            /* status A: an update is in progress */
+#define CMOS_BINARY     0x04            /* status B: binary, not BCD */
+#define CMOS_24H        0x02            /* status B: 24 hour mode */
+#define CMOS_PM         0x80            /* hours: PM in 12 hour mode */
+
+#define bcd2bin(x)      (((x) & 0x0F) + ((x) >> 4) * 10)
+
 
 /* timer object */
 typedef struct {
@@ -28,15 +61,19 @@ typedef struct {
 
 typedef struct {
     /* stores the number of seconds that have elsaped since midnight of January 1 1970 (UTC) */
-    // tv_sec;
+    uint32_t tv_sec;
 
     /* stores the number of nanoseconds that have elapsed within the last second */
-    // tv_nsec;
+    uint32_t tv_nsec;
 } timespec;
 
 
 void pit_init(void);
 void do_timer(void);
+void scheduler_tick(void);
+void tick_program(uint64_t ns);
+uint64_t pit_clock_read(void);
+int32_t do_clock_gettime(uint32_t clock, timespec *tp);
 
 
 #endif /* _TIME_H_ */
@@ -0,0 +1,55 @@
+#ifndef _TIMER_H_
+#define _TIMER_H_
+
+#include <types.h>
+#include <list.h>
+
+/* the timer wheel: 256 slots of one tick, then 4 levels of 64 slots,
+ * each slot of a level covering a whole turn of the level below */
+#define TVR_BITS        8
+#define TVN_BITS        6
+#define TVR_SIZE        (1 << TVR_BITS)
+#define TVN_SIZE        (1 << TVN_BITS)
+#define TVR_MASK        (TVR_SIZE - 1)
+#define TVN_MASK        (TVN_SIZE - 1)
+#define TVN_LEVELS      4
+
+#define ALARM_MAX       2000000         /* seconds, keeps an alarm within half a turn of sys_ticks */
+
+/* the clocks of clock_gettime() */
+#define CLOCK_REALTIME  0               /* seconds since the epoch */
+#define CLOCK_MONOTONIC 1               /* time since boot */
+
+/* a function to be called once the tick count reaches expires */
+typedef struct timer_list {
+    list_head entry;                    /* in a slot of the wheel, next is NULL if not pending */
+    uint32_t  expires;                  /* in ticks (sys_ticks) */
+    void      (*function)(uint32_t);    /* called in the timer interrupt with the timer lock held */
+    uint32_t  data;                     /* argument of function */
+} timer_list;
+
+
+extern volatile uint32_t sys_ticks;
+
+/**
+ * @brief is the timer waiting in the wheel?
+ *
+ * @param timer : timer
+ * @return int32_t : 1 if pending, 0 otherwise
+ */
+static inline int32_t timer_pending(timer_list *timer) {
+    return timer->entry.next != NULL;
+}
+
+void timer_init(void);
+void init_timer(timer_list *timer);
+void add_timer(timer_list *timer);
+int32_t del_timer(timer_list *timer);
+int32_t mod_timer(timer_list *timer, uint32_t expires);
+void run_timers(uint32_t now);
+uint32_t next_timer_event(uint32_t max);
+uint32_t ns_to_ticks(uint64_t ns);
+int32_t do_nanosleep(uint64_t ns, uint64_t *rem);
+uint32_t do_alarm(uint32_t seconds);
+
+#endif /* _TIMER_H_ */
@@ -19,8 +19,11 @@ void vga_init(void);
 void vga_write(char *vidmem, uint8_t x, uint8_t y, int8_t c);
 void vga_clear(char *vidmem);
 void vga_scrolling(char *vidmem);
+void vga_scroll(char *vidmem, uint32_t lines);
+void vga_write_run(char *vidmem, uint8_t x, uint8_t y, const int8_t *s, uint32_t n);
 void vga_enable_cursor(uint8_t cursor_start, uint8_t cursor_end);
 void vga_disable_cursor(void);
 void vga_update_cursor(uint8_t x, uint8_t y);
+void vga_set_start(uint16_t offset);
 
 #endif /* _VGA_H_ */
@@ -0,0 +1,48 @@
+#ifndef _ELF_H_
+#define _ELF_H_
+
+#include <types.h>
+
+#define EI_NIDENT       16
+#define ELFMAG          "\177ELF"       /* magic number at e_ident[0..3] */
+#define SELFMAG         4
+#define ET_EXEC         2               /* executable file */
+#define EM_386          3               /* Intel 80386 */
+
+#define PT_LOAD         1               /* loadable segment */
+
+#define PF_X            0x1             /* segment is executable */
+#define PF_W            0x2             /* segment is writable */
+#define PF_R            0x4             /* segment is readable */
+
+/* ELF file header, at offset 0 of the file */
+typedef struct {
+    uint8_t  e_ident[EI_NIDENT];        /* magic number and other info */
+    uint16_t e_type;                    /* object file type */
+    uint16_t e_machine;                 /* architecture */
+    uint32_t e_version;                 /* object file version */
+    uint32_t e_entry;                   /* entry point virtual address */
+    uint32_t e_phoff;                   /* program header table file offset */
+    uint32_t e_shoff;                   /* section header table file offset */
+    uint32_t e_flags;                   /* processor-specific flags */
+    uint16_t e_ehsize;                  /* ELF header size in bytes */
+    uint16_t e_phentsize;               /* program header table entry size */
+    uint16_t e_phnum;                   /* program header table entry count */
+    uint16_t e_shentsize;               /* section header table entry size */
+    uint16_t e_shnum;                   /* section header table entry count */
+    uint16_t e_shstrndx;                /* section header string table index */
+} elf32_ehdr_t;
+
+/* program header, one per segment */
+typedef struct {
+    uint32_t p_type;                    /* segment type */
+    uint32_t p_offset;                  /* segment file offset */
+    uint32_t p_vaddr;                   /* segment virtual address */
+    uint32_t p_paddr;                   /* segment physical address */
+    uint32_t p_filesz;                  /* segment size in file */
+    uint32_t p_memsz;                   /* segment size in memory */
+    uint32_t p_flags;                   /* segment flags */
+    uint32_t p_align;                   /* segment alignment */
+} elf32_phdr_t;
+
+#endif /* _ELF_H_ */
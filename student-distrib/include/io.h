@@ -18,6 +18,9 @@ void test_interrupts(void);
 void back(terminal_t *terminal);
 int32_t fputs(int32_t fd, const int8_t* s);
 void _putc(uint8_t c, terminal_t* terminal);
+void putbuf(const int8_t* buf, int32_t n);
+void _putbuf(const int8_t* buf, int32_t n, terminal_t* terminal);
+void __putbuf(const int8_t* buf, int32_t n, terminal_t* terminal);
 
 void panic(int8_t* s);
 #endif /* _IO_T */
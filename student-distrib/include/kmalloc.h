@@ -1,14 +1,19 @@
 #ifndef _KMALLOC_H
 #define _KMALLOC_H
 
+#include <list.h>
+#include <spinlock.h>
+#include <boot/multiboot.h>
+
 #define RESERVED_PAGES 2
 #define USER_START_ADDR 0x80000000
 #define MAX_ORDER 11
 
-#define SLAB_SIZE 0x08
-
-#define MAX_BMSIZE 224
-#define BIT_MAP_COMP(x) (1L << (x % 32))
+#define CACHE_LINE 64            /* alignment of hot objects */
+#define KMALLOC_MIN 16           /* smallest kmalloc size class */
+#define KMALLOC_MAX 2048         /* largest kmalloc size class, bigger requests get pages */
+#define SLAB_MIN_OBJS 8          /* a slab grows until it holds this many objects */
+#define MAX_MEM_RANGES 16        /* usable ranges kept from the boot memory map */
 
 
 struct mem_block
@@ -23,55 +28,81 @@ typedef struct dmem_t {
 } dmem_t;
 
 
-struct buddy
-{
-    struct buddy* next;
-    struct buddy* last;
-    uint32_t addr; /* used in user memory alloc */
-};
-typedef struct buddy buddy;
-
-typedef struct free_area_t {
-    buddy* free_list;
-    uint32_t* bit_map;
-    int bmsize;
-    uint32_t start_addr;
-    int user;
-} free_area_t;
-
-typedef struct page_header_t {
-    int addr;
-    int order;
-    struct page_header_t* next;
-} page_header_t;
-
-typedef struct slab_t {
-    int size;
-    int status;
-    struct slab_t* last;
-    struct slab_t* next;
-} slab_t;
+/* owner of a frame */
+#define PG_NONE  0      /* tail frame of a block, or handed out by get_page() */
+#define PG_PAGE  1      /* head of a block handed out by kmalloc() */
+#define PG_SLAB  2      /* part of a slab */
+#define PG_BUDDY 3      /* head of a free block in a buddy free list */
+
+/* descriptor of a frame, indexed by frame number in its zone */
+typedef struct page_t {
+    list_head list;     /* node in a buddy free list (PG_BUDDY only) */
+    uint8_t order;      /* order of the block starting at this frame */
+    uint8_t owner;      /* PG_NONE, PG_PAGE, PG_SLAB or PG_BUDDY */
+    uint16_t count;     /* number of mappings, user frames only */
+} page_t;
+
+/* usable physical frames [first, last) */
+typedef struct mem_range {
+    uint32_t first;
+    uint32_t last;
+} mem_range_t;
+
+extern mem_range_t mem_ranges[MAX_MEM_RANGES];
+extern int nr_mem_ranges;
+extern uint32_t max_pfn;
+
+/* a range of physical frames managed by a buddy allocator */
+typedef struct zone {
+    uint32_t start;                     /* address of the first frame, 4MB aligned */
+    uint32_t nr_frames;                 /* number of frames */
+    page_t* mem_map;                    /* one descriptor per frame */
+    list_head free_list[MAX_ORDER];     /* free blocks of order 0 .. MAX_ORDER - 1 */
+    uint32_t free_mask;                 /* bit k is set if free_list[k] is not empty */
+    spinlock_t lock;                    /* protects the free lists */
+} zone_t;
+
+/* object cache, every slab holds objects of one size */
+typedef struct kmem_cache {
+    const int8_t* name;         /* name of the cache */
+    uint32_t size;              /* object size, rounded up to align */
+    uint32_t align;             /* object alignment */
+    void (*ctor)(void*);        /* called once for every new object, may be NULL */
+    int order;                  /* a slab is 2^order pages */
+    uint32_t num;               /* objects per slab */
+    uint32_t offset;            /* offset of the first object in a slab */
+    list_head slabs_partial;    /* slabs with used and free objects */
+    list_head slabs_full;       /* slabs without free objects */
+    list_head slabs_free;       /* slabs without used objects */
+    list_head next;             /* list of all caches */
+    spinlock_t lock;            /* protects the slab lists, taken before the zone lock */
+} kmem_cache_t;
+
+/* header at the start of every slab, followed by the free index array */
+typedef struct kmem_slab {
+    list_head list;             /* node in one of the cache's slab lists */
+    kmem_cache_t* cache;        /* cache owning this slab */
+    uint32_t inuse;             /* number of allocated objects */
+    int32_t free;               /* index of the first free object, -1 if full */
+} kmem_slab_t;
 
 void kmalloc_init(void);
 void* kmalloc(int size);
 void kfree(void* p);
+void zone_init(zone_t* z, uint32_t start, uint32_t nr_frames, page_t* mem_map);
+void zone_free_range(zone_t* z, uint32_t first, uint32_t last);
+void zone_free_usable(zone_t* z);
+void mem_detect(multiboot_info_t* mbi);
+void* boot_alloc(uint32_t size);
+int32_t __get_pages(zone_t* z, int order);
+void __free_pages(zone_t* z, uint32_t pfn, int order);
 void* get_page(int order);
 void free_page(void* p, int order);
-void _free_page(free_area_t* area, buddy* b, int order);
-
-void slab_init(void);
-void* slab_alloc(int size);
-void slab_free(slab_t* p);
-
-void free_list_init(int order);
-void free_list_push(buddy* fl, buddy* b);
-buddy* free_list_pop(buddy* fl);
-buddy* buddy_split(free_area_t* area, buddy* b, int cur_order, int tar_order);
-int buddy_size(int order);
-int is_split(free_area_t* area, buddy* b, int order);
-void flip_bit_map(free_area_t* area, buddy* b, int order);
-int is_left_buddy(free_area_t* area, buddy* b, int order);
-buddy* remove_from_free(free_area_t* area, buddy* fl, buddy* b, int order);
+
+kmem_cache_t* kmem_cache_create(const int8_t* name, uint32_t size, uint32_t align, void (*ctor)(void*));
+void* kmem_cache_alloc(kmem_cache_t* cache);
+void kmem_cache_free(kmem_cache_t* cache, void* obj);
+
 
 
 #endif /* _KMALLOC_H */
@@ -168,6 +168,38 @@ do {                                    \
     );                                  \
 } while (0)
 
+/* Find first set bit
+ * Returns the 1-based index of the least significant set bit
+ * of x, 0 if x is 0 */
+static inline int32_t ffs(uint32_t x) {
+    int32_t r;
+    if (!x) return 0;
+    asm volatile ("bsfl %1, %0" : "=r"(r) : "rm"(x) : "cc");
+    return r + 1;
+}
+
+/* Divide the 64-bit *n by base in place (no libgcc here)
+ * Returns the remainder */
+static inline uint32_t do_div(uint64_t *n, uint32_t base) {
+    uint32_t hi = (uint32_t)(*n >> 32);
+    uint32_t lo = (uint32_t)*n;
+    uint32_t qhi = 0, rem;
+    if (hi >= base) {
+        qhi = hi / base;
+        hi %= base;
+    }
+    asm ("divl %4" : "=a"(lo), "=d"(rem) : "0"(lo), "1"(hi), "rm"(base) : "cc");
+    *n = ((uint64_t)qhi << 32) | lo;
+    return rem;
+}
+
+/* Read the time-stamp counter */
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
 #endif /* _LIB_H */
 
 
@@ -14,12 +14,6 @@ do {                                            \
 } while (0)
 
 
-typedef struct _list {
-    struct _list *next;
-    struct _list *prev;
-} list_head;
-
-
 static inline void __brk__(void) {
 
 }
@@ -41,6 +35,11 @@ static inline void __list_valid(list_head *list) {
 #define LIST_HEAD(name) \
     list_head name = LIST_HEAD_INIT(name)
 
+static inline void INIT_LIST_HEAD(list_head *list) {
+    list->next = list;
+    list->prev = list;
+}
+
 static inline void __list_add(list_head *new,
                 list_head *prev,
                 list_head *next) {
@@ -82,6 +81,19 @@ static inline int32_t list_empty(list_head *head) {
     return head->next == head;
 }
 
+/* move the entries of list to the tail of head, list is left empty */
+static inline void list_splice_tail_init(list_head *list, list_head *head) {
+    __list_valid(head);
+    if (list_empty(list))
+        return;
+
+    list->next->prev = head->prev;
+    head->prev->next = list->next;
+    list->prev->next = head;
+    head->prev = list->prev;
+    INIT_LIST_HEAD(list);
+}
+
 #define list_for_each(pos, head) \
     for (pos = (head)->next; pos != (head); pos = pos->next)
 
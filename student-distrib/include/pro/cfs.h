@@ -4,6 +4,8 @@
 #include <types.h>
 #include <list.h>
 #include <rbtree.h>
+#include <spinlock.h>
+#include <boot/smp.h>
 
 /* sets a target for is approximation of the "infinitely small" 
  * scheduling duration in perfect multitasking */
@@ -25,7 +27,14 @@
 
 #define WMULT_SHIFT         32               
 
-/* walk up scheduling entities hierarchy (NOT USED IN THIS VERSION) */
+/* run queue of a processor */
+#define cpu_rq(cpu)         (runqueues[(cpu)])
+
+/* run queue of the processor running this code */
+#define this_rq()           cpu_rq(smp_processor_id())
+
+/* walk up scheduling entities hierarchy: a task, then the group entity
+ * of its console (if any) in the root queue */
 #define for_each_sched(se) \
 		for (; se; se = se->parent)
 
@@ -41,8 +50,10 @@ typedef struct {
 } weight_t;
 
 
-/* sched process info */
-typedef struct {
+struct cfs_rq;
+
+/* sched process info, also used as the entity of a task group */
+typedef struct sched {
     rb_node  node;              /* a red-block tree node for this thread */
     list_head wait_node;        /* use linked list of nodes to store waiting tasks*/
     weight_t load;              /* calculated load weight of each particle combined into one entity */
@@ -51,6 +62,9 @@ typedef struct {
     uint64_t sum_exec_time;     /* time the process has been running in total */
     uint64_t prev_sum_exec_time;/* used for storing the previous run time of a process */
     int8_t   on_rq;             /* does the process on runqueue now? */
+    struct sched *parent;       /* entity of the group this one runs in, NULL in the root queue */
+    struct cfs_rq *cfs_rq;      /* queue this entity is (or will be) put on */
+    struct cfs_rq *my_q;        /* queue owned by a group entity, NULL for a task */
 } sched_t;
 
 
@@ -71,19 +85,38 @@ typedef struct {
  * it is the leftmost element, because the tree is sorted based on 
  * vruntime of processes (smaller vruntime means sooner execution).
  */
-typedef struct {
+typedef struct cfs_rq {
     weight_t load;          /* sum of weights of all tasks in the queue */
     uint32_t nr_running;    /* number of runnable tasks in the queue */
+    uint32_t h_nr_running;  /* root queue: runnable tasks in the queue and in all groups below */
     uint64_t min_vruntime;  /* current min vruntime in the queue */
     uint64_t clock;         /* time clock in nanosecond */
     rb_root rb_tree;        /* root of the red-black tree*/
     rb_node *left_most;     /* current leftmost red-black tree node */
     sched_t *current;       /* current running task's sched info (NULL when no process is running) */
+    spinlock_t lock;        /* protects the queue, taken with interrupts disabled */
+    uint32_t cpu;           /* processor of the queue (the lock of its root queue is used) */
+    struct thread *running; /* root queue: task running on the processor (any class), NULL while idle */
 } cfs_rq;
 
 
+/* Group scheduling:
+ *
+ * Each console is a task group. A group has one entity in the root queue
+ * of every processor, weighted as a nice 0 task, and its own queue there
+ * holding the tasks of the console. The root queue shares the CPU between
+ * the groups (and the tasks without a console), each group then shares
+ * its part between its tasks, so a console running many tasks does not
+ * slow down the others.
+ */
+typedef struct {
+    sched_t se[NR_CPUS];    /* entity of the group in the root queue of each processor */
+    cfs_rq  rq[NR_CPUS];    /* queue of the tasks of the group on each processor */
+} task_group;
+
+
 
-extern cfs_rq *rq;
+extern cfs_rq *runqueues[NR_CPUS];
 extern const uint32_t sched_prio_to_weight[40];
 extern const uint32_t sched_prio_to_wmult[40];
 
@@ -91,7 +124,8 @@ extern const uint32_t sched_prio_to_wmult[40];
 void sched_init(void);
 void schedule(void);
 void pause(void);
- void enqueue_entity(sched_t *s, int8_t wakeup);
+void enqueue_entity(cfs_rq *rq, sched_t *s, int8_t wakeup);
+task_group *sched_group_create(void);
 
 
 #endif /* _CFS_H_ */
@@ -3,11 +3,20 @@
 
 #include <pro/process.h>
 
-#define PID_SIZE    0x8000    /* Total bits of a 4KB page */
-#define BITMAP_SIZE 0x1000    /* 0x8000 / 8 */
+#define PID_SIZE        0x8000                      /* Total bits of a 4KB page */
+#define BITS_PER_WORD   32
+#define PIDMAP_WORDS    (PID_SIZE / BITS_PER_WORD)  /* 1024 words of the bitmap */
+#define RESERVED_PIDS   2                           /* 0, 1 are the idle and init process */
 
-pid_t alloc_pid();
-pid_t kill_pid();
-void pidmap_init();
+#define PIDHASH_BITS    8
+#define PIDHASH_SIZE    (1 << PIDHASH_BITS)         /* buckets of the pid hash table */
+#define pid_hashfn(pid) ((pid) & (PIDHASH_SIZE - 1))
+
+int32_t alloc_pid(void);
+void free_pid(pid_t pid);
+void pidmap_init(void);
+void attach_pid(thread_t *task);
+void detach_pid(thread_t *task);
+thread_t *find_task_by_pid(pid_t pid);
 
 #endif
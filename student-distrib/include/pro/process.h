@@ -5,7 +5,12 @@
 #include <drivers/terminal.h>
 #include <access.h>
 #include <pro/cfs.h>
+#include <pro/rt.h>
+#include <pro/schedstat.h>
+#include <pro/wait.h>
+#include <drivers/timer.h>
 #include <list.h>
+#include <kmalloc.h>
 
 
 #define ARGSIZE         33              /* max size of a command argument*/           
@@ -18,17 +23,23 @@
 #define NICE_SHELL      5              /* nice value for shell process */
 #define NICE_NORMAL     0               /* nice value for default process */
 #define NTERMINAL       3               /* max number of terminals supported */
-#define MAXCHILDREN     100             /* default max number of children for a process */
 #define STACK           2042            /* CPU pushs user registers on stack starting at this offset */
 #define USEREIP         2042            /* CPU pre-pushed user eip needed to be copied */
 #define USERESP         2045            /* CPU pre-pushed user esp needed to be copied */
 #define KSTACK_SIZE     2048            /* 2048 word */
 
 #define task_of(ptr)  container_of(ptr, thread_t, sched_info)
+#define rt_task_of(ptr)  container_of(ptr, thread_t, rt_info)
+
+/* does the task belong to the real-time class? */
+#define rt_task(t)    ((t)->policy != SCHED_NORMAL)
 
 #define NEED_RESCHED    1               /* flag used for rescheduling */
 #define WAKEUP          2               /* flag used for waking up */
 
+#define TIMER_EXPIRED   1               /* timer_flags: the time of a nanosleep() is over */
+#define TIMER_ALARM     2               /* timer_flags: the alarm fired */
+
 typedef enum { UNUSED, RUNNING, RUNNABLE, SLEEPING, EXITED, ZOMIBIE } pro_state;
 
 
@@ -61,6 +72,13 @@ do {                                                  \
 } while (0)                                                  \
 
 
+/* argument vector with its strings, allocated from argv_cachep */
+typedef struct {
+    int8_t *argv[MAXARGS + 1];          /* NULL terminated argument list */
+    int8_t buf[MAXARGS][ARGSIZE];       /* storage of the arguments */
+} argv_t;
+
+
 /* hardware context (callee saved registers and part of segment registers) */
 typedef struct {
     uint32_t eip;
@@ -84,6 +102,7 @@ typedef struct vm_area {
 } vm_area_t;
 
 typedef struct vmem {
+    uint32_t            *pgdir;         /* page directory of this address space */
     struct vm_area      *map_list;
     uint32_t            size;
     uint32_t            file_length;
@@ -97,6 +116,7 @@ typedef struct thread {
     list_head          task_node;       /* a list of all tasks  */
     list_head          wait_node;       /* a list of all sleeping tasks */
     list_head          run_node;        /* a list of all runnable tasks */
+    list_head          pid_node;        /* in the pid hash table */
     volatile uint32_t  count;           /* time slice for a task */
     sched_t            sched_info;      /* info used for scheduler */
     volatile pro_state state;	        /* process state */
@@ -105,9 +125,8 @@ typedef struct thread {
     int8_t             **argv;          /* user command line argument */
     pid_t              pid;             /* process id number */
     struct thread      *parent;         /* parent process addr */
-    struct thread      **children;      /* child process addr */
-    uint64_t           n_children;      /* number of children */
-    uint64_t           max_children;    /* max number of children */
+    list_head          children;        /* child processes, linked by sibling, the newest last */
+    list_head          sibling;         /* in the children list of the parent */
     context_t          *context;        /* hardware context */
     uint32_t           usreip;          /* user eip */
     uint32_t           usresp;          /* user esp */
@@ -118,6 +137,14 @@ typedef struct thread {
     uint32_t           console_id;      /* console for this thread */
     int32_t            nice;            /* nice value */
     uint8_t            **user_vidmap;
+    uint32_t           cpu;             /* processor whose run queue holds this thread */
+    volatile uint8_t   on_cpu;          /* 1 from being picked until its context is saved */
+    uint32_t           policy;          /* SCHED_NORMAL, SCHED_FIFO or SCHED_RR */
+    sched_rt_t         rt_info;         /* info used by the real-time class */
+    timer_list         real_timer;      /* timer of alarm() */
+    wait_queue_head_t  timer_wait;      /* sleeping in nanosleep() */
+    volatile uint8_t   timer_flags;     /* TIMER_EXPIRED, TIMER_ALARM */
+    sched_stat_t       stats;           /* scheduling statistics */
 } thread_t;
 
 
@@ -128,6 +155,7 @@ typedef struct {
     thread_t *task;
     uint8_t* vidmap;
     uint32_t intr_flag;       /* interrupt CLI/STI flag */
+    task_group *tg;           /* scheduling group of the tasks of this console */
 } console_t;
 
 
@@ -141,32 +169,40 @@ typedef union {
 extern thread_t *idle;
 extern thread_t *init;
 extern list_head task_queue;  
+extern spinlock_t tasklist_lock;
 extern list_head wait_queue;
 extern console_t **consoles;
 extern console_t *current;
 
+extern kmem_cache_t *context_cachep;
+extern kmem_cache_t *argv_cachep;
+extern kmem_cache_t *files_cachep;
+extern kmem_cache_t *terminal_cachep;
+extern kmem_cache_t *vm_area_cachep;
+
 void swapper(void);
+void proc_caches_init(void);
 void init_task(void);
 void inline context_switch(thread_t *prev, thread_t *next);
 void process_free(thread_t *current);
 
 void do_exit(uint32_t status);
 int32_t do_execv(thread_t *curr, const int8_t *pathname, int8_t *const argv[]);
-int32_t do_fork(thread_t *parent, uint8_t kthread);
-int32_t do_execute(thread_t *parent, const int8_t *cmd);
+int32_t do_fork(thread_t *parent, uint8_t kthread, thread_t **childp);
+void wake_up_new_task(thread_t *child);
+int32_t do_execute(thread_t *parent, const int8_t *cmd, thread_t **childp);
 pid_t do_getpid(void);
 void *do_sbrk(uint32_t size);
 
 uint32_t get_esp0(thread_t *curr);
 int32_t file_init(int32_t fd, file_t *file, dentry_t *dentry, file_op *op, thread_t *curr);
-thread_t **children_create(void);
 
 /* implemented in fs.c */
 
 int32_t pro_loader(const int8_t *fname, uint32_t *EIP, thread_t* curr);
 
 /* implemented in switch.S */
-void swtch(context_t *prev, context_t *next);
+void swtch(context_t *prev, context_t *next, volatile uint8_t *prev_on_cpu);
 
 /* implemented in access.c */
 
@@ -194,7 +230,10 @@ void sched_wakeup(thread_t *from, thread_t *task);
 void enqueue_task(thread_t *new, int8_t wakeup);
 void sched_exit(thread_t *child, thread_t *parent);
 void activate_task(thread_t *task);
-void wakeup_preempt(thread_t *task);
+void set_curr_task(thread_t *task);
+void try_to_wake_up(thread_t *task);
 void task_tick(thread_t *curr);
+uint64_t sched_tick_length(void);
+int32_t sched_setscheduler(thread_t *task, uint32_t policy, uint32_t priority);
 
 #endif /* _PROCESS_H_ */
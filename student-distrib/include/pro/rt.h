@@ -0,0 +1,65 @@
+#ifndef _RT_H_
+#define _RT_H_
+
+#include <types.h>
+#include <list.h>
+#include <boot/x86_desc.h>
+
+/* scheduling policies */
+#define SCHED_NORMAL        0               /* completely fair scheduler */
+#define SCHED_FIFO          1               /* real-time, runs until it blocks or yields to a higher priority */
+#define SCHED_RR            2               /* real-time, round robin within a priority */
+
+#define MAX_RT_PRIO         32              /* real-time priorities 1 (lowest) .. 31 */
+
+#define RR_TIMESLICE        10000000ULL     /* 10 ms */
+
+/* real-time tasks may use RT_RUNTIME of every RT_PERIOD while fair tasks wait */
+#define RT_PERIOD           1000000000ULL   /* 1 s */
+#define RT_RUNTIME          950000000ULL    /* 0.95 s */
+
+/* run queue of a processor for real-time tasks */
+#define cpu_rt_rq(cpu)      (rt_runqueues[(cpu)])
+
+
+/* real-time info of a task */
+typedef struct {
+    list_head run_node;         /* in the queue of its priority */
+    uint32_t  priority;         /* 1 .. MAX_RT_PRIO - 1, higher runs first */
+    uint64_t  time_slice;       /* SCHED_RR: nanoseconds left of the slice */
+    uint64_t  exec_start;       /* time when the task started running */
+    int8_t    on_rq;            /* is the task on the run queue? */
+} sched_rt_t;
+
+
+/* Real-time run queue:
+ *
+ * One list per priority and a bitmap of the non empty lists, so the
+ * highest priority is found with one bit scan. A list holds the running
+ * task too, at its head: a preempted SCHED_FIFO task goes on first again.
+ * Lists are indexed by MAX_RT_PRIO - 1 - priority, so the lowest set bit
+ * is the highest priority.
+ */
+typedef struct {
+    list_head queue[MAX_RT_PRIO];   /* runnable tasks of each priority */
+    uint32_t bitmap;                /* bit i is set if queue[i] is not empty */
+    uint32_t rt_nr_running;         /* runnable real-time tasks, the running one included */
+    uint64_t rt_time;               /* time used by real-time tasks in this period */
+    uint64_t period_start;          /* start of the current period */
+    uint8_t  rt_throttled;          /* RT_RUNTIME used up: fair tasks go first */
+} rt_rq;
+
+
+extern rt_rq *rt_runqueues[NR_CPUS];
+
+struct thread;
+
+void rt_init(void);
+void enqueue_rt_task(rt_rq *rt, struct thread *task);
+void dequeue_rt_task(rt_rq *rt, struct thread *task);
+struct thread *pick_next_rt_task(rt_rq *rt, uint32_t nr_fair);
+void put_prev_rt_task(rt_rq *rt, struct thread *prev);
+int32_t task_tick_rt(rt_rq *rt, struct thread *curr, uint32_t nr_fair);
+int32_t check_preempt_rt(struct thread *curr, struct thread *task);
+
+#endif /* _RT_H_ */
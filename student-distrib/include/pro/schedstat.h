@@ -0,0 +1,57 @@
+#ifndef _SCHEDSTAT_H_
+#define _SCHEDSTAT_H_
+
+#include <types.h>
+#include <boot/smp.h>
+
+/* log2 histograms of microseconds: bucket 0 counts [0, 2) us, bucket i
+ * [2^i, 2^(i+1)) us, the last one everything from 2^(NR_HIST-1) us (~0.5 s) */
+#define NR_HIST             20
+
+/* run queue depth: 0 .. NR_DEPTH - 1 waiting tasks, the last bucket is NR_DEPTH - 1 or more */
+#define NR_DEPTH            16
+
+/* statistics of a processor */
+#define cpu_schedstat(cpu)  (&schedstats[(cpu)])
+
+
+/* scheduling statistics of a task */
+typedef struct {
+    uint64_t wait_start;        /* time the task was put on a run queue */
+    uint64_t run_start;         /* time the task started running */
+    uint64_t wait_sum;          /* time spent waiting on a run queue */
+    uint64_t wait_max;          /* longest wait on a run queue */
+    uint32_t nr_runs;           /* times the task was picked */
+    uint32_t nr_wakeups;        /* times the task was woken up */
+    uint32_t nr_voluntary;      /* switches because the task slept or exited */
+    uint32_t nr_involuntary;    /* switches because the task was preempted */
+    uint8_t  woken;             /* waiting since a wakeup */
+} sched_stat_t;
+
+
+/* scheduling statistics of a processor, the sum of all processors is
+ * handed to user space (see sys_schedstat) */
+typedef struct {
+    uint32_t wakeup[NR_HIST];   /* wakeup latency: woken up => running */
+    uint32_t wait[NR_HIST];     /* time on a run queue before running */
+    uint32_t slice[NR_HIST];    /* time running before a switch */
+    uint32_t depth[NR_DEPTH];   /* waiting tasks, sampled on every tick */
+    uint32_t nr_switches;       /* context switches */
+    uint32_t nr_voluntary;      /* switches because the task slept or exited */
+    uint32_t nr_involuntary;    /* switches because the task was preempted */
+    uint32_t nr_wakeups;        /* tasks woken up */
+} schedstat_t;
+
+
+extern schedstat_t schedstats[NR_CPUS];
+
+struct thread;
+
+void schedstat_init_task(struct thread *task);
+void schedstat_enqueue(struct thread *task, uint64_t now);
+void schedstat_wakeup(struct thread *task, uint64_t now);
+void schedstat_switch(uint32_t cpu, struct thread *prev, struct thread *next, uint64_t now);
+void schedstat_tick(uint32_t cpu, uint32_t depth);
+int32_t do_schedstat(schedstat_t *buf);
+
+#endif /* _SCHEDSTAT_H_ */
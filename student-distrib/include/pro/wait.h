@@ -0,0 +1,41 @@
+#ifndef _WAIT_H_
+#define _WAIT_H_
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+
+/* a list of tasks sleeping until some event happens */
+typedef struct {
+    list_head task_list;            /* waiting thread_t, linked by wait_node */
+    spinlock_t lock;                /* protects task_list */
+} wait_queue_head_t;
+
+#define __WAIT_QUEUE_HEAD_INITIALIZER(name) \
+    { { &(name).task_list, &(name).task_list }, __SPIN_LOCK_UNLOCKED }
+
+#define DECLARE_WAIT_QUEUE_HEAD(name) \
+    wait_queue_head_t name = __WAIT_QUEUE_HEAD_INITIALIZER(name)
+
+/**
+ * @brief sleep on queue q until condition becomes true. The condition is
+ * checked with the queue locked, so a wake_up() from an interrupt handler
+ * or another processor can not be lost between the check and going to sleep.
+ *
+ * @param q : wait queue head
+ * @param condition : expression evaluated every time the task wakes up
+ */
+#define wait_event(q, condition)                \
+do {                                            \
+    uint32_t __flags;                           \
+    spin_lock_irqsave(&(q).lock, __flags);      \
+    while (!(condition))                        \
+        sleep_on(&(q));                         \
+    spin_unlock_irqrestore(&(q).lock, __flags); \
+} while (0)
+
+void init_waitqueue_head(wait_queue_head_t *q);
+void sleep_on(wait_queue_head_t *q);
+void wake_up(wait_queue_head_t *q);
+
+#endif /* _WAIT_H_ */
@@ -0,0 +1,97 @@
+#ifndef _SPINLOCK_H_
+#define _SPINLOCK_H_
+
+#include <types.h>
+#include <lib.h>
+
+/* a busy-waiting lock shared by all processors */
+typedef struct {
+    volatile uint32_t locked;       /* 1 while some processor holds the lock */
+} spinlock_t;
+
+#define __SPIN_LOCK_UNLOCKED    { 0 }
+
+#define DEFINE_SPINLOCK(name) \
+    spinlock_t name = __SPIN_LOCK_UNLOCKED
+
+
+/**
+ * @brief hint the processor that it is spinning (pause)
+ *
+ */
+static inline void cpu_relax(void) {
+    asm volatile ("pause" : : : "memory");
+}
+
+
+/**
+ * @brief initialize an unlocked spinlock
+ *
+ * @param lock : spinlock
+ */
+static inline void spin_lock_init(spinlock_t *lock) {
+    lock->locked = 0;
+}
+
+
+/**
+ * @brief try to take the lock once
+ *
+ * @param lock : spinlock
+ * @return int32_t : 1 if the lock is taken, 0 if it is held by someone else
+ */
+static inline int32_t spin_trylock(spinlock_t *lock) {
+    uint32_t old = 1;
+
+    /* xchg with a memory operand is always locked */
+    asm volatile ("xchgl %0, %1"
+                : "+r"(old), "+m"(lock->locked)
+                :
+                : "memory"
+    );
+    return !old;
+}
+
+
+/**
+ * @brief spin until the lock is taken. Only reads the lock while
+ * it is held, so the cache line is not bounced between processors.
+ *
+ * @param lock : spinlock
+ */
+static inline void spin_lock(spinlock_t *lock) {
+    while (!spin_trylock(lock)) {
+        while (lock->locked)
+            cpu_relax();
+    }
+}
+
+
+/**
+ * @brief release the lock. A plain store is enough on x86: stores
+ * are not reordered with earlier loads and stores.
+ *
+ * @param lock : spinlock
+ */
+static inline void spin_unlock(spinlock_t *lock) {
+    asm volatile ("" : : : "memory");
+    lock->locked = 0;
+}
+
+
+/* take a lock also taken by interrupt handlers: interrupts on this
+ * processor stay disabled until the matching spin_unlock_irqrestore */
+#define spin_lock_irqsave(lock, flags)          \
+do {                                            \
+    cli_and_save(flags);                        \
+    spin_lock(lock);                            \
+} while (0)
+
+#define spin_unlock_irqrestore(lock, flags)     \
+do {                                            \
+    spin_unlock(lock);                          \
+    restore_flags(flags);                       \
+} while (0)
+
+
+#endif /* _SPINLOCK_H_ */
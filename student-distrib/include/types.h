@@ -27,6 +27,12 @@ typedef unsigned char uint8_t;
 typedef uint32_t pid_t;
 typedef uint32_t gid_t;
 
+/* doubly linked list node, see list.h for the operations */
+typedef struct _list {
+    struct _list *next;
+    struct _list *prev;
+} list_head;
+
 /* x is likely to be true */
 #define likely(x)	    __builtin_expect(!!(x), 1)
 
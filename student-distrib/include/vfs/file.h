@@ -21,6 +21,8 @@ typedef struct {
     file_op  f_op;          /* Pointer to the file operation table. */
     uint32_t f_count;       /* File object's reference count. */
     uint32_t f_pos;         /* Current file offset (file pointer). */
+    uint32_t f_rtc_div;     /* RTC: hardware interrupts per virtual tick. */
+    uint32_t f_rtc_next;    /* RTC: hardware tick count of the next virtual tick. */
 } file_t;
 
 
@@ -7,9 +7,13 @@
 #define stdout      1               /* Standard output to the terminal. */
 
 #include <vfs/file.h>
+#include <spinlock.h>
 
 
+/* The table belongs to one task, the lock keeps its children from 
+ * copying a slot that is being opened or closed (see fdcopy()). */
 typedef struct {
+    spinlock_t lock;        /* slots being opened or closed */
     uint32_t count;         /* Number of processes sharing this table */
     uint32_t max_fd;        /* Current maximun number of file objects */
     file_t fd[OPEN_MAX];    /* Pointers to array of file object pointers */
@@ -28,7 +32,8 @@ int32_t do_open(const int8_t *filename);
 int32_t do_close(int32_t fd);
 int32_t do_read(int32_t fd, void *buf, uint32_t nbytes);
 int32_t do_write(int32_t fd, const void *buf, uint32_t nbytes);
-void fdcopy(void);
+int32_t fdcopy(void);
+void fd_release(files *fds);
 
 
 #endif /* _VFS_H_ */
@@ -10,26 +10,16 @@
 
 
 /**
- * @brief map user virtual memory space
+ * @brief switch user virtual memory space
  * 
  * @param from : source process
  * @param to : dest process
  */
 void __umap(thread_t *from, thread_t *to) {
-    if (from != init)     /* only unmap if it's not the init process */
-        user_mem_unmap(from);
-    if (to != init)
+    if (to != init)     /* init runs on the kernel page directory */
         user_mem_map(to);
-}
-
-
-int _user_mem_mmap(vm_area_t* vm) {
-    int va, rtn = 0, i = 0;
-    for(va = vm->vmstart; va < vm->vmend; va += PAGE_SIZE) {
-        rtn += mmap(va, ADDR_TO_PTE(vm->mmap[i]), PAGE_SIZE, GETBIT_12(vm->mmap[i]));
-        i ++;
-    }  
-    return rtn;
+    else
+        user_mem_unmap(from);
 }
 
 
@@ -44,7 +34,7 @@ void create_vm(thread_t* t)
         while(area != 0) {
             length = area->vmend - area->vmstart;
             area->vmend = area->vmstart;
-            rtn += vmalloc(area, length, PTE_RW * ((area->vmflag & VM_WRITE)? 1: 0) | PTE_US);
+            rtn += vmreserve(area, length, PTE_RW * ((area->vmflag & VM_WRITE)? 1: 0) | PTE_US);
             area = area->next;
         }
         
@@ -55,6 +45,12 @@ void create_vm(thread_t* t)
     else panic("created!");
 }
 
+/**
+ * @brief release the user memory of process t, frames still shared
+ *        with another process are kept alive by their reference count
+ * 
+ * @param t : thread whose memory areas are freed
+ */
 void free_vm(thread_t* t)
 {
     
@@ -65,68 +61,33 @@ void free_vm(thread_t* t)
     while(area != 0) {
         length = area->vmend - area->vmstart;
         vmdealloc(area, length, 0);
-        area = area->next;
         temp = area;
-        kfree(temp);
+        area = area->next;
+        kmem_cache_free(vm_area_cachep, temp);
     }
-
+    t->vm.map_list = 0;
 }
 
 /**
- * @brief map user virtual memory to process pid's physical memory
+ * @brief map user virtual memory of process t by loading its page directory
  * 
- * @param pid process id (start at 2)
+ * @param t : thread whose address space becomes active
  */
 void user_mem_map(thread_t* t) {
-    int rtn = 0;
-    vm_area_t* area;
-    if(t->vm.size == 0) {
-        create_vm(t);
-        return;
-    }
+    set_pgdir(t->vm.pgdir);
 
-    area = t->vm.map_list;
-    while(area != 0) {
-        rtn += _user_mem_mmap(area);
-        area = area->next;
-    }
-    
-    // if(rtn == 0) printf(">>>>>map process pid = %d succeed!\n", t->pid);
-    // else printf(">>>>>map process pid = %d FAILED, mapping has existed\n", t->pid);
-    
-    flush_tlb();
+    if(t->vm.size == 0)
+        create_vm(t);
 }
 
 
-// void user_mem_map(thread_t* t) {
-//     page_directory[VIR_MEM_BEGIN >> PDE_OFFSET_4MB] = PTE_PRESENT | PTE_RW
-//          | PTE_US | PDE_MB | INDEX_TO_DIR(t->pid + 14);
-//     flush_tlb();
-// }
-
-
-// void user_mem_unmap(thread_t* t) {
-//     page_directory[VIR_MEM_BEGIN >> PDE_OFFSET_4MB] = 0;
-//     flush_tlb();
-// }
-
 /**
- * @brief user_mem_unmap
+ * @brief user_mem_unmap, fall back to the kernel-only page directory
  * 
- * @param pid process id (start at 2)
+ * @param t : thread whose address space is left
  */
 void user_mem_unmap(thread_t* t) {
-    int rtn;
-    vm_area_t *area = t->vm.map_list;
-    while(area != 0){
-        rtn = freemap(area->vmstart, area->vmend - area->vmstart);
-        area = area->next;
-    }
-    
-    flush_tlb();
-
-    // if(rtn == 0) printf("<<<<<unmap process pid = %d succeed!\n", t->pid);
-    // else printf("<<<<<unmap process pid = %d FAILED!\n", t->pid);
+    set_pgdir(page_directory);
 }
 
 /**
@@ -0,0 +1,173 @@
+#include <boot/apic.h>
+#include <boot/smp.h>
+#include <boot/page.h>
+#include <drivers/time.h>
+#include <drivers/clocksource.h>
+#include <pro/process.h>
+#include <lib.h>
+
+uint8_t apic_present;                   /* 1 if the processor has a local APIC */
+static uint32_t apic_timer_count;       /* APIC timer counts in a tick, measured by the boot processor */
+
+static int32_t has_apic(void);
+static void apic_timer_calibrate(void);
+
+
+/**
+ * @brief map and enable the local APIC of the boot processor. The 8259
+ * keeps delivering the device interrupts through LINT0.
+ *
+ * @return int32_t : 0 on success, -1 if there is no local APIC
+ */
+int32_t apic_init(void) {
+    if (!has_apic()) return -1;
+
+    /* uncached, shared by every page directory created later */
+    page_directory[APIC_PDE] = PTE_PRESENT | PTE_RW | PDE_MB | PTE_CD | PTE_WT | PTE_GLO
+                             | ADDR_TO_4MB(APIC_BASE);
+    flush_tlb();
+
+    apic_present = 1;
+
+    apic_write(APIC_SVR, APIC_SVR_ENABLE | SPURIOUS_INTR);
+    apic_write(APIC_LVT_LINT0, APIC_EXTINT);
+    apic_write(APIC_LVT_LINT1, APIC_NMI);
+    apic_write(APIC_TPR, 0);
+
+    apic_timer_calibrate();
+
+    return 0;
+}
+
+
+/**
+ * @brief enable the local APIC of an application processor and start its
+ * periodic timer. Only the boot processor takes the 8259 interrupts.
+ *
+ */
+void apic_setup(void) {
+    apic_write(APIC_SVR, APIC_SVR_ENABLE | SPURIOUS_INTR);
+    apic_write(APIC_LVT_LINT0, APIC_LVT_MASKED);
+    apic_write(APIC_LVT_LINT1, APIC_LVT_MASKED);
+    apic_write(APIC_TPR, 0);
+
+    apic_write(APIC_TIMER_DIV, APIC_DIV_16);
+    apic_write(APIC_LVT_TIMER, APIC_TIMER_PERIODIC | APIC_TIMER_INTR);
+    apic_write(APIC_TIMER_INIT, apic_timer_count);
+}
+
+
+/**
+ * @brief local APIC id of this processor
+ *
+ * @return uint32_t : APIC id
+ */
+uint32_t apic_id(void) {
+    return apic_read(APIC_ID) >> 24;
+}
+
+
+/**
+ * @brief send an interprocessor interrupt to one processor
+ *
+ * @param apicid : local APIC id of the destination
+ * @param icr : delivery mode and vector
+ */
+void apic_send_ipi(uint32_t apicid, uint32_t icr) {
+    uint32_t flags;
+
+    cli_and_save(flags);
+    while (apic_read(APIC_ICR_LOW) & ICR_BUSY);
+    apic_write(APIC_ICR_HIGH, apicid << 24);
+    apic_write(APIC_ICR_LOW, icr);
+    restore_flags(flags);
+}
+
+
+/**
+ * @brief send an interprocessor interrupt to all other processors
+ *
+ * @param icr : delivery mode and vector
+ */
+void apic_broadcast_ipi(uint32_t icr) {
+    uint32_t flags;
+
+    cli_and_save(flags);
+    while (apic_read(APIC_ICR_LOW) & ICR_BUSY);
+    apic_write(APIC_ICR_HIGH, 0);
+    apic_write(APIC_ICR_LOW, ICR_ALL_BUT_SELF | icr);
+    while (apic_read(APIC_ICR_LOW) & ICR_BUSY);
+    restore_flags(flags);
+}
+
+
+/**
+ * @brief local APIC timer interrupt handler (application processors)
+ *
+ */
+void do_apic_timer(void) {
+    uint32_t intr_flag;
+
+    cli_and_save(intr_flag);
+    apic_eoi();
+    scheduler_tick();
+    restore_flags(intr_flag);
+}
+
+
+/**
+ * @brief reschedule interrupt handler: another processor has put a
+ * task on the run queue of this one
+ *
+ */
+void do_reschedule(void) {
+    thread_t *curr;
+    uint32_t intr_flag;
+
+    cli_and_save(intr_flag);
+    apic_eoi();
+
+    /* the new task needs the periodic tick back */
+    tick_program(sched_tick_length());
+
+    GETPRO(curr);
+    if (this_rq()->running && curr->flag == NEED_RESCHED)
+        schedule();
+
+    restore_flags(intr_flag);
+}
+
+
+/**
+ * @brief count the APIC timer (divided by 16) during 10 ms of PIT
+ * channel 2 to get the initial count of a tick
+ *
+ */
+static void apic_timer_calibrate(void) {
+    uint64_t count;
+
+    apic_write(APIC_TIMER_DIV, APIC_DIV_16);
+    apic_write(APIC_LVT_TIMER, APIC_LVT_MASKED);
+    apic_write(APIC_TIMER_INIT, 0xFFFFFFFF);
+
+    pit_delay(CALIBRATE_LATCH);
+
+    count = 0xFFFFFFFF - apic_read(APIC_TIMER_CUR);
+    apic_write(APIC_TIMER_INIT, 0);
+
+    count *= TICKUNIT;
+    do_div(&count, (uint32_t)CALIBRATE_NS);
+    apic_timer_count = count ? (uint32_t)count : 1;
+}
+
+
+/**
+ * @brief check whether the processor has a local APIC
+ *
+ * @return int32_t : 1 if it has, 0 otherwise
+ */
+static int32_t has_apic(void) {
+    uint32_t eax = 1, ebx, ecx, edx;
+    asm volatile ("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    return !!(edx & CPUID_APIC);
+}
@@ -46,8 +46,13 @@
 
 #include <pro/cfs.h>
 #include <pro/process.h>
+#include <drivers/time.h>
+#include <drivers/timer.h>
+#include <drivers/clocksource.h>
+#include <boot/x86_desc.h>
 #include <access.h>
 #include <kmalloc.h>
+#include <errno.h>
 #include <lib.h>
 
 /*
@@ -95,37 +100,50 @@ const uint32_t sched_prio_to_wmult[40] = {
 };
 
 
-/* the running queue containing all runable threads */
-cfs_rq *rq;
+/* the running queue of each processor, containing its runable threads */
+cfs_rq *runqueues[NR_CPUS];
 
 
-static thread_t *pick_next_task(sched_t *curr);
-static sched_t *pick_next_entity(void);
-static void put_prev_task(sched_t *prev);
+static thread_t *pick_next_task(cfs_rq *rq, sched_t *curr);
+static int32_t idle_balance(cfs_rq *rq);
+static uint32_t select_task_rq(void);
+static void resched_cpu(uint32_t cpu);
+static sched_t *pick_next_entity(cfs_rq *rq);
+static sched_t *pick_stealable(cfs_rq *q);
+static void put_prev_task(cfs_rq *rq, sched_t *prev);
 static void dequeue_task(thread_t *prev);
-static void dequeue_entity(sched_t *prev);
-static void __dequeue_entity(sched_t *s);
-// static void enqueue_task(thread_t *new, int8_t wakeup);
-// static void enqueue_entity(sched_t *s, int8_t wakeup);
-static void __enqueue_entity(sched_t *s);
+static void dequeue_entity(cfs_rq *rq, sched_t *prev);
+static void __dequeue_entity(cfs_rq *rq, sched_t *s);
+static void __enqueue_task(cfs_rq *rq, thread_t *new, int8_t wakeup);
+// static void enqueue_entity(cfs_rq *rq, sched_t *s, int8_t wakeup);
+static void __enqueue_entity(cfs_rq *rq, sched_t *s);
 static uint64_t sched_key(sched_t *s);
 static int32_t check_preempt_new(sched_t *curr, sched_t *new);
-static int32_t check_preempt_tick(sched_t *curr);
-static void update_curr(void);
-static void update_min_vruntime(void);
+static int32_t wakeup_preempt(cfs_rq *rq, thread_t *task);
+static void find_matching_se(sched_t **se, sched_t **pse);
+static inline int32_t sched_depth(sched_t *s);
+static void set_task_rq(thread_t *task, uint32_t cpu);
+static inline task_group *task_group_of(thread_t *task);
+static void init_cfs_rq(cfs_rq *q, uint32_t cpu);
+static void __set_curr_task(cfs_rq *rq, thread_t *task);
+static int32_t check_preempt_tick(cfs_rq *rq, sched_t *curr);
+static void update_curr(cfs_rq *rq);
+static void update_min_vruntime(cfs_rq *rq);
 static inline uint64_t calc_delta_vruntime(uint64_t delta, sched_t *s);
 static uint64_t __calc_delta_vruntime(uint64_t delta, uint32_t weight, weight_t *load);
 static inline uint64_t mul_u64_u32_shr(uint64_t a, uint32_t mul, uint32_t shift);
 static inline uint64_t max_vruntime(uint64_t min_vruntime, uint64_t vruntime);
 static inline uint64_t min_vruntime(uint64_t min_vruntime, uint64_t vruntime);
 static inline void set_load_weight(sched_t *s, int32_t nice);
-static void place_entity(sched_t *s, int8_t new_task);
-static uint64_t vtimeslice(sched_t *s);
-static uint64_t timeslice(sched_t *s);
+static void place_entity(cfs_rq *rq, sched_t *s, int8_t new_task);
+static uint64_t vtimeslice(cfs_rq *rq, sched_t *s);
+static uint64_t timeslice(cfs_rq *rq, sched_t *s);
 static uint64_t sched_period(uint32_t nr_running);
 static inline void add_load(weight_t *from, weight_t *to);
 static inline void sub_load(weight_t *from, weight_t *to);
 static inline int32_t nice_to_index(int32_t nice);
+static inline void idle_wait(void);
+static inline uint64_t update_rq_clock(cfs_rq *rq);
 
 
 /**
@@ -133,6 +151,9 @@ static inline int32_t nice_to_index(int32_t nice);
  * 
  */
 void sched_init(void) {
+    int i;
+    cfs_rq *rq;
+
     /* allocate memory spaces for kernel threads */
     process_t *idlep = (process_t *) alloc_kstack();
     process_t *initp = (process_t *) alloc_kstack();
@@ -147,45 +168,67 @@ void sched_init(void) {
     idle->argv = kmalloc(sizeof(int8_t*));
     idle->argv[0] = kmalloc(5);
     strcpy(idle->argv[0], IDLE);
-    idle->context = kmalloc(sizeof(context_t));
+    idle->context = kmem_cache_alloc(context_cachep);
+    idle->vm.pgdir = page_directory;
+    idle->cpu = 0;
+    idle->console_id = NTERMINAL;
+    idle->policy = SCHED_NORMAL;
+    idle->rt_info.on_rq = 0;
+    idle->sched_info.on_rq = 0;
+    idle->sched_info.parent = NULL;
+    idle->sched_info.cfs_rq = NULL;
+    idle->sched_info.my_q = NULL;
     
     /* set up process 1 */
     init = &initp->thread;
     init->pid = 1;
     init->state = RUNNABLE;  
     init->parent = idle;
-    init->n_children = 0;
-    init->children = NULL;
-    init->max_children = MAXCHILDREN;
+    INIT_LIST_HEAD(&init->children);
     init->nice = NICE_INIT;
     init->kthread = 1;
     init->argc = 1;
     init->argv = kmalloc(sizeof(int8_t*));
     init->argv[0] = kmalloc(5);
     strcpy(init->argv[0], INIT);
-    init->context = kmalloc(sizeof(context_t));
+    init->context = kmem_cache_alloc(context_cachep);
+    init->vm.pgdir = page_directory;
+    init->cpu = 0;
+    init->on_cpu = 1;
+    init->console_id = NTERMINAL;       /* runs in the root queue */
+    init->policy = SCHED_NORMAL;
+    init->rt_info.on_rq = 0;
+    schedstat_init_task(init);
 
     /* create console queue */
     consoles = kmalloc(NTERMINAL * sizeof(console_t));
+    memset(consoles, 0, NTERMINAL * sizeof(console_t));
     current = NULL;
 
     /* create task queue */
     task_queue.next = &task_queue;
     task_queue.prev = &task_queue;
 
-    /* create run queue */
-    rq = kmalloc(sizeof(cfs_rq));
-    rq->nr_running = 0;
-    rq->current = NULL;
-    rq->left_most = NULL;
-    rq->rb_tree.rb_node = NULL;
+    /* create a run queue for each processor */
+    for (i = 0; i < NR_CPUS; ++i) {
+        rq = kmalloc(sizeof(cfs_rq));
+        init_cfs_rq(rq, i);
+        runqueues[i] = rq;
+    }
+    rt_init();
     
 
     /* add init process to the run queue */
     // sched_fork(init);
 
+    rq = cpu_rq(0);
+    set_task_rq(init, 0);
+    init->sched_info.on_rq = 0;
     rq->min_vruntime = init->sched_info.vruntime;
 
+    /* the other processors may start scheduling now */
+    smp_started = 1;
+
     /* start running init */
     init->context->esp = get_esp0(init);
     init->context->ebp = init->context->esp;
@@ -195,6 +238,7 @@ void sched_init(void) {
                 : "memory" 
     );
     rq->current = &init->sched_info;
+    rq->running = init;
     init->state = RUNNING;
     
     /* init should be the only process running so go to its task */
@@ -202,6 +246,59 @@ void sched_init(void) {
 }
 
 
+/**
+ * @brief create a task group with an (empty) queue on every processor
+ * 
+ * @return task_group* : the group, NULL if out of memory
+ */
+task_group *sched_group_create(void) {
+    uint32_t cpu;
+    sched_t *se;
+    task_group *tg;
+
+    if ((tg = kmalloc(sizeof(task_group))) == NULL)
+        return NULL;
+
+    for (cpu = 0; cpu < NR_CPUS; ++cpu) {
+        init_cfs_rq(&tg->rq[cpu], cpu);
+
+        se = &tg->se[cpu];
+        set_load_weight(se, 0);
+        se->vruntime = 0;
+        se->sum_exec_time = 0;
+        se->prev_sum_exec_time = 0;
+        se->on_rq = 0;
+        se->parent = NULL;
+        se->cfs_rq = cpu_rq(cpu);
+        se->my_q = &tg->rq[cpu];
+    }
+
+    return tg;
+}
+
+
+/**
+ * @brief set up an empty queue
+ * 
+ * @param q : the queue
+ * @param cpu : processor it belongs to
+ */
+static void init_cfs_rq(cfs_rq *q, uint32_t cpu) {
+    q->load.weight = 0;
+    q->load.inv_weight = 0;
+    q->nr_running = 0;
+    q->h_nr_running = 0;
+    q->min_vruntime = 0;
+    q->clock = 0;
+    q->current = NULL;
+    q->left_most = NULL;
+    q->rb_tree.rb_node = NULL;
+    q->cpu = cpu;
+    q->running = NULL;
+    spin_lock_init(&q->lock);
+}
+
+
     
 
 /**
@@ -210,37 +307,347 @@ void sched_init(void) {
  * @param new : new task thread info
  */
 void sched_fork(thread_t *task) {
-    sched_t *curr = rq->current;
+    cfs_rq *rq = this_rq();
+    cfs_rq *q;
+    sched_t *curr;
     sched_t *new = &task->sched_info;
+    uint32_t flags;
+
+    spin_lock_irqsave(&rq->lock, flags);
+
+    /* new task become runnable, on the processor of its parent for now */
+    task->state = RUNNABLE;
+    task->cpu = smp_processor_id();
+
+    /* it starts in the queue of its console group */
+    set_task_rq(task, task->cpu);
+    new->on_rq = 0;
+    q = new->cfs_rq;
+    curr = q->current;
 
     /* set weights */
     set_load_weight(new, task->nice);
 
     if (curr) {
         /* update vruntime of the current process */
-        update_curr();
+        update_curr(q);
 
         /* new task first get vruntime from its parent */
         new->vruntime = curr->vruntime;  
+    } else {
+        new->vruntime = q->min_vruntime;
     }
 
     /* set vruntime for new task */
-    place_entity(new, 1);
+    place_entity(q, new, 1);
 
-    /* new task become runnable */
-    task->state = RUNNABLE;
+    spin_unlock_irqrestore(&rq->lock, flags);
 }
 
 
+/**
+ * @brief put a new task on the run queue of the least loaded processor
+ * 
+ * @param task : new task set up by sched_fork
+ */
 void activate_task(thread_t *task) {
-    /* enqueue task to runqueue */
-    enqueue_task(task, 0);
+    uint32_t cpu = select_task_rq();
+    cfs_rq *rq = cpu_rq(cpu);
+    sched_t *s = &task->sched_info;
+    uint32_t flags;
+
+    /* vruntime only means something relative to the min_vruntime of a queue */
+    if (cpu != task->cpu)
+        s->vruntime -= s->cfs_rq->min_vruntime;
+
+    spin_lock_irqsave(&rq->lock, flags);
+    if (cpu != task->cpu) {
+        set_task_rq(task, cpu);
+        s->vruntime += s->cfs_rq->min_vruntime;
+    }
+    task->cpu = cpu;
+    schedstat_enqueue(task, sched_clock());
+    __enqueue_task(rq, task, 0);
+    if (rt_task(task))
+        wakeup_preempt(rq, task);
+    spin_unlock_irqrestore(&rq->lock, flags);
+
+    resched_cpu(cpu);
+}
+
+
+/**
+ * @brief check if a task just put on rq should preempt the running one.
+ * rq->lock must be held.
+ * 
+ * @param rq : run queue of the task
+ * @param task : new or woken task
+ * @return int32_t : 1 if the running task is flagged NEED_RESCHED
+ */
+static int32_t wakeup_preempt(cfs_rq *rq, thread_t *task) {
+    sched_t *curr = rq->current;
+    sched_t *se, *pse;
+
+    /* a real-time task preempts fair tasks and lower priorities */
+    if (rt_task(task)) {
+        if (!rq->running || !check_preempt_rt(rq->running, task))
+            return 0;
+        rq->running->flag = NEED_RESCHED;
+        return 1;
+    }
+
+    /* a throttled real-time task gives way to any fair task */
+    if (rq->running && rt_task(rq->running)) {
+        if (!cpu_rt_rq(rq->cpu)->rt_throttled)
+            return 0;
+        rq->running->flag = NEED_RESCHED;
+        return 1;
+    }
+
+    /* the running task is the current entity at the bottom of the groups */
+    while (curr && curr->my_q)
+        curr = curr->my_q->current;
+
+    /* nothing to preempt while the CPU is idle in pick_next_task() */
+    if (!curr) return 0;
+
+    /* compare the two where they share a queue: a task is only 
+     * preempted by another group when its group has run long enough */
+    se = curr;
+    pse = &task->sched_info;
+    find_matching_se(&se, &pse);
+    update_curr(se->cfs_rq);
+
+    /* check if the woken task should preempt the running one */
+    if (check_preempt_new(se, pse) == 1) {
+        task_of(curr)->flag = NEED_RESCHED;
+        return 1;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief walk up two entities until they are in the same queue
+ * 
+ * @param se : entity of the running task, becomes its ancestor
+ * @param pse : entity of the woken task, becomes its ancestor
+ */
+static void find_matching_se(sched_t **se, sched_t **pse) {
+    int32_t se_depth = sched_depth(*se);
+    int32_t pse_depth = sched_depth(*pse);
+
+    while (se_depth > pse_depth) {
+        se_depth--;
+        *se = (*se)->parent;
+    }
+
+    while (pse_depth > se_depth) {
+        pse_depth--;
+        *pse = (*pse)->parent;
+    }
+
+    while ((*se)->cfs_rq != (*pse)->cfs_rq) {
+        *se = (*se)->parent;
+        *pse = (*pse)->parent;
+    }
 }
 
 
-void wakeup_preempt(thread_t *task) {
-    /* check if reschedling is needed */
-    if (check_preempt_new(rq->current, &task->sched_info) == 1) task->flag = NEED_RESCHED;
+/**
+ * @brief number of groups above an entity
+ * 
+ * @param s : sched info
+ * @return int32_t : 0 for an entity of the root queue
+ */
+static inline int32_t sched_depth(sched_t *s) {
+    int32_t depth = 0;
+
+    for (s = s->parent; s; s = s->parent)
+        depth++;
+
+    return depth;
+}
+
+
+/**
+ * @brief make a task the running one of this processor without a context 
+ * switch, used to start the first shell. Its groups become current too.
+ * 
+ * @param task : task set up by sched_fork
+ */
+void set_curr_task(thread_t *task) {
+    cfs_rq *rq = this_rq();
+    uint32_t flags;
+
+    spin_lock_irqsave(&rq->lock, flags);
+    __set_curr_task(rq, task);
+    spin_unlock_irqrestore(&rq->lock, flags);
+}
+
+
+/**
+ * @brief make a fair task (already running on this processor) the current 
+ * entity of its queues, rq->lock must be held and no fair task current
+ * 
+ * @param rq : run queue of this processor
+ * @param task : the task
+ */
+static void __set_curr_task(cfs_rq *rq, thread_t *task) {
+    sched_t *s = &task->sched_info;
+    cfs_rq *q;
+
+    for_each_sched(s) {
+        q = s->cfs_rq;
+        if (!s->on_rq) {
+            place_entity(q, s, 0);
+            add_load(&s->load, &q->load);
+            s->on_rq = 1;
+        } else if (q->current != s) {
+            /* its group is waiting in the queue */
+            __dequeue_entity(q, s);
+        }
+        q->current = s;
+        s->exec_start = update_rq_clock(q);
+        s->prev_sum_exec_time = s->sum_exec_time;
+    }
+
+    rq->running = task;
+}
+
+
+/**
+ * @brief change the scheduling policy and the real-time priority of a task
+ * 
+ * @param task : the task
+ * @param policy : SCHED_NORMAL, SCHED_FIFO or SCHED_RR
+ * @param priority : 1 .. MAX_RT_PRIO - 1 for a real-time policy, 0 otherwise
+ * @return int32_t : 0 on success, -EINVAL on invalid arguments
+ */
+int32_t sched_setscheduler(thread_t *task, uint32_t policy, uint32_t priority) {
+    cfs_rq *rq;
+    rt_rq *rt;
+    uint32_t flags;
+    uint32_t cpu;
+    int8_t queued, running;
+
+    if (policy == SCHED_NORMAL) {
+        if (priority) return -EINVAL;
+    } else if (policy == SCHED_FIFO || policy == SCHED_RR) {
+        if (priority < 1 || priority >= MAX_RT_PRIO) return -EINVAL;
+    } else {
+        return -EINVAL;
+    }
+
+    /* a queued task may be taken by another processor meanwhile */
+    for (;;) {
+        cpu = task->cpu;
+        rq = cpu_rq(cpu);
+        spin_lock_irqsave(&rq->lock, flags);
+        if (cpu == task->cpu)
+            break;
+        spin_unlock_irqrestore(&rq->lock, flags);
+    }
+
+    rt = cpu_rt_rq(cpu);
+    running = (rq->running == task);
+    queued = rt_task(task) ? task->rt_info.on_rq : task->sched_info.on_rq;
+
+    /* leave the old class */
+    if (queued) {
+        if (rt_task(task)) {
+            if (running)
+                put_prev_rt_task(rt, task);
+            dequeue_rt_task(rt, task);
+        } else {
+            dequeue_task(task);
+            /* the groups of a running task go back to their queues */
+            if (running)
+                put_prev_task(rq, &task->sched_info);
+        }
+    }
+
+    task->policy = policy;
+    task->rt_info.priority = priority;
+    task->rt_info.time_slice = RR_TIMESLICE;
+
+    /* and join the new one */
+    if (queued) {
+        if (rt_task(task)) {
+            enqueue_rt_task(rt, task);
+            if (running)
+                task->rt_info.exec_start = sched_clock();
+        } else if (running) {
+            __set_curr_task(rq, task);
+        } else {
+            __enqueue_task(rq, task, 1);
+        }
+    }
+
+    /* pick again with the new priorities */
+    if (rq->running)
+        rq->running->flag = NEED_RESCHED;
+
+    spin_unlock_irqrestore(&rq->lock, flags);
+
+    resched_cpu(cpu);
+    return 0;
+}
+
+
+/**
+ * @brief point the entity of a task at the queue of its console group 
+ * (or at the root queue) of a processor
+ * 
+ * @param task : the task
+ * @param cpu : processor number
+ */
+static void set_task_rq(thread_t *task, uint32_t cpu) {
+    task_group *tg = task_group_of(task);
+    sched_t *s = &task->sched_info;
+
+    s->parent = tg ? &tg->se[cpu] : NULL;
+    s->cfs_rq = tg ? &tg->rq[cpu] : cpu_rq(cpu);
+    s->my_q = NULL;
+}
+
+
+/**
+ * @brief group of the console of a task
+ * 
+ * @param task : the task
+ * @return task_group* : the group, NULL for a task without a console
+ */
+static inline task_group *task_group_of(thread_t *task) {
+    if (task->console_id >= NTERMINAL || !consoles[task->console_id])
+        return NULL;
+
+    return consoles[task->console_id]->tg;
+}
+
+
+/**
+ * @brief move a sleeping task back to the run queue of its processor. 
+ * A task woken before it has switched out just stays on the run queue.
+ * 
+ * @param task : task to wake up
+ */
+void try_to_wake_up(thread_t *task) {
+    cfs_rq *rq = cpu_rq(task->cpu);
+    uint32_t flags;
+    int8_t woken = 0;
+
+    spin_lock_irqsave(&rq->lock, flags);
+    if (task->state == SLEEPING) {
+        task->state = RUNNABLE;
+        schedstat_wakeup(task, sched_clock());
+        __enqueue_task(rq, task, 1);
+        wakeup_preempt(rq, task);
+        woken = 1;
+    }
+    spin_unlock_irqrestore(&rq->lock, flags);
+
+    if (woken) resched_cpu(task->cpu);
 }
 
 
@@ -252,10 +659,8 @@ void wakeup_preempt(thread_t *task) {
  */
 void sched_wakeup(thread_t *from, thread_t *task) {
     task->flag = WAKEUP;
-    if (task == current->task) {
-        task->state = RUNNABLE;
-        enqueue_task(task, 1);
-    }
+    if (task == current->task)
+        try_to_wake_up(task);
     __schedule(from);
 }
 
@@ -267,20 +672,20 @@ void sched_wakeup(thread_t *from, thread_t *task) {
  * @param parent : its parent
  */
 void sched_exit(thread_t *child, thread_t *parent) {
-    child->sched_info.on_rq = 0;
+    /* __schedule() takes it off the run queue */
     child->state = EXITED;
     sched_wakeup(child, parent);
 }
 
 
 /**
- * @brief let a running process to sleep
+ * @brief let a running process to sleep. The caller marks it SLEEPING 
+ * (with interrupts disabled) before anyone can wake it up, __schedule()
+ * then takes it off the run queue unless a wakeup came in meanwhile.
  * 
  * @param task : task info 
  */
 void sched_sleep(thread_t *task) {
-    task->sched_info.on_rq = 0;
-    task->state = SLEEPING;
     __schedule(task);
 }
 
@@ -316,18 +721,33 @@ void schedule(void) {
  * 
  */
 void __schedule(thread_t *curr) {
+    cfs_rq *rq = this_rq();
     sched_t *sched;
     thread_t *next;
     uint32_t flags;
 
     /* avoid preemption */
-    cli_and_save(flags);
+    spin_lock_irqsave(&rq->lock, flags);
 
     /* get sched info of the current task */
     sched = &curr->sched_info;
 
+    /* no other processor may pick curr before its context is saved */
+    curr->on_cpu = 1;
+
+    /* a sleeping or exiting task leaves the run queue and gives back 
+     * its load, unless it has been woken up already */
+    if (curr->state == SLEEPING || curr->state == EXITED) {
+        if (rt_task(curr))
+            dequeue_rt_task(cpu_rt_rq(rq->cpu), curr);
+        else if (sched->on_rq)
+            dequeue_task(curr);
+    }
+
     /* find the next task to run */
-    next = pick_next_task(sched);
+    next = pick_next_task(rq, sched);
+
+    schedstat_switch(rq->cpu, curr, next, sched_clock());
 
     /* switch to the next task*/
 	if (likely(curr != next)) {
@@ -336,11 +756,25 @@ void __schedule(thread_t *curr) {
             curr->state = RUNNABLE;
 
         next->state = RUNNING;
-        rq->current = &next->sched_info;
+        next->cpu = smp_processor_id();
+        next->on_cpu = 1;
+        rq->running = next;
         /* update current console's task */
         if (curr->console_id == next->console_id)
             current->task = next;
+
+        /* swtch clears curr->on_cpu once it has left its stack */
+        spin_unlock(&rq->lock);
         context_switch(curr, next);
+    } else {
+        /* the only runnable task was woken while the CPU idled */
+        next->state = RUNNING;
+        rq->running = next;
+        spin_unlock(&rq->lock);
+
+        /* the directory may have been changed meanwhile (a child loaded
+         * by __exec, a freed directory): reload the task's own */
+        __umap(next, next);
     }
     restore_flags(flags);
 }
@@ -353,27 +787,49 @@ void __schedule(thread_t *curr) {
  * @param curr : the current running thread 
  * @return sched_t* : the pointer to next runable thread
  */
-static thread_t *pick_next_task(sched_t *curr) {
+static thread_t *pick_next_task(cfs_rq *rq, sched_t *curr) {
     sched_t *next;
-
-    /* if no task can be scheduled */
-    if (unlikely(!rq->nr_running))
-        swapper();  /* pause the CPU */
+    cfs_rq *q = rq;
+    rt_rq *rt = cpu_rt_rq(rq->cpu);
+    thread_t *task;
 
     /* store the current task back to the run queue only if curr is present */
-    put_prev_task(curr);
+    if (rt_task(task_of(curr)))
+        put_prev_rt_task(rt, task_of(curr));
+    else
+        put_prev_task(rq, curr);
+
+    /* real-time tasks go first (unless throttled). If no task can be 
+     * scheduled, try to take one from a busy processor, otherwise stop 
+     * the periodic tick and halt until an interrupt wakes one up */
+    for (;;) {
+        if ((task = pick_next_rt_task(rt, rq->nr_running)) != NULL)
+            return task;
+        if (likely(rq->nr_running) || idle_balance(rq))
+            break;
+        rq->running = NULL;
+        tick_program(sched_tick_length());
+        spin_unlock(&rq->lock);
+        idle_wait();
+        spin_lock(&rq->lock);
+    }
     
-    /* get next sched entity */
-    next = pick_next_entity();
+    /* walk down the groups, a group in a queue always has a task queued */
+    do {
+        /* get next sched entity */
+        next = pick_next_entity(q);
 
-    /* remove the picked task from the run queue */
-    __dequeue_entity(next);
+        /* remove the picked entity from the run queue */
+        __dequeue_entity(q, next);
 
-    rq->current = next;
+        q->current = next;
 
-    next->exec_start = rq->clock;
+        next->exec_start = update_rq_clock(q);
 
-    next->prev_sum_exec_time = next->sum_exec_time;
+        next->prev_sum_exec_time = next->sum_exec_time;
+
+        q = next->my_q;
+    } while (q);
     
     /* return the thread */
     return task_of(next);
@@ -387,7 +843,7 @@ static thread_t *pick_next_task(sched_t *curr) {
  * 
  * @return sched_t* : picked sched info
  */
-static sched_t *pick_next_entity(void) {
+static sched_t *pick_next_entity(cfs_rq *rq) {
     rb_node *__left_most = rq->left_most;
 
     if (unlikely(!__left_most)) return NULL;
@@ -396,21 +852,146 @@ static sched_t *pick_next_entity(void) {
 }
 
 
+/**
+ * @brief take a runnable task that is not running from the queue of 
+ * another processor. Called by an idle processor with rq->lock held, 
+ * so the other queues are only tried, never waited for.
+ * 
+ * @param rq : run queue of this processor, empty
+ * @return int32_t : 1 if a task was moved to rq, 0 otherwise
+ */
+static int32_t idle_balance(cfs_rq *rq) {
+    uint32_t cpu;
+    cfs_rq *busiest;
+    sched_t *s;
+    thread_t *task;
+
+    for (cpu = 0; cpu < nr_cpus; ++cpu) {
+        busiest = cpu_rq(cpu);
+
+        /* a processor without a running task will pick its own */
+        if (busiest == rq || !busiest->h_nr_running || !busiest->running)
+            continue;
+
+        if (!spin_trylock(&busiest->lock))
+            continue;
+
+        if ((s = pick_stealable(busiest)) != NULL) {
+            task = task_of(s);
+            dequeue_task(task);
+            s->vruntime -= s->cfs_rq->min_vruntime;
+            spin_unlock(&busiest->lock);
+
+            /* same group, queue of this processor */
+            task->cpu = smp_processor_id();
+            set_task_rq(task, task->cpu);
+            s->vruntime += s->cfs_rq->min_vruntime;
+            __enqueue_task(rq, task, 0);
+            return 1;
+        }
+
+        spin_unlock(&busiest->lock);
+    }
+
+    return 0;
+}
+
+
+/**
+ * @brief find a queued task that can move to another processor, 
+ * looking into the running group first
+ * 
+ * @param q : queue to search, its root queue is locked
+ * @return sched_t* : entity of the task, NULL if none
+ */
+static sched_t *pick_stealable(cfs_rq *q) {
+    rb_node *node;
+    sched_t *s, *found;
+
+    if (q->current && q->current->my_q && (found = pick_stealable(q->current->my_q)))
+        return found;
+
+    for (node = q->left_most; node; node = rb_next(node)) {
+        s = sched_of(node);
+
+        if (s->my_q) {
+            if ((found = pick_stealable(s->my_q)) != NULL)
+                return found;
+            continue;
+        }
+
+        /* switched out, but its context is not saved yet */
+        if (!task_of(s)->on_cpu)
+            return s;
+    }
+
+    return NULL;
+}
+
+
+/**
+ * @brief find the processor with the fewest tasks, this one on a tie
+ * 
+ * @return uint32_t : processor number
+ */
+static uint32_t select_task_rq(void) {
+    uint32_t cpu, load;
+    uint32_t best = smp_processor_id();
+    uint32_t min = cpu_rq(best)->h_nr_running + cpu_rt_rq(best)->rt_nr_running 
+                 + !!cpu_rq(best)->current;
+
+    for (cpu = 0; cpu < nr_cpus; ++cpu) {
+        load = cpu_rq(cpu)->h_nr_running + cpu_rt_rq(cpu)->rt_nr_running 
+             + !!cpu_rq(cpu)->current;
+        if (load < min) {
+            min = load;
+            best = cpu;
+        }
+    }
+
+    return best;
+}
+
+
+/**
+ * @brief tell a processor that its run queue got a task
+ * 
+ * @param cpu : processor number
+ */
+static void resched_cpu(uint32_t cpu) {
+    if (cpu == smp_processor_id()) {
+        /* tasks now compete for the CPU: back to the periodic tick */
+        tick_program(TICKUNIT);
+    } else {
+        smp_send_reschedule(cpu);
+    }
+}
+
+
 /**
  * @brief restore task into runqueue
  * 
  * @param prev : sched info
  */
-static void put_prev_task(sched_t *prev) {
+static void put_prev_task(cfs_rq *rq, sched_t *prev) {
+    cfs_rq *q;
 
     /* If the prev process is still on the run queue, it is very likely 
      * that the prev process is preempted. Before giving up the cpu, it 
      * is necessary to update the process runtime and other information. 
+     * The same goes for the groups it runs in.
      */
-    if (prev->on_rq) {
-        update_curr();
-        /* cache the next entity which has the min_vruntime if have any */
-        __enqueue_entity(prev);
+    for_each_sched(prev) {
+        /* the idle thread of a processor is on no queue */
+        if (!(q = prev->cfs_rq))
+            break;
+
+        if (prev->on_rq) {
+            update_curr(q);
+            /* cache the next entity which has the min_vruntime if have any */
+            __enqueue_entity(q, prev);
+        }
+        q->current = NULL;
     }
 
     rq->current = NULL;
@@ -418,15 +999,26 @@ static void put_prev_task(sched_t *prev) {
 
 
 /**
- * @brief remove a prev task from runqueue
+ * @brief remove a prev task from runqueue, and its group too if the 
+ * group has no other task. The lock of its root queue must be held.
  * 
  * @param new : prev task thread info
  */
 static void dequeue_task(thread_t *prev) {
     sched_t *s = &prev->sched_info;
-    dequeue_entity(s);
-    rq->current = NULL;
-    s->on_rq = 0;
+    cfs_rq *q;
+
+    for_each_sched(s) {
+        q = s->cfs_rq;
+        dequeue_entity(q, s);
+        if (q->current == s)
+            q->current = NULL;
+        s->on_rq = 0;
+
+        /* the group stays while it has other tasks */
+        if (q->load.weight)
+            break;
+    }
 }
 
 
@@ -438,11 +1030,11 @@ static void dequeue_task(thread_t *prev) {
  * @param s : a scheduling entity
  * @param sleep : does the process just sleep?
  */
-static void dequeue_entity(sched_t *prev) {
-    update_curr();
+static void dequeue_entity(cfs_rq *rq, sched_t *prev) {
+    update_curr(rq);
 
     if (prev != rq->current)
-        __dequeue_entity(prev);
+        __dequeue_entity(rq, prev);
     
     sub_load(&prev->load, &rq->load);
 }
@@ -453,7 +1045,7 @@ static void dequeue_entity(sched_t *prev) {
  * 
  * @param s : sched info to remove
  */
-static void __dequeue_entity(sched_t *s) {
+static void __dequeue_entity(cfs_rq *rq, sched_t *s) {
     /* s is the left most node */
     if (rq->left_most == &s->node) {
 
@@ -465,6 +1057,8 @@ static void __dequeue_entity(sched_t *s) {
     }
 
     rq->nr_running--;
+    if (!s->my_q)
+        cpu_rq(rq->cpu)->h_nr_running--;
 
     /* remove from red-black tree */
     rb_erase(&s->node, &rq->rb_tree);
@@ -479,11 +1073,39 @@ static void __dequeue_entity(sched_t *s) {
  * @param wakeup : does the process just wake up?
  */
 void enqueue_task(thread_t *new, int8_t wakeup) {
+    cfs_rq *rq = cpu_rq(new->cpu);
+    uint32_t flags;
+
+    spin_lock_irqsave(&rq->lock, flags);
+    __enqueue_task(rq, new, wakeup);
+    spin_unlock_irqrestore(&rq->lock, flags);
+
+    resched_cpu(new->cpu);
+}
+
+
+/**
+ * @brief add a task to rq, rq->lock must be held
+ * 
+ * @param rq : run queue of the processor of the task
+ * @param new : new task thread info
+ * @param wakeup : does the process just wake up?
+ */
+static void __enqueue_task(cfs_rq *rq, thread_t *new, int8_t wakeup) {
     sched_t *s = &new->sched_info;
+
+    if (rt_task(new)) {
+        enqueue_rt_task(cpu_rt_rq(rq->cpu), new);
+        return;
+    }
     
     if (s->on_rq) return;
 
-    enqueue_entity(s, wakeup);
+    /* a group that had no task is placed like a woken task */
+    for_each_sched(s) {
+        if (s->on_rq) break;
+        enqueue_entity(s->cfs_rq, s, wakeup || s->my_q);
+    }
 }
 
 
@@ -495,20 +1117,20 @@ void enqueue_task(thread_t *new, int8_t wakeup) {
  * @param s : a scheduling entity
  * @param wakeup : does the task just wake up?
  */
-void enqueue_entity(sched_t *s, int8_t wakeup) {
-    update_curr();
+void enqueue_entity(cfs_rq *rq, sched_t *s, int8_t wakeup) {
+    update_curr(rq);
 
     /* update sum of all runnable tasks' load weights */
     add_load(&s->load, &rq->load);
 
     if (wakeup) {    
         /* adjust vruntime */
-        place_entity(s, 0);
+        place_entity(rq, s, 0);
     }
 
     /* add to run queue */
     if (rq->current != s) {
-        __enqueue_entity(s);
+        __enqueue_entity(rq, s);
     }
 }
 
@@ -518,7 +1140,7 @@ void enqueue_entity(sched_t *s, int8_t wakeup) {
  * 
  * @param s : sched info to add
  */
-static void __enqueue_entity(sched_t *s) {
+static void __enqueue_entity(cfs_rq *rq, sched_t *s) {
     rb_node **link = &rq->rb_tree.rb_node;
     rb_node *parent = NULL;
     sched_t *entry;
@@ -548,6 +1170,8 @@ static void __enqueue_entity(sched_t *s) {
     rb_insert_color(&s->node, &rq->rb_tree);
     s->on_rq = 1;
     rq->nr_running++;
+    if (!s->my_q)
+        cpu_rq(rq->cpu)->h_nr_running++;
 }
 
 
@@ -583,23 +1207,87 @@ static int32_t check_preempt_new(sched_t *curr, sched_t *new) {
 }
 
 
+/**
+ * @brief how long the next timer tick can be delayed (NO_HZ). Competing 
+ * tasks need the periodic tick, a task running alone only needs one when 
+ * its timeslice ends, and an idle CPU the longest period the timer allows.
+ * The boot processor runs the kernel timers, so it also wakes up for the 
+ * next one.
+ * 
+ * Read without the lock: a task put on this queue by another processor 
+ * comes with a reschedule IPI, which programs the tick again.
+ * 
+ * @return uint64_t : nanoseconds until the next tick
+ */
+uint64_t sched_tick_length(void) {
+    cfs_rq *rq = this_rq();
+    uint64_t len, timer;
+
+    /* real-time tasks need the tick for round robin and throttling */
+    if (rq->h_nr_running || cpu_rt_rq(rq->cpu)->rt_nr_running)
+        return TICKUNIT;
+
+    len = rq->current ? timeslice(rq, rq->current) : TICK_MAX_NS;
+
+    if (!rq->cpu) {
+        timer = (uint64_t)next_timer_event(TICK_MAX_NS / TICKUNIT) * TICKUNIT;
+        if (timer < len)
+            len = timer;
+    }
+
+    return len;
+}
+
+
 /**
  * @brief called everytime when a timer interrupt is fired
  * 
  * @param curr : current sched info
  */
 void task_tick(thread_t *curr) {
+    cfs_rq *rq = this_rq();
     sched_t *sched = &curr->sched_info;
+    cfs_rq *q;
+
+    /* interrupts are disabled in the timer handler */
+    spin_lock(&rq->lock);
+
+    /* tasks waiting, a running real-time task is on its queue */
+    schedstat_tick(rq->cpu, rq->h_nr_running + cpu_rt_rq(rq->cpu)->rt_nr_running -
+                   (rq->running && rt_task(rq->running)));
+
+    /* the CPU is idle in pick_next_task(), nobody to preempt */
+    if (unlikely(!rq->running)) {
+        spin_unlock(&rq->lock);
+        return;
+    }
+
+    /* round robin and throttling of the real-time class */
+    if (task_tick_rt(cpu_rt_rq(rq->cpu), curr, rq->nr_running))
+        curr->flag = NEED_RESCHED;
+
+    /* a real-time task is on none of the fair queues */
+    if (rt_task(curr) || !rq->current) {
+        spin_unlock(&rq->lock);
+        return;
+    }
+
+    /* the task competes in its group, the group in the root queue */
+    for_each_sched(sched) {
+        q = sched->cfs_rq;
 
-    /* update vruntime of the current task */
-    update_curr();
+        /* update vruntime of the current task */
+        update_curr(q);
     
-    /* only try to reschedule when there are more than 1 runnable task */
-    if (rq->nr_running) {
-        if (check_preempt_tick(sched) == 1) {
-            curr->flag = NEED_RESCHED;
+        /* only try to reschedule when there are more than 1 runnable task */
+        if (q->nr_running) {
+            if (check_preempt_tick(q, sched) == 1) {
+                curr->flag = NEED_RESCHED;
+            }
         }
     }
+
+    spin_unlock(&rq->lock);
 }
 
 
@@ -609,8 +1297,8 @@ void task_tick(thread_t *curr) {
  * @param curr : current task sched info
  * @return int32_t : 1 to reschedule, 0 otherwise
  */
-static int32_t check_preempt_tick(sched_t *curr) {
-    uint64_t ideal = timeslice(curr);
+static int32_t check_preempt_tick(cfs_rq *rq, sched_t *curr) {
+    uint64_t ideal = timeslice(rq, curr);
     uint64_t delta = curr->sum_exec_time - curr->prev_sum_exec_time;
 
     /* has used all timeslice: should be preempted */
@@ -649,9 +1337,9 @@ static int32_t check_preempt_tick(sched_t *curr) {
  * @brief update the current process's vruntime 
  * 
  */
-static void update_curr(void) {
+static void update_curr(cfs_rq *rq) {
     sched_t *curr = rq->current;
-    uint64_t now = rq->clock;
+    uint64_t now = update_rq_clock(rq);
     uint64_t delta;
 
     if (unlikely(!curr)) return;    
@@ -671,7 +1359,7 @@ static void update_curr(void) {
     curr->vruntime += calc_delta_vruntime(delta, curr);  
 
     /* update min_vruntime */
-    update_min_vruntime();
+    update_min_vruntime(rq);
 }
 
 
@@ -679,7 +1367,7 @@ static void update_curr(void) {
  * @brief update current min_vruntime
  * 
  */
-static void update_min_vruntime(void) {
+static void update_min_vruntime(cfs_rq *rq) {
     sched_t *s;
     uint64_t vruntime = rq->min_vruntime;
     
@@ -831,12 +1519,12 @@ static inline void set_load_weight(sched_t *s, int32_t nice) {
  * @param s : sched info
  * @param new_task : is the task a new task?
  */
-static void place_entity(sched_t *s, int8_t new_task) {
+static void place_entity(cfs_rq *rq, sched_t *s, int8_t new_task) {
     uint64_t vruntime = rq->min_vruntime;
 
     if (new_task) {
         /* punish new task */
-        vruntime += vtimeslice(s);
+        vruntime += vtimeslice(rq, s);
     } else {
         /* make up for sleeping task */
         vruntime -= (TARGET_LATENCY >> 1);
@@ -856,8 +1544,8 @@ static void place_entity(sched_t *s, int8_t new_task) {
  * @param s : sched info
  * @return uint64_t : virtual time slice
  */
-static uint64_t vtimeslice(sched_t *s) {
-    return calc_delta_vruntime(timeslice(s), s);
+static uint64_t vtimeslice(cfs_rq *rq, sched_t *s) {
+    return calc_delta_vruntime(timeslice(rq, s), s);
 }
 
 
@@ -867,7 +1555,7 @@ static uint64_t vtimeslice(sched_t *s) {
  * @param s : sched info
  * @return uint64_t : real time slice
  */
-static uint64_t timeslice(sched_t *s) {
+static uint64_t timeslice(cfs_rq *rq, sched_t *s) {
 	uint64_t slice = sched_period(rq->nr_running + !s->on_rq);
     weight_t load = rq->load;
 
@@ -957,3 +1645,23 @@ void pause(void) {
     /* Spin (nicely, so we don't chew up cycles) */
     asm volatile (".1: hlt; jmp .1;");
 }
+
+
+/**
+ * @brief halt with interrupts enabled until the next interrupt, 
+ * then disable them again. Used while the run queue is empty.
+ * 
+ */
+static inline void idle_wait(void) {
+    asm volatile ("sti; hlt; cli" : : : "memory");
+}
+
+
+/**
+ * @brief read the clocksource into rq->clock
+ * 
+ * @return uint64_t : nanoseconds since boot
+ */
+static inline uint64_t update_rq_clock(cfs_rq *rq) {
+    return rq->clock = sched_clock();
+}
@@ -105,63 +105,44 @@ void do_general_protection() {
 }
 
 /**
- * @brief If the address of the page fault is within the allowed
- *        user stack range, expand the user stack by 4KB for the user.
+ * @brief A write to a copy-on-write page gets its private copy.
+ *        A reserved page gets a frame on its first touch. If the address
+ *        of the page fault is within the allowed user stack range, the
+ *        user stack is expanded down to the faulting page.
  * 
- * @param errcode   
+ * @param errcode   Error code pushed by the CPU (PF_PROT, PF_WRITE, PF_USER).
  * @param addr      Address of page fault.
  */
 void 
 do_page_fault(int errcode, int addr) 
 {   
+    thread_t* t;
+    vm_area_t* area;
 
-    if(addr < USER_STACK_ADDR && addr > (USER_STACK_ADDR - USER_STACK_MAX)) {
-        thread_t* t;
-        vm_area_t* area;
-        uint32_t pa, length, va;
-        uint32_t* temp;
-
-        GETPRO(t);
-        
-        // printf("handling page fault.. getting more stack!\n Your process = %d, ", t->pid);
-        // printf("your address: %x\n", addr);
-
-        area = t->vm.map_list;
-        while(area != 0) {
-            if(area->vmflag & VM_STACK) {
-                //TODO
-                //vmdealloc(area, (area->vmend-area->vmstart), 1);
-                length = (area->vmend - area->vmstart) / PAGE_SIZE + 1;
-
-                area->vmstart = area->vmstart - PAGE_SIZE;
-                pa = get_user_page(0);                      /* Alloc physical memory. */
-
-                temp = kmalloc(sizeof(uint32_t*) * length);
-                if(length > 1) {
-                    memcpy((char*)(temp + sizeof(uint32_t*)), (char*)area->mmap, sizeof(uint32_t*) * length);
-                    kfree(area->mmap);
-                }
-                
-                area->mmap = temp;
-
-                va = area->vmstart;
-                mmap(va, pa, PAGE_SIZE, PTE_RW | PTE_US);   /* Create mmap. */
-
-                area->mmap[0] = ADDR_TO_PTE(pa) | PTE_PRESENT | PTE_RW | PTE_US;
-                // printf("------------------------------------------------------------\n");
-                // printf("PAGE FAULT HANDLER: Succeed! Your new stack start: 0x%x.\n", area->vmstart);
-                // printf("------------------------------------------------------------\n");
-                // int i;
-                // for(i = 0; i < length; i++) {
-                //     printf("mmap: %x", area->mmap[i]);
-                // }
-                
-                return;
+    GETPRO(t);
+
+    if((errcode & PF_PROT) && (errcode & PF_WRITE)) {
+        if(do_wp_page(&t->vm, addr) == 0)
+            return;
+    }
+
+    if(!(errcode & PF_PROT)) {
+        if(addr < USER_STACK_ADDR && addr > (USER_STACK_ADDR - USER_STACK_MAX)) {
+            for(area = t->vm.map_list; area != 0; area = area->next) {
+                if(area->vmflag & VM_STACK)
+                    break;
             }
-            area = area->next;
+            if(area == 0) {
+                printf("ERROR: NO STACK?\n");
+                while(1);
+            }
+            /* Reserve the stack down to the faulting page. */
+            if(ADDR_TO_PTE(addr) < area->vmstart && vmgrow_down(area, ADDR_TO_PTE(addr)) == -1)
+                panic("do_page_fault: stack");
         }
-        printf("ERROR: NO STACK?\n");
-        while(1);
+
+        if(do_no_page(&t->vm, addr) == 0)
+            return;
     }
 
     printf("PAGE FAULT! ERROR ADDRESS: %x\n", addr);
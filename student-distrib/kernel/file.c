@@ -5,7 +5,8 @@
 #include <io.h>
 
 /**
- * @brief Initialize the file object.
+ * @brief Initialize the file object. The lock of the file table must be
+ * held until the object is copied into the slot found.
  * 
  * @param fd : A starting file descriptor. 
  * @param file : A file object that to be set.
@@ -3,6 +3,7 @@
 #include <boot/x86_desc.h>
 #include <boot/exception.h>
 #include <boot/interrupt.h>
+#include <boot/apic.h>
 #include <boot/syscall.h>
 #include <lib.h>
 #include <io.h>
@@ -103,6 +104,9 @@ void intr_init() {
     set_intr_gate(TIMER_INTR, &timer_handler);
     set_intr_gate(KEYBOARD_INTR, &keyboard_handler);
     set_intr_gate(RTC_INTR, &rtc_handler);
+    set_intr_gate(APIC_TIMER_INTR, &apic_timer_handler);
+    set_intr_gate(RESCHEDULE_INTR, &reschedule_handler);
+    set_intr_gate(SPURIOUS_INTR, &spurious_handler);
 }
 
 
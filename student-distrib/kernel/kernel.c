@@ -7,11 +7,14 @@
 #include <boot/page.h>
 #include <boot/idt.h>
 #include <boot/i8259.h>
+#include <boot/smp.h>
 #include <drivers/keyboard.h>
 #include <drivers/terminal.h>
 #include <drivers/rtc.h>
 #include <drivers/fs.h>
 #include <drivers/time.h>
+#include <drivers/timer.h>
+#include <drivers/clocksource.h>
 #include <drivers/vga.h>
 #include <vfs/vfs.h>
 #include <pro/process.h>
@@ -109,6 +112,7 @@ void entry(unsigned long magic, unsigned long addr) {
                     (unsigned)mmap->length_high,
                     (unsigned)mmap->length_low);
     }
+    mem_detect(mbi);                /* Find the usable RAM while low memory is still reachable. */
 
     /* Construct an LDT entry in the GDT */
     {
@@ -158,14 +162,15 @@ void entry(unsigned long magic, unsigned long addr) {
     i8259_init();                   /* Initialize the PIC */
 
     /* Dynamic Memory Allocation */
+    user_mem_init();                /* Takes its frame descriptors from the heap first. */
     kmalloc_init();
+    proc_caches_init();             /* Create the object caches of processes. */
 
     /* File System */
     module_t *mod = (module_t *)mbi->mods_addr;
     fs_init(mod->mod_start);        /* Initialize the file system driver. */ 
 
     /* Virtual Memory */
-    user_mem_init();
     page_init();                    /* Initialize page tables. */
 
 
@@ -173,10 +178,15 @@ void entry(unsigned long magic, unsigned long addr) {
     keyboard_init();                /* Initialize the Keyboard driver. */
     rtc_init();                     /* Initialize the RTC driver. */
     pit_init();                     /* Initialize the PIT driver */
+    timer_init();                   /* Initialize the kernel timers */
+    clocksource_init();             /* Pick the clock the scheduler reads */
     vga_init();                     /* Initialize the VGA driver */
 
 
     clear();
+
+    /* Processors */
+    smp_init();                     /* Start the other processors */
     
     /* Process management Unit */
     sched_init();
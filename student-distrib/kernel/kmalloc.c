@@ -5,29 +5,50 @@
  
 
 
-free_area_t free_area[MAX_ORDER + 1];
-buddy free_list[MAX_ORDER + 1];
+zone_t kernel_zone;                 /* frames of the kernel heap */
 
-uint32_t bit_map[MAX_BMSIZE * 2 + 12];
+#define HEAP_BEGIN      (RESERVED_PAGES * PAGE_SIZE_4MB)
+#define HEAP_END        (KERNEL_PAGES * PAGE_SIZE_4MB)
+#define HEAP_FRAMES     ((HEAP_END - HEAP_BEGIN) / PAGE_SIZE)
 
-page_header_t *page_header;
-page_header_t ph;
-slab_t l1;
-slab_t *slab_free_list;
-slab_t *start_slab;
+page_t mem_map[HEAP_FRAMES];        /* descriptors of the kernel heap frames */
 
-#define PAGE_SLAB (PAGE_SIZE_4MB / SLAB_SIZE)
+#define virt_to_page(p) (&mem_map[((uint32_t)(p) - HEAP_BEGIN) / PAGE_SIZE])
 
+#define MB_INFO_MEM     0x01                /* multiboot flags: mem_lower/mem_upper valid */
+#define MB_INFO_MMAP    0x40                /* multiboot flags: mmap_addr/mmap_length valid */
+#define MB_MEM_USABLE   1                   /* memory map type of usable RAM */
+#define MEM_DEFAULT_END 0x10000000          /* assumed end of RAM without any memory info */
+#define MAX_PFN         (ENTRY_NUM * ENTRY_NUM - 1) /* keeps frame end addresses within 32 bits */
 
-int add_header(void* pt, int order);
-int pop_header(int addr);
-void slab_list_push(slab_t* list, slab_t* s);
-void slab_list_remove(slab_t* b);
+mem_range_t mem_ranges[MAX_MEM_RANGES];     /* usable RAM found at boot */
+int nr_mem_ranges;
+uint32_t max_pfn;                           /* frame number behind the highest usable frame */
+static uint32_t boot_top = HEAP_END;        /* heap frames above are taken by boot_alloc() */
 
-slab_t* _slab_free(slab_t* ns); 
-int slab_space_grow();
-void bminit();
-buddy* get_buddy(uint32_t addr);
+#define KMALLOC_CLASSES 8                   /* 16, 32, ... 2048 bytes */
+
+static kmem_cache_t cache_cache;            /* cache of the kmem_cache_t objects */
+static LIST_HEAD(cache_chain);              /* list of all caches */
+static kmem_cache_t* kmalloc_caches[KMALLOC_CLASSES];
+static const int8_t* kmalloc_names[KMALLOC_CLASSES] = {
+    "size-16", "size-32", "size-64", "size-128", 
+    "size-256", "size-512", "size-1024", "size-2048"
+};
+
+/* free index array right behind the slab header */
+#define slab_bufctl(s)  ((int32_t*)((kmem_slab_t*)(s) + 1))
+
+
+static void set_page_owner(void* p, int order, int owner);
+static void kmem_cache_init(void);
+static void cache_setup(kmem_cache_t* cache, const int8_t* name, uint32_t size, 
+                        uint32_t align, void (*ctor)(void*));
+static kmem_slab_t* cache_grow(kmem_cache_t* cache);
+static inline kmem_slab_t* obj_to_slab(void* obj);
+static inline void add_free(zone_t* z, page_t* page, int order);
+static inline void del_free(zone_t* z, page_t* page, int order);
+static void add_mem_range(uint64_t base, uint64_t length);
 
 
 
@@ -38,517 +59,547 @@ buddy* get_buddy(uint32_t addr);
  */
 void kmalloc_init()
 {
-    int i = 0;
-    buddy* p;
-
-    for(i = 0; i <= MAX_ORDER; i++) {
-        free_list_init(i); 
-        bminit();
-        free_area[i].start_addr = RESERVED_PAGES * PAGE_SIZE_4MB;
-        free_area[i].user = 0;
-        //memset(free_area[i].bit_map, 0, 16 * sizeof(uint32_t)); /* All buddys are both free */
-    }
-
-    buddy* fl = free_area[MAX_ORDER].free_list;
-    /* index kernel memory and store in largest free list */
-    for(i = RESERVED_PAGES * PAGE_SIZE_4MB; i < KERNEL_PAGES * PAGE_SIZE_4MB; i += buddy_size(MAX_ORDER - 1)) {
-        p = (buddy*) i;
-        p->addr = i;
-        free_list_push(fl, p);
-    }
-    /* initialize page alloc header */
-    page_header = &ph;
-    page_header->next = page_header;
+    zone_init(&kernel_zone, HEAP_BEGIN, (boot_top - HEAP_BEGIN) / PAGE_SIZE, mem_map);
+    zone_free_usable(&kernel_zone);
 
-    slab_init();
+    kmem_cache_init();
 
     return;
 }
 
 /**
- * @brief Initialize kernel memory bit map for buddy allocator.
+ * @brief Initialize an empty zone, all frames are in use.
  * 
+ * @param z the zone
+ * @param start address of the first frame, aligned to the largest block
+ * @param nr_frames number of frames
+ * @param mem_map array of nr_frames descriptors
  */
-void bminit()
+void zone_init(zone_t* z, uint32_t start, uint32_t nr_frames, page_t* mem_map)
 {
-    int i, t = 0;
-    memset(bit_map, 0, sizeof(uint32_t) * (MAX_BMSIZE * 2 + 10));
-    for(i = 0; i < MAX_ORDER; i++) {
-        free_area[i].bmsize = (MAX_BMSIZE >> i) + (i > 4 ? 1 : 0);
-        free_area[i].bit_map = bit_map + t;
-        t += free_area[i].bmsize;
-    }
+    int i;
+
+    z->start = start;
+    z->nr_frames = nr_frames;
+    z->mem_map = mem_map;
+    z->free_mask = 0;
+    spin_lock_init(&z->lock);
+    for(i = 0; i < MAX_ORDER; i++)
+        INIT_LIST_HEAD(&z->free_list[i]);
+    memset(mem_map, 0, nr_frames * sizeof(page_t));     /* every frame starts as PG_NONE */
 }
 
 /**
- * @brief Allocate parameter size kernel memory space.
- * Use the slab allocator for allocations under 4KB, 
- * and use the buddy allocator directly for 4KB and above.
+ * @brief Give frames [first, last) of a zone to the buddy allocator,
+ * in the largest aligned blocks that fit.
  * 
- * @param size Required memory space, can be any integer from 0 to 4MB.
- * @return void* pointer to allocated memory space. NULL means failed.
+ * @param z the zone
+ * @param first first frame number
+ * @param last frame number behind the range
  */
-void* kmalloc(int size) 
-{   
-    int order = 0, temp = 1;
-    char* pt;
-
-    if (size <= 0) return NULL;
-
-    if(size > PAGE_SIZE_4MB) /* larger than upper limit */
-        return NULL;
-
-    /* use slab allocator for small size */
-    if((size + sizeof(slab_t)) < PAGE_SIZE) {
-        return slab_alloc(size);
+void zone_free_range(zone_t* z, uint32_t first, uint32_t last)
+{
+    int order;
 
-    } else {
-        /* calculate order for get_page */
-        size = (size + PAGE_SIZE - 1) / PAGE_SIZE;
-        while(temp < size) {
-            temp *= 2;
-            order ++;
+    while(first < last) {
+        for(order = MAX_ORDER - 1; order > 0; order--) {
+            if(!(first & ((1 << order) - 1)) && first + (1 << order) <= last)
+                break;
         }
-        if((pt = get_page(order)) == 0) 
-            return 0;
-        if(add_header(pt, order) == -1) /* add page alloc header */
-            return 0;
-        return (void*)pt;
+        __free_pages(z, first, order);
+        first += 1 << order;
     }
 }
 
 /**
- * @brief add kmalloc header for kmalloc request >= 4KB
- * 
- * @param pt allocated space
- * @param order order of page alloc
- * @return 0 means succeed, -1 means failed
- */
-int add_header(void* pt, int order)
-{
-    page_header_t* h;
-    /* use dynamic space to manage page alloc headers */
-    if((h = kmalloc(sizeof(page_header_t))) == 0)
-        return -1;
-    h->addr = (uint32_t)pt;
-    h->order = order;
-    h->next = page_header->next;
-    page_header->next = h;
-    return 0;
-}
-
-/**
- * @brief free a kernel space created by kmalloc
+ * @brief Give every usable frame of a zone to the buddy allocator,
+ * holes of the boot memory map stay in use.
  * 
- * @param p pointer to the space
+ * @param z the zone
  */
-void kfree(void* p)
+void zone_free_usable(zone_t* z)
 {
-    int t;
+    int i;
+    uint32_t first, last;
+    uint32_t base = z->start / PAGE_SIZE;
 
-    /* do nothing when p is NULL */
-    if (!p) return;
-    
-    if((t = pop_header((uint32_t)p)) != -1) {   /* try to use free_page */
-        free_page(p, t);
-        return;
-    }
-    
-    slab_t* header = (slab_t*)((uint32_t)p - sizeof(slab_t));
-    if(header->status == 0) return; /* double free a pointer */
-    if((header->size + sizeof(slab_t)) < PAGE_SIZE) {
-        slab_free(header);
+    for(i = 0; i < nr_mem_ranges; i++) {
+        first = mem_ranges[i].first > base ? mem_ranges[i].first - base : 0;
+        if(mem_ranges[i].last <= base + first)
+            continue;
+        last = mem_ranges[i].last - base;
+        if(last > z->nr_frames)
+            last = z->nr_frames;
+        if(first < last)
+            zone_free_range(z, first, last);
     }
-    return;
 }
 
 /**
- * @brief Try to delete a kmalloc header.
+ * @brief Record the usable RAM from the multiboot information.
+ * Must run before paging is enabled, the information lives in low memory.
  * 
- * @param addr space to free
- * @return order to free_page; -1 means using slab.
+ * @param mbi multiboot information from the boot loader
  */
-int pop_header(int addr) 
+void mem_detect(multiboot_info_t* mbi)
 {
-    page_header_t* h = page_header, *nh;
-    int t;
-    while(h->next != page_header) {
-        if(h->next->addr == addr) {
-            nh = h->next;
-            t = nh->order;
-            h->next = nh->next;
-            kfree(nh);
-            return t;
+    memory_map_t* mmap;
+
+    nr_mem_ranges = 0;
+    max_pfn = 0;
+
+    if(mbi->flags & MB_INFO_MMAP) {
+        for (mmap = (memory_map_t *)mbi->mmap_addr;
+                (unsigned long)mmap < mbi->mmap_addr + mbi->mmap_length;
+                mmap = (memory_map_t *)((unsigned long)mmap + mmap->size + sizeof (mmap->size))) {
+            if(mmap->type == MB_MEM_USABLE)
+                add_mem_range(((uint64_t)mmap->base_addr_high << 32) | mmap->base_addr_low,
+                              ((uint64_t)mmap->length_high << 32) | mmap->length_low);
         }
-        h = h->next;
+    } else if(mbi->flags & MB_INFO_MEM) {
+        add_mem_range(0x100000, (uint64_t)mbi->mem_upper * 1024);   /* mem_upper starts at 1MB */
+    } else {
+        add_mem_range(0x100000, MEM_DEFAULT_END - 0x100000);
     }
-    return -1;
 }
 
 /**
- * @brief Allocate a kernel space of size 2^(order) of 4KB.
+ * @brief Add a usable range of RAM, only whole frames below 4GB are kept.
  * 
- * @param order The minimum order is 0 (4KB) and the maximum order is 10 (4MB).
- * @return void* pointer to allocated space
+ * @param base physical address
+ * @param length length in bytes
  */
-void* get_page(int order)
+static void add_mem_range(uint64_t base, uint64_t length)
 {
-    int i;
-    buddy* temp;
-    if(order >= MAX_ORDER || order < 0) return NULL;
+    uint64_t first = (base + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint64_t last = (base + length) / PAGE_SIZE;
 
-    for(i = order; i <= MAX_ORDER; i++) {
-        /* find the smallest order that has a free block */ 
-        if((temp = free_list_pop(free_area[i].free_list)) == NULL) {
-            continue;
-        }
-        return (void*)buddy_split(free_area, temp, i, order); /* reduce order with split */
-    }
+    if(last > MAX_PFN)
+        last = MAX_PFN;                             /* no PAE, RAM above 4GB is not reachable */
+    if(first >= last || nr_mem_ranges == MAX_MEM_RANGES)
+        return;
 
-    return NULL;
+    mem_ranges[nr_mem_ranges].first = first;
+    mem_ranges[nr_mem_ranges].last = last;
+    nr_mem_ranges++;
+    if(last > max_pfn)
+        max_pfn = last;
 }
 
 /**
- * @brief Recursively split the blocks until obtain a 
- *        memory block of proper size.
+ * @brief Take memory from the top of the kernel heap, before kmalloc_init().
+ * Used for tables sized by the amount of RAM, which never get freed.
  * 
- * @param b Block to split.
- * @param cur_order order of buddy b.
- * @param tar_order required order of get_page().
- * @return buddy* memory generated by split.
+ * @param size size in bytes
+ * @return void* pointer to zeroed, page aligned memory, NULL if too large
  */
-buddy* buddy_split(free_area_t* area, buddy* b, int cur_order, int tar_order)
+void* boot_alloc(uint32_t size)
 {
-    /* b2: pointer to the right child block of b on a lower order */
-    buddy* b2;
-    if(area->user){
-        b2 = get_buddy(b->addr + buddy_size(cur_order) / 4);
-    }
-    else{
-        b2 = (buddy*) (((uint32_t)b) + buddy_size(cur_order) / 4);
-        b2->addr = (uint32_t)b2;
-    }
-    
-    if(cur_order == tar_order) {
-        /* Completely alloc a partially free buddy, or partially free a both free buddy */
-        flip_bit_map(area, b, cur_order);
-        return b;
-    }
-    if(cur_order != MAX_ORDER)
-        flip_bit_map(area, b, cur_order);
-    /* The right block of the next order will not be used for allocation */
-    free_list_push(area[cur_order - 1].free_list, b2);
-    
-    return buddy_split(area, b, cur_order - 1, tar_order);
-}
+    size = PAGE_ALIGN(size);
+    if(size > boot_top - HEAP_BEGIN - PAGE_SIZE_4MB)
+        return NULL;                                /* keep at least 4MB for the heap */
 
-/**
- * @brief Determine if buddy b is partially free.
- * 
- * @param order order of b
- * @return 1 means has only one free block, 0 means both free or busy.
- */
-int is_split(free_area_t* area, buddy* b, int order) 
-{
-    int index = (b->addr - area->start_addr) / buddy_size(order);
-    if(area[order].bit_map[index / 32] & (1 << (index % 32)))
-        return 1;
-    else
-        return 0;
+    boot_top -= size;
+    memset((void*)boot_top, 0, size);
+    return (void*)boot_top;
 }
 
 /**
- * @brief Flip the partially busy pair bitmaps of buddy b. 
- * 
- * @param order order of b
+ * @brief Put a free block into the free list of its order.
  */
-void flip_bit_map(free_area_t* area, buddy* b, int order) 
+static inline void add_free(zone_t* z, page_t* page, int order)
 {
-    int index = (b->addr - area->start_addr) / buddy_size(order);
-    area[order].bit_map[index / 32] ^= (1 << (index % 32));
+    page->owner = PG_BUDDY;
+    page->order = order;
+    list_add(&page->list, &z->free_list[order]);
+    z->free_mask |= 1 << order;
 }
 
 /**
- * @brief Get the size of a buddy.
+ * @brief Take a free block out of the free list of its order.
  */
-int buddy_size(int order) 
+static inline void del_free(zone_t* z, page_t* page, int order)
 {
-    return ((PAGE_SIZE * 2) << order);
+    list_del(&page->list);
+    page->owner = PG_NONE;
+    if(list_empty(&z->free_list[order]))
+        z->free_mask &= ~(1 << order);
 }
 
-
 /**
- * @brief Free a space created by get_page().
+ * @brief Allocate 2^order frames from a zone. The smallest non empty 
+ * order is found with one bit scan, the block is split down to order.
  * 
- * @param p pointer to the space
- * @param order The minimum order is 0 (4KB) and the maximum order is 10 (4MB).
+ * @param z the zone
+ * @param order 0 to MAX_ORDER - 1
+ * @return int32_t number of the first frame, -1 if out of memory
  */
-void free_page(void* p, int order)
+int32_t __get_pages(zone_t* z, int order)
 {
-    buddy* b = (buddy*) p;
-    b->addr = (uint32_t) b;
-    _free_page(free_area, b, order);
-    return;    
+    int i;
+    uint32_t mask, flags;
+    page_t* page;
+
+    if(order >= MAX_ORDER || order < 0) return -1;
+
+    spin_lock_irqsave(&z->lock, flags);
+    if((mask = z->free_mask & ~((1 << order) - 1)) == 0) {
+        spin_unlock_irqrestore(&z->lock, flags);
+        return -1;
+    }
+    i = ffs(mask) - 1;
+
+    page = list_entry(z->free_list[i].next, page_t, list);
+    del_free(z, page, i);
+
+    while(i > order) {                      /* give the upper halves back */
+        i--;
+        add_free(z, page + (1 << i), i);
+    }
+    page->order = order;
+    spin_unlock_irqrestore(&z->lock, flags);
+
+    return page - z->mem_map;
 }
 
 /**
- * @brief Recursively free the allocated space and its parent buddies.
+ * @brief Free 2^order frames to a zone. The buddy of a block is found
+ * by its frame number, so each merge step is O(1).
  * 
- * @param b current buddy
- * @param order current order
+ * @param z the zone
+ * @param pfn number of the first frame
+ * @param order order used by __get_pages()
  */
-void _free_page(free_area_t* area, buddy* b, int order)
+void __free_pages(zone_t* z, uint32_t pfn, int order)
 {
-    buddy* t;
-    if(order == MAX_ORDER){
-        free_list_push(area[order].free_list, b);
-        return;
-    } 
-    if(!is_split(area, b, order)) {
-        free_list_push(area[order].free_list, b);
-        flip_bit_map(area, b, order);
-    }
-    else {
-        flip_bit_map(area, b, order);
-        t = remove_from_free(area, area[order].free_list, b, order);
-        _free_page(area, t, order + 1);
+    uint32_t bpfn, flags;
+    page_t* buddy;
+
+    spin_lock_irqsave(&z->lock, flags);
+    while(order < MAX_ORDER - 1) {
+        bpfn = pfn ^ (1 << order);
+        if(bpfn >= z->nr_frames)
+            break;
+        buddy = &z->mem_map[bpfn];
+        if(buddy->owner != PG_BUDDY || buddy->order != order)
+            break;                          /* the buddy is (partly) in use */
+        del_free(z, buddy, order);
+        pfn &= bpfn;                        /* the merged block starts at the lower one */
+        order++;
     }
-    return;
+    add_free(z, &z->mem_map[pfn], order);
+    spin_unlock_irqrestore(&z->lock, flags);
 }
 
 /**
- * @brief Remove memory block b from a free list and merge it with its buddy block.
+ * @brief Allocate parameter size kernel memory space.
+ * Use the size class caches for allocations up to KMALLOC_MAX, 
+ * and use the buddy allocator directly above.
  * 
- * @param fl the free list b currently exist in.
- * @param order order of b
+ * @param size Required memory space, can be any integer from 0 to 4MB.
+ * @return void* pointer to allocated memory space. NULL means failed.
  */
-buddy* remove_from_free(free_area_t* area, buddy* fl, buddy* b, int order)
-{
-    uint32_t b2, left;
-    // if(is_left_buddy(area, b, order))
-    //     b2 = (((uint32_t)b) + buddy_size(order) / 2);
-    // else
-    //     b2 = (((uint32_t)b) - buddy_size(order) / 2);
-
-    left = is_left_buddy(area, b, order);
-    if(left)
-        b2 = b->addr + buddy_size(order) / 2;
-    else
-        b2 = b->addr - buddy_size(order) / 2;
-
-    buddy *t = fl->next;
-    while(t != fl) {
-        /* try to merge buddy blocks */
-        if(t->addr == b2) {
-            t->last->next = t->next;
-            t->next->last = t->last;
-            if(left){
-                if(area->user) 
-                    kfree(t);
-                return b;
-            }
-            else{
-                if(area->user) 
-                    kfree(b);
-                return t;
-            }
+void* kmalloc(int size) 
+{   
+    int order = 0, temp = 1;
+    char* pt;
+
+    if (size <= 0) return NULL;
+
+    if(size > PAGE_SIZE_4MB) /* larger than upper limit */
+        return NULL;
+
+    /* use the smallest size class that fits */
+    if(size <= KMALLOC_MAX) {
+        for(temp = KMALLOC_MIN; temp < size; temp <<= 1)
+            order++;
+        return kmem_cache_alloc(kmalloc_caches[order]);
+
+    } else {
+        /* calculate order for get_page */
+        size = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+        while(temp < size) {
+            temp *= 2;
+            order ++;
         }
-        t = t->next;
+        if((pt = get_page(order)) == 0) 
+            return 0;
+        virt_to_page(pt)->owner = PG_PAGE;  /* remember the order for kfree */
+        virt_to_page(pt)->order = order;
+        return (void*)pt;
     }
-    return NULL;
 }
 
-
 /**
- * @brief Determine whether d is pointing to the memory block on the left 
- * or the memory block on the right in a buddy under the current order.
+ * @brief Set the owner of every frame of a block.
  * 
- * @return 1 means left memory block, 0 means right memory block.
+ * @param p start of the block
+ * @param order order of the block
+ * @param owner PG_NONE, PG_PAGE or PG_SLAB
  */
-int is_left_buddy(free_area_t* area, buddy* b, int order) 
+static void set_page_owner(void* p, int order, int owner)
 {
-    int t;
-    if(area->user)
-        t = ((b->addr - area->start_addr) / (buddy_size(order) / 2));
-    else
-        t = (((uint32_t)b - area->start_addr) / (buddy_size(order) / 2));
-    return (t % 2 == 0) ? 1 : 0; 
+    int i;
+    page_t* page = virt_to_page(p);
+
+    for(i = 0; i < (1 << order); i++) {
+        page[i].owner = owner;
+        page[i].order = order;
+    }
 }
 
 /**
- * @brief Initialize required data structures of slab allocator.
+ * @brief free a kernel space created by kmalloc
  * 
+ * @param p pointer to the space
  */
-void slab_init()
+void kfree(void* p)
 {
-    slab_t *s;
-    slab_free_list = &l1;
-    slab_free_list->next = slab_free_list;
-    slab_free_list->last = slab_free_list;
-    slab_free_list->size = 0;
-
-    s = get_page(MAX_ORDER - 1);
-    s->size = PAGE_SLAB;
-    s->status = 0;
-    start_slab = s;
-    slab_list_push(slab_free_list, s);
+    page_t* page;
+
+    /* do nothing when p is NULL or not from the kernel heap */
+    if (!p || (uint32_t)p < HEAP_BEGIN || (uint32_t)p >= HEAP_END) return;
+    
+    page = virt_to_page(p);
+    if(page->owner == PG_PAGE && !((uint32_t)p & (PAGE_SIZE - 1))) {   /* use free_page */
+        page->owner = PG_NONE;
+        free_page(p, page->order);
+        return;
+    }
+    if(page->owner == PG_SLAB)          /* any cache object, including kmalloc size classes */
+        kmem_cache_free(obj_to_slab(p)->cache, p);
     return;
 }
 
 /**
- * @brief Allocate a small kernel space using slab allocator.
+ * @brief Allocate a kernel space of size 2^(order) of 4KB.
  * 
- * @param size must be an integer between 0 and (4KB - sizeof(slab_t)).
+ * @param order The minimum order is 0 (4KB) and the maximum order is 10 (4MB).
  * @return void* pointer to allocated space
  */
-void* slab_alloc(int size)
+void* get_page(int order)
 {
-    size += sizeof(slab_t);
-    slab_t* s = slab_free_list->next, *ns;
-    int size_n = (size + SLAB_SIZE - 1) / SLAB_SIZE; /* required number of slabs */
-
-    while(s != slab_free_list) {
-        /* looking for a slab with enough space */
-        if(s->size >= size_n) {
-            slab_list_remove(s);
-            break;
-        }
-        s = s->next;
-    }
-
-    if(s == slab_free_list) {
-        /* All slabs do not have enough space, allocate a new page */
-        if(slab_space_grow() == 0)
-            return 0;
-        else
-            return slab_alloc(size - sizeof(slab_t));
-    }
+    int32_t pfn;
 
-    s->status = 1;
-    if(s->size == size_n) {
-        return (void*)(((uint32_t)s) + sizeof(slab_t));
-    } else {
-        /* put the rest of the space back */
-        ns = (slab_t*) (((uint32_t)s) + size_n * SLAB_SIZE);
-        ns->size = s->size - size_n;
-        ns->status = 0;
-        s->size = size_n;
-        slab_list_push(slab_free_list, ns);
-
-        return (void*)(((uint32_t)s) + sizeof(slab_t));
-    }
+    if((pfn = __get_pages(&kernel_zone, order)) < 0)
+        return NULL;
+    return (void*)(kernel_zone.start + pfn * PAGE_SIZE);
 }
 
 /**
- * @brief Add a new 4kb page to the slab allocator. 
- * Called when contiguous space is not enough.
+ * @brief Free a space created by get_page().
  * 
- * @return 0 means succeed, -1 means failed.
+ * @param p pointer to the space
+ * @param order The minimum order is 0 (4KB) and the maximum order is 10 (4MB).
  */
-int slab_space_grow() 
-{   
-    slab_t* s;
-    if((s = get_page(MAX_ORDER - 1)) == 0) 
-        return -1;
-    s->size = PAGE_SLAB;
-    s->status = 0;
-    slab_list_push(slab_free_list, s);
-    return 0;
+void free_page(void* p, int order)
+{
+    __free_pages(&kernel_zone, ((uint32_t)p - kernel_zone.start) / PAGE_SIZE, order);
+    return;    
 }
 
-
 /**
- * @brief Free a space created by slab_alloc().
+ * @brief Initialize the cache of caches and the kmalloc size classes.
  * 
- * @param p pointer to the space
  */
-void slab_free(slab_t* p)
+static void kmem_cache_init(void)
 {
-    slab_t *ns = (slab_t*) p;
-    //slab_list_remove(ns);
-    ns = _slab_free(ns);
-    ns->status = 0;
-
-    /* If there is a extra empty page, free it */
-    if((ns != start_slab) && !((uint32_t)ns % PAGE_SIZE_4MB) && (ns->size == PAGE_SLAB)) {
-        free_page((void*)ns, (MAX_ORDER - 1));
+    int i;
+
+    cache_setup(&cache_cache, "kmem_cache", sizeof(kmem_cache_t), 0, NULL);
+
+    for(i = 0; i < KMALLOC_CLASSES; i++) {
+        kmalloc_caches[i] = kmem_cache_create(kmalloc_names[i], KMALLOC_MIN << i, 
+                                              ((KMALLOC_MIN << i) < CACHE_LINE) ? (KMALLOC_MIN << i) : CACHE_LINE, NULL);
     }
-    slab_list_push(slab_free_list, ns);
-    return;
 }
 
 /**
- * @brief Recursively merge adjacent frees space in a page.
+ * @brief Compute the slab layout of a cache. A slab is the smallest 
+ * block of pages that holds SLAB_MIN_OBJS objects.
  * 
- * @param ns pointer to current memory block
- * @return slab_t* Finally merged free space
+ * @param cache cache to set up
+ * @param name name of the cache
+ * @param size object size
+ * @param align object alignment, 0 means word alignment
+ * @param ctor constructor of new objects, may be NULL
  */
-slab_t* _slab_free(slab_t* ns)
+static void cache_setup(kmem_cache_t* cache, const int8_t* name, uint32_t size, 
+                        uint32_t align, void (*ctor)(void*))
 {
-    slab_t *s = slab_free_list->next;
-    while(s != slab_free_list) {
-        /* try to merge adjacent space */
-        if(((uint32_t)s + s->size * SLAB_SIZE == (uint32_t)ns 
-        || (uint32_t)ns + ns->size * SLAB_SIZE == (uint32_t)s)
-        && (((uint32_t)s % (PAGE_SIZE_4MB)) 
-        || ((uint32_t)ns % (PAGE_SIZE_4MB)))) {
-            slab_list_remove(s);
-            if((uint32_t)s > (uint32_t)ns) {
-                ns->size = s->size + ns->size;
-                return _slab_free(ns);
-            } else {
-                s->size = s->size + ns->size;
-                return _slab_free(s);
-            }
+    uint32_t slabsize, num, offset;
+    int order;
+
+    if(align < sizeof(void*))
+        align = sizeof(void*);
+    size = (size + align - 1) & ~(align - 1);
+
+    for(order = 0; order < MAX_ORDER - 1; order++) {
+        slabsize = PAGE_SIZE << order;
+        num = (slabsize - sizeof(kmem_slab_t)) / (size + sizeof(int32_t));
+        offset = (sizeof(kmem_slab_t) + num * sizeof(int32_t) + align - 1) & ~(align - 1);
+        while(num && offset + num * size > slabsize) {
+            num--;
+            offset = (sizeof(kmem_slab_t) + num * sizeof(int32_t) + align - 1) & ~(align - 1);
         }
-        s = s->next;
+        if(num >= SLAB_MIN_OBJS)
+            break;
     }
-    return ns;
+
+    cache->name = name;
+    cache->size = size;
+    cache->align = align;
+    cache->ctor = ctor;
+    cache->order = order;
+    cache->num = num;
+    cache->offset = offset;
+    INIT_LIST_HEAD(&cache->slabs_partial);
+    INIT_LIST_HEAD(&cache->slabs_full);
+    INIT_LIST_HEAD(&cache->slabs_free);
+    spin_lock_init(&cache->lock);
+    list_add_tail(&cache->next, &cache_chain);
 }
 
+/**
+ * @brief Create a cache of objects of the same size.
+ * 
+ * @param name name of the cache
+ * @param size object size
+ * @param align object alignment (e.g. CACHE_LINE), 0 means word alignment
+ * @param ctor called once for every new object, objects must be freed
+ *             in their constructed state; may be NULL
+ * @return kmem_cache_t* the new cache, NULL if failed
+ */
+kmem_cache_t* kmem_cache_create(const int8_t* name, uint32_t size, uint32_t align, void (*ctor)(void*))
+{
+    kmem_cache_t* cache;
 
-/* The following functions are helper functions for the linked lists.*/
+    if(size == 0 || size > KMALLOC_MAX * 2)
+        return NULL;
+    if((cache = kmem_cache_alloc(&cache_cache)) == NULL)
+        return NULL;
+    cache_setup(cache, name, size, align, ctor);
+    return cache;
+}
 
-void free_list_init(int order) 
+/**
+ * @brief Add an empty slab to a cache.
+ * 
+ * @param cache cache to grow
+ * @return kmem_slab_t* the new slab, NULL if out of memory
+ */
+static kmem_slab_t* cache_grow(kmem_cache_t* cache)
 {
-    buddy* fl = &free_list[order];
-    free_area[order].free_list = fl;
-    fl->last = fl;
-    fl->next = fl;
+    kmem_slab_t* slab;
+    int32_t* bufctl;
+    uint32_t i;
+
+    if((slab = get_page(cache->order)) == NULL)
+        return NULL;
+    set_page_owner(slab, cache->order, PG_SLAB);
+
+    slab->cache = cache;
+    slab->inuse = 0;
+    slab->free = 0;
+
+    bufctl = slab_bufctl(slab);
+    for(i = 0; i < cache->num; i++)             /* chain all objects as free */
+        bufctl[i] = i + 1;
+    bufctl[cache->num - 1] = -1;
+
+    if(cache->ctor) {
+        for(i = 0; i < cache->num; i++)
+            cache->ctor((void*)((uint32_t)slab + cache->offset + i * cache->size));
+    }
+
+    list_add(&slab->list, &cache->slabs_free);
+    return slab;
 }
 
-void free_list_push(buddy* fl, buddy* b) 
+/**
+ * @brief Find the slab of an object through the frame descriptors.
+ * Slabs are buddy blocks, so they are aligned to their own size.
+ */
+static inline kmem_slab_t* obj_to_slab(void* obj)
 {
-    buddy* prev = fl->last;
-    b->last = prev;
-    b->next = fl;
-    prev->next = b;
-    fl->last = b;
+    return (kmem_slab_t*)((uint32_t)obj & ~((PAGE_SIZE << virt_to_page(obj)->order) - 1));
 }
 
-buddy* free_list_pop(buddy* fl) 
+/**
+ * @brief Allocate an object from a cache.
+ * 
+ * @param cache the cache
+ * @return void* the object, NULL if out of memory
+ */
+void* kmem_cache_alloc(kmem_cache_t* cache)
 {
-    buddy* head = fl->next;
-    if(head == fl) 
+    kmem_slab_t* slab;
+    void* obj;
+    uint32_t flags;
+
+    spin_lock_irqsave(&cache->lock, flags);
+    if(!list_empty(&cache->slabs_partial)) {
+        slab = list_entry(cache->slabs_partial.next, kmem_slab_t, list);
+    } else if(!list_empty(&cache->slabs_free)) {
+        slab = list_entry(cache->slabs_free.next, kmem_slab_t, list);
+    } else if((slab = cache_grow(cache)) == NULL) {
+        spin_unlock_irqrestore(&cache->lock, flags);
         return NULL;
-    head->next->last = fl;
-    fl->next = head->next;
-    return head;
-}
+    }
 
-void slab_list_push(slab_t* list, slab_t* s)
-{
-    slab_t* prev = list->last;
-    s->last = prev;
-    s->next = list;
-    prev->next = s;
-    list->last = s;
+    obj = (void*)((uint32_t)slab + cache->offset + slab->free * cache->size);
+    slab->free = slab_bufctl(slab)[slab->free];
+
+    /* move the slab when it leaves the free or the partial state */
+    if(slab->free == -1) {
+        list_del(&slab->list);
+        list_add(&slab->list, &cache->slabs_full);
+    } else if(slab->inuse == 0) {
+        list_del(&slab->list);
+        list_add(&slab->list, &cache->slabs_partial);
+    }
+    slab->inuse++;
+    spin_unlock_irqrestore(&cache->lock, flags);
+
+    return obj;
 }
 
-void slab_list_remove(slab_t* b)
+/**
+ * @brief Return an object to its cache. An empty slab is given back 
+ * to the buddy allocator if the cache already keeps an empty one.
+ * 
+ * @param cache the cache of the object
+ * @param obj the object, does nothing if NULL
+ */
+void kmem_cache_free(kmem_cache_t* cache, void* obj)
 {
-    b->last->next = b->next;
-    b->next->last = b->last;
-}
+    kmem_slab_t* slab;
+    uint32_t i, flags;
 
+    if(!obj)
+        return;
 
+    slab = obj_to_slab(obj);
+    if(slab->cache != cache)
+        panic("kmem_cache_free: wrong cache");
+
+    spin_lock_irqsave(&cache->lock, flags);
+    i = ((uint32_t)obj - (uint32_t)slab - cache->offset) / cache->size;
+    slab_bufctl(slab)[i] = slab->free;
+    slab->free = i;
+
+    if(--slab->inuse == 0) {
+        list_del(&slab->list);
+        if(!list_empty(&cache->slabs_free)) {
+            spin_unlock_irqrestore(&cache->lock, flags);
+            set_page_owner(slab, cache->order, PG_NONE);
+            free_page(slab, cache->order);
+            return;
+        }
+        list_add(&slab->list, &cache->slabs_free);
+    } else if(slab->inuse == cache->num - 1) {
+        list_del(&slab->list);
+        list_add(&slab->list, &cache->slabs_partial);
+    }
+    spin_unlock_irqrestore(&cache->lock, flags);
+}
@@ -1,64 +1,146 @@
+/**
+ * @file pid.c
+ * @brief Process id allocation and lookup.
+ * @overview:
+ * Free pids are kept in a bitmap of PID_SIZE bits, searched a 32-bit word
+ * at a time from the last pid handed out: pids go round the whole range
+ * before one is reused, and a freed pid is not given out again at once.
+ *
+ * The tasks of the task queue are also kept in a hash table by pid, so
+ * finding a task by its pid does not walk the task queue. The hash table
+ * is protected by tasklist_lock, like the task queue.
+ *
+ */
+
 #include <pro/pid.h>
 #include <types.h>
+#include <spinlock.h>
 #include <errno.h>
 #include <lib.h>
 
-// uint8_t pidmap[BITMAP_SIZE];
-pid_t size;
+static uint32_t pidmap[PIDMAP_WORDS];           /* bit set: pid in use */
+static pid_t last_pid;                          /* last pid handed out */
+static DEFINE_SPINLOCK(pidmap_lock);            /* the bitmap and last_pid */
+
+static list_head pid_hash[PIDHASH_SIZE];        /* tasks by pid, linked by pid_node */
+
 
 /**
  * @brief Allocate a new process id for the current process
  * 
- * @return pid_t : The process id
+ * @return int32_t : The process id, -EAGAIN if all are in use
  */
-pid_t alloc_pid() {
-    int i;
-    // int i, j, mask;
-    
-    if (size < BITMAP_SIZE) {
-        i = size++;
-        return i;
-    }
+int32_t alloc_pid(void) {
+    uint32_t flags;
+    uint32_t i, w, free;
+    pid_t start;
+    int32_t pid = -EAGAIN;
+
+    spin_lock_irqsave(&pidmap_lock, flags);
 
-    // mask = 0x1;
-    // for (i = 0; i < BITMAP_SIZE; ++i) {
-    //     uint8_t pid_group = pidmap[i];
-    //     j = 0;
+    start = last_pid + 1;
+    if (start >= PID_SIZE)
+        start = RESERVED_PIDS;
 
-    //     while (j < 8) {
-    //         if (!(pid_group & (mask << j))) {
-    //             return i * 8 + j;
-    //         }
-    //         j++;
-    //     }
-    // }
+    /* the free bits of the first word from the cursor on, then whole
+     * words; one more turn covers the first word below the cursor */
+    w = start / BITS_PER_WORD;
+    free = ~pidmap[w] & (~0U << (start % BITS_PER_WORD));
+
+    for (i = 0; i <= PIDMAP_WORDS; ++i) {
+        if (free) {
+            free = ffs(free) - 1;
+            pidmap[w] |= 1U << free;
+            last_pid = pid = w * BITS_PER_WORD + free;
+            break;
+        }
+        w = (w + 1) % PIDMAP_WORDS;
+        free = ~pidmap[w];
+    }
+
+    spin_unlock_irqrestore(&pidmap_lock, flags);
 
     /* resource temporarily unavailable */
-    return -EAGAIN;
+    return pid;
+}
+
+
+/**
+ * @brief give a process id back
+ * 
+ * @param pid : the process id
+ */
+void free_pid(pid_t pid) {
+    uint32_t flags;
+
+    if (pid < RESERVED_PIDS || pid >= PID_SIZE)
+        return;
+
+    spin_lock_irqsave(&pidmap_lock, flags);
+    pidmap[pid / BITS_PER_WORD] &= ~(1U << (pid % BITS_PER_WORD));
+    spin_unlock_irqrestore(&pidmap_lock, flags);
 }
 
 
 /**
- * @brief init the pidmap, calling only by the init process
+ * @brief init the pidmap and the pid hash, calling only by the init process
  * 
  */
-void pidmap_init() {
-    // memset((void *)pidmap, 0, BITMAP_SIZE);
-    size = 2;   /* 0, 1 are allocted by idle and init process */
+void pidmap_init(void) {
+    uint32_t i, flags;
+
+    memset((void *)pidmap, 0, sizeof(pidmap));
+
+    /* 0, 1 are allocted by idle and init process */
+    for (i = 0; i < RESERVED_PIDS; ++i)
+        pidmap[0] |= 1U << i;
+    last_pid = RESERVED_PIDS - 1;
+
+    for (i = 0; i < PIDHASH_SIZE; ++i)
+        INIT_LIST_HEAD(&pid_hash[i]);
+
+    spin_lock_irqsave(&tasklist_lock, flags);
+    attach_pid(init);
+    spin_unlock_irqrestore(&tasklist_lock, flags);
 }
 
 
 /**
- * @brief Kill the current pid
+ * @brief put a task in the pid hash, tasklist_lock must be held
  * 
- * @return return the previous pid
+ * @param task : task with its pid set
  */
-pid_t kill_pid() {
-    if (size > 2)
-        return --size;
-    
-    return -1;
+void attach_pid(thread_t *task) {
+    list_add(&task->pid_node, &pid_hash[pid_hashfn(task->pid)]);
+}
+
 
+/**
+ * @brief take a task out of the pid hash, tasklist_lock must be held
+ * 
+ * @param task : task in the pid hash
+ */
+void detach_pid(thread_t *task) {
+    list_del(&task->pid_node);
 }
 
 
+/**
+ * @brief find a task by its pid, tasklist_lock must be held (the task
+ * can not be freed while it is)
+ * 
+ * @param pid : process id
+ * @return thread_t* : the task, NULL if there is no (living) task with this pid
+ */
+thread_t *find_task_by_pid(pid_t pid) {
+    list_head *node;
+    thread_t *task;
+
+    list_for_each(node, &pid_hash[pid_hashfn(pid)]) {
+        task = list_entry(node, thread_t, pid_node);
+        if (task->pid == pid)
+            return task->state != EXITED ? task : NULL;
+    }
+
+    return NULL;
+}
@@ -43,18 +43,45 @@ uint32_t ntask;                 /* current number of tasks created */
 console_t **consoles;           /* array of consoles containing one running task */
 console_t *current;             /* current console */
 LIST_HEAD(task_queue);          /* list of all tasks (idle -> init -> {user task}) */
+DEFINE_SPINLOCK(tasklist_lock); /* protects task_queue */
 LIST_HEAD(wait_queue);          /* list of sleeping tasks (idle -> {sleeping user task || init}) */
 
+kmem_cache_t *context_cachep;   /* cache of context_t */
+kmem_cache_t *argv_cachep;      /* cache of argv_t */
+kmem_cache_t *files_cachep;     /* cache of files */
+kmem_cache_t *terminal_cachep;  /* cache of terminal_t */
+kmem_cache_t *vm_area_cachep;   /* cache of vm_area_t */
+
 /* local helper functions */
-static int32_t __exec(thread_t *current, const int8_t *cmd, uint8_t kthread);
-static int32_t process_create(thread_t *current, uint8_t kthread);
+static int32_t __exec(thread_t *current, const int8_t *cmd, uint8_t kthread, thread_t **childp);
+static thread_t *process_create(thread_t *current, uint8_t kthread);
 static int32_t process_clone(thread_t *parent, thread_t *child);
 static int32_t parse_arg(int8_t *cmd, int8_t *argv[]);
 static inline void switch_to_user(thread_t *curr);
 static void console_init(void);
 static inline void update_tss(thread_t *curr);
-static inline void place_children(thread_t *task);
-static inline void overflow_children(thread_t *task);
+static void place_children(thread_t *task);
+static void argv_ctor(void *obj);
+static inline int8_t **argv_alloc(void);
+static inline void argv_reset(int8_t **argv);
+static inline void argv_free(int8_t **argv);
+
+
+/**
+ * @brief create the object caches of the process management unit
+ * (called once after kmalloc_init)
+ * 
+ */
+void proc_caches_init(void) {
+    context_cachep = kmem_cache_create("context_t", sizeof(context_t), CACHE_LINE, NULL);
+    argv_cachep = kmem_cache_create("argv_t", sizeof(argv_t), CACHE_LINE, argv_ctor);
+    files_cachep = kmem_cache_create("files", sizeof(files), CACHE_LINE, NULL);
+    terminal_cachep = kmem_cache_create("terminal_t", sizeof(terminal_t), CACHE_LINE, NULL);
+    vm_area_cachep = kmem_cache_create("vm_area_t", sizeof(vm_area_t), CACHE_LINE, NULL);
+
+    if (!context_cachep || !argv_cachep || !files_cachep || !terminal_cachep || !vm_area_cachep)
+        panic("proc_caches_init: out of memory");
+}
 
 
 /**
@@ -105,7 +132,7 @@ void inline context_switch(thread_t *prev, thread_t *next) {
     if (next != init)
         update_tss(next);
 
-    swtch(prev->context, next->context);
+    swtch(prev->context, next->context, &prev->on_cpu);
 }
 
 /**
@@ -113,6 +140,7 @@ void inline context_switch(thread_t *prev, thread_t *next) {
  * 
  * @param parent : current process
  * @param kthread : is the new thread a kernel thread?
+ * @param childp : set to the new child on success
  * @return int32_t : 0 - to child
  *                 < 0 - error number
  *                 > 0 - pid of the child process
@@ -122,43 +150,53 @@ void inline context_switch(thread_t *prev, thread_t *next) {
  * 
  * pid 0 is reserved by the kernel, which will not be
  * used by the user.
+ * 
+ * The child is not runnable yet: the caller builds its kernel context and 
+ * starts it with wake_up_new_task().
  */
-int32_t do_fork(thread_t *parent, uint8_t kthread) {
+int32_t do_fork(thread_t *parent, uint8_t kthread, thread_t **childp) {
     thread_t *child;
     int32_t errno;
 
     /* create child process */
-    if ((errno = process_create(parent, kthread)) < 0)
-        return errno;
+    if ((child = process_create(parent, kthread)) == NULL)
+        return -EAGAIN;
 
-    child = parent->children[parent->n_children - 1];
-
-    /* clone thread info of child from parent */
-    if (process_clone(parent, child) < 0) {
+    /* clone thread info of child from parent, what is copied so far
+     * is released with the child */
+    if ((errno = process_clone(parent, child)) < 0) {
         process_free(child);
-        return -1;
+        return errno;
     }
 
     /* set up terminal for process */
     child->terminal = parent->terminal;
-        
-    /* set up sched info for child */
-    sched_fork(child); 
-    
-    activate_task(child);
+
+    child->console_id = parent->console_id;
 
     ntask++;  
 
     child->context->eax = 0;    
 
-    /* map to parent's address space */
-    __umap(child, parent);
-
+    *childp = child;
     return child->pid;
 }
 
 
 
+/**
+ * @brief make a new task runnable once its kernel context is complete,
+ * it may be picked by another processor right away
+ * 
+ * @param child : task from do_fork() or do_execute()
+ */
+void wake_up_new_task(thread_t *child) {
+    sched_fork(child);
+    activate_task(child);
+}
+
+
+
 /**
  * @brief clone parent's state into child
  * 
@@ -178,10 +216,8 @@ static int32_t process_clone(thread_t *parent, thread_t *child) {
     
     /* copy arguments */
     child->argc = parent->argc;
-    child->argv = kmalloc(MAXARGS * sizeof(int8_t*));
-
-    for (i = 0; i < MAXARGS; ++i)
-        child->argv[i] = kmalloc(ARGSIZE);    
+    if ((child->argv = argv_alloc()) == NULL)
+        return -ENOMEM;
 
     for (i = 0; i < child->argc; ++i)
         strcpy(child->argv[i], parent->argv[i]);
@@ -232,12 +268,15 @@ void do_exit(uint32_t status) {
     parent = child->parent;
 
     /* if it has children runnable/sleeping */
-    if (child->n_children) {
+    if (!list_empty(&child->children)) {
         /* leave its children to its parent's parnent */
         place_children(child);
     }
     
     ntask--;
+
+    /* the alarm must not fire on a freed task */
+    del_timer(&child->real_timer);
     
     /* when wait syscall is implement, the parent will get the exit status */
 
@@ -254,44 +293,49 @@ void do_exit(uint32_t status) {
  * 
  * @param parent : current process
  * @param cmd : the program name with arguments
+ * @param childp : set to the new child before it may run
  * @return int32_t : positive or 0 denote success, negative values denote an error condition
  */
-int32_t do_execute(thread_t *parent, const int8_t *cmd) {
+int32_t do_execute(thread_t *parent, const int8_t *cmd, thread_t **childp) {
     thread_t *child;  
     int32_t errno;
     
     /* call _exec to create the new thread and execute it
      * (only return here when error occurs) */
-    if ((errno = __exec(parent, cmd, 0)) < 0) {
+    if ((errno = __exec(parent, cmd, 0, &child)) < 0) {
         return errno;
     }
 
-    child = parent->children[parent->n_children - 1];
-
     /* set up terminal for process */
     child->terminal = parent->terminal;
 
     child->console_id = parent->console_id;
 
-    /* set up sched info */
-    sched_fork(child);
-    activate_task(child);
+    /* the child runs in the foreground of the console of its parent */
+    consoles[child->console_id]->task = child;
+
+    *childp = child;
 
     /* get child esp */
     child->context->esp = get_esp0(child);
     child->context->ebp = child->context->esp;
 
 
-    /* save current context to child and switch parent to sys_execute
+    /* save current context to child, start it once its eip is set (another 
+     * processor may run it right away) and return 0 to sys_execute in parent,
      * when scheduler preempt to child, child will goto line 287 */
     asm volatile("                              \n\
                   movl  $1f,   %[child_eip]     \n\
+                  pushl %[child]                \n\
+                  call  wake_up_new_task        \n\
+                  addl  $4,    %%esp            \n\
+                  xorl  %%eax, %%eax            \n\
                   leave                         \n\
                   ret                           \n\
                   1:                            \n\
                   "                                 
                 : [child_eip] "=m"(child->context->eip)
-                :
+                : [child] "rm"(child)
                 : "memory" 
     );
 
@@ -320,9 +364,10 @@ int32_t do_execv(thread_t *curr, const int8_t *pathname, int8_t *const argv[]) {
     uint32_t EIP_reg;
 
     curr->argc = 0;
+    argv_reset(curr->argv);
 
     /* update argument lists */
-    for (i = 0; argv[i]; ++i) {
+    for (i = 0; argv[i] && i < MAXARGS; ++i) {
         strcpy((char*)(curr->argv[i]), (char*)(argv[i]));
         if (curr->argv[i][strlen(curr->argv[i]) - 1] == '\n')
             curr->argv[i][strlen(curr->argv[i]) - 1] = '\0';
@@ -330,7 +375,7 @@ int32_t do_execv(thread_t *curr, const int8_t *pathname, int8_t *const argv[]) {
     } 
 
     /* set next byte to null */
-    if (curr->argc < MAXARGS) curr->argv[curr->argc] = NULL;
+    curr->argv[curr->argc] = NULL;
 
     /* executable check and load program image into user's memory */
     if ((errno = pro_loader(curr->argv[0], &EIP_reg, curr)) < 0) {
@@ -338,10 +383,8 @@ int32_t do_execv(thread_t *curr, const int8_t *pathname, int8_t *const argv[]) {
     }
 
     /* clear fds */
-    if (curr->fds) {
-        kfree(curr->fds);
+    if (curr->fds)
         fd_init(curr);
-    }
 
     /* update nice values */
     if (!strcmp(argv[0], SHELL))
@@ -365,34 +408,31 @@ int32_t do_execv(thread_t *curr, const int8_t *pathname, int8_t *const argv[]) {
  * @param parent: the new thread 
  * @param cmd : command line arguments
  * @param kthread : 1 if it is kernel thread, 0 otherwie
+ * @param childp : set to the new thread on success
  * @return int32_t : positive or 0 denote success, negative values denote an error condition
  */
-static int32_t __exec(thread_t *parent, const int8_t *cmd, uint8_t kthread) {
-    int i;
+static int32_t __exec(thread_t *parent, const int8_t *cmd, uint8_t kthread, thread_t **childp) {
     thread_t *child;
     int32_t errno;
     int32_t argc;
     uint32_t EIP_reg;
 
     /* arguments array for child */
-    int8_t **argv = kmalloc(MAXARGS * sizeof(int8_t*));
-    for (i = 0; i < MAXARGS; ++i)
-        argv[i] = kmalloc(ARGSIZE);
+    int8_t **argv = argv_alloc();
+    if (!argv)
+        return -ENOMEM;
 
     /* parse arguments */
     if ((argc = parse_arg((int8_t *)cmd, argv)) < 0) {
-        kfree(argv);
+        argv_free(argv);
         return argc;
     }
 
     /* create process */
-    if ((errno = process_create(parent, kthread)) < 0) {
-        kfree(argv);
-        return errno;
+    if ((child = process_create(parent, kthread)) == NULL) {
+        argv_free(argv);
+        return -EAGAIN;
     }
-    
-    /* get child thread */
-    child = parent->children[parent->n_children - 1];
 
     child->argc = argc;
     child->argv = argv;
@@ -407,9 +447,10 @@ static int32_t __exec(thread_t *parent, const int8_t *cmd, uint8_t kthread) {
         return errno;
     }
 
-    /* unmap user space when creating kernel threads */
-    if (kthread)
-        user_mem_unmap(child);
+    /* back to the address space of the parent: the child may run on another
+     * processor while the parent goes on here (kernel threads are created 
+     * by init, which runs on the kernel page directory) */
+    __umap(child, parent);
 
     /* init file array */
     if ((errno = fd_init(child)) < 0) {
@@ -430,6 +471,7 @@ static int32_t __exec(thread_t *parent, const int8_t *cmd, uint8_t kthread) {
     /* increment number of tasks */
     ntask++;
     
+    *childp = child;
     return 0;
 }
 
@@ -500,17 +542,22 @@ static int32_t parse_arg(int8_t *cmd, int8_t *argv[]) {
  * 
  * @param current : the current thread
  * @param kthread : is the thread a kernel thread?
- * @return int32_t : positive or 0 denote success, negative values denote an error condition
+ * @return thread_t* : the new thread, linked to its parent, NULL if there
+ * is no free pid or no memory for its stack
  */
-static int32_t process_create(thread_t *current, uint8_t kthread) {
-    pid_t pid;
+static thread_t *process_create(thread_t *current, uint8_t kthread) {
+    int32_t pid;
     process_t *p;
     thread_t *t;
+    uint32_t flags;
 
     if ((pid = alloc_pid()) < 0) 
         return NULL;
 
-    p = (process_t *)alloc_kstack();
+    if ((p = (process_t *)alloc_kstack()) == NULL) {
+        free_pid(pid);
+        return NULL;
+    }
     t = &p->thread;
     
     /* setup current pid */
@@ -520,33 +567,45 @@ static int32_t process_create(thread_t *current, uint8_t kthread) {
     t->parent = current;
 
     /* allocate memory for context */
-    t->context = kmalloc(sizeof(context_t));
-
-    if (!current->children)
-        current->children = children_create();
-    
-    /* check if max_children is full */
-    overflow_children(current);
-
-    /* update parent's children list */
-    current->children[current->n_children++] = t;
+    t->context = kmem_cache_alloc(context_cachep);
 
-    t->children = NULL;
+    /* no file table yet (see fd_init() and fdcopy()) */
+    t->fds = NULL;
 
-    t->n_children = 0;
-
-    t->max_children = MAXCHILDREN;
+    INIT_LIST_HEAD(&t->children);
     
     /* not a kernel thread */
     t->kthread = kthread;
 
     t->state = UNUSED;
 
+    t->cpu = smp_processor_id();
+
+    t->on_cpu = 0;
+
+    /* the scheduling policy is inherited */
+    t->policy = current->policy;
+    t->rt_info.priority = current->rt_info.priority;
+    t->rt_info.time_slice = RR_TIMESLICE;
+    t->rt_info.on_rq = 0;
+
+    /* no alarm is inherited */
+    init_timer(&t->real_timer);
+    init_waitqueue_head(&t->timer_wait);
+    t->timer_flags = 0;
+
+    schedstat_init_task(t);
+
     process_vm_init(&t->vm);
 
+    spin_lock_irqsave(&tasklist_lock, flags);
     list_add_tail(&t->task_node, &task_queue);
+    attach_pid(t);
+    /* update parent's children list */
+    list_add_tail(&t->sibling, &current->children);
+    spin_unlock_irqrestore(&tasklist_lock, flags);
 
-    return 0;
+    return t;
 }
 
 
@@ -556,37 +615,41 @@ static int32_t process_create(thread_t *current, uint8_t kthread) {
  * @param current : the process to be freed
  */
 void process_free(thread_t *current) {
-    int i;
+    uint32_t flags;
     thread_t *parent;
     
     if (!current) return;
 
     parent = current->parent;
 
-    kill_pid(current->pid);
-    kfree(current->context);
-    kfree(current->fds);
+    /* an exited task may still be leaving its stack on another processor */
+    while (current->on_cpu)
+        cpu_relax();
 
-    for (i = 0; i < MAXARGS; ++i)
-        kfree(current->argv[i]);
-    kfree(current->argv);
-
-    if (current->children) {
-        for (i = 0; i < current->max_children; ++i)
-            kfree(current->children[i]);
-        kfree(current->children);
-    }
+    kmem_cache_free(context_cachep, current->context);
+    fd_release(current->fds);
+    kmem_cache_free(files_cachep, current->fds);
+    argv_free(current->argv);
 
     if (current->state != EXITED) {
         __umap(current, current->parent);
         update_tss(parent);
     }
 
+    /* drop the user frames and page tables of the child */
+    free_vm(current);
+    pgdir_free(current->vm.pgdir);
+
+    spin_lock_irqsave(&tasklist_lock, flags);
     list_del(&current->task_node);
+    detach_pid(current);
+    list_del(&current->sibling);
+    spin_unlock_irqrestore(&tasklist_lock, flags);
 
-    free_kstack((void*)current);
+    /* nobody finds the task by its pid any more */
+    free_pid(current->pid);
 
-    parent->children[--parent->n_children] = NULL;
+    free_kstack((void*)current);
 }
 
 
@@ -627,13 +690,15 @@ static inline void switch_to_user(thread_t *curr) {
 
 
 /**
- * @brief update tss entry for ss0 and esp0
+ * @brief update the tss of this processor for ss0 and esp0
  * 
  * @param _pid : process id
  */
 static inline void update_tss(thread_t *curr) {
-    tss.ss0 = KERNEL_DS;
-    tss.esp0 = get_esp0(curr);
+    tss_t *t = cpu_tss[smp_processor_id()];
+
+    t->ss0 = KERNEL_DS;
+    t->esp0 = get_esp0(curr);
 }
 
 
@@ -662,8 +727,8 @@ static void console_init(void) {
     
     /* create consoles */
     for (i = 0; i < NTERMINAL; ++i) {
-        (void) __exec(init, SHELL, 1); 
-        shell = init->children[i];
+        if (__exec(init, SHELL, 1, &shell) < 0)
+            panic("console_init: can not start a shell");
         shell->state = UNUSED;
         shell->context->esp = get_esp0(shell);
         shell->context->ebp = shell->context->esp;
@@ -672,25 +737,22 @@ static void console_init(void) {
         console->fkey = keys[i];
         console->task = shell;
         console->vidmap = (uint8_t*)(VIR_VID_MEM + VIDEO + PAGE_SIZE * i);
+        if ((console->tg = sched_group_create()) == NULL)
+            panic("console_init: out of memory");
         consoles[i] = console;
         shell->console_id = console->id;
         shell->terminal = terminal_create();
-        shell->terminal->saved_vidmem = (char*) (VIDEO_BUF_1 + i * PAGE_SIZE);       /* create video memory */
-        shell->terminal->vidmem = shell->terminal->saved_vidmem;  /* save back up video memory */
-        memset(shell->terminal->saved_vidmem, 0, PAGE_SIZE);
+        shell->terminal->vidmem = video_mem + i * VIDMEM_SIZE;    /* its own page of VGA memory */
+        if (i)
+            vga_clear(shell->terminal->vidmem);     /* the first one keeps the boot messages */
     }
 
-    shell = init->children[0];
-    shell->sched_info.on_rq = 1;
-    shell->state = RUNNABLE;
+    shell = consoles[0]->task;
     current = consoles[0];
-    rq->current = &shell->sched_info;
-
-
-    /* give the first shell vga memory */
-    shell->terminal->vidmem = video_mem;
 
+    /* the first shell (and its console group) runs on this processor */
     sched_fork(shell);
+    set_curr_task(shell);
     // activate_task(shell);
 
     user_mem_map(shell);
@@ -707,7 +769,7 @@ static void console_init(void) {
                   call  switch_to_user          \n\
                   1:                            \n\
                   "       
-                : [eip1] "=m"(init->children[1]->context->eip), [eip2] "=m"(init->children[2]->context->eip)
+                : [eip1] "=m"(consoles[1]->task->context->eip), [eip2] "=m"(consoles[2]->task->context->eip)
                 : [shell] "rm"(shell)
                 : "memory" 
     );
@@ -720,54 +782,72 @@ static void console_init(void) {
 
 
 /**
- * @brief create a children list
+ * @brief place task's children to its parent
  * 
- * @return thread_t** : children list
+ * @param task : a thread
  */
-thread_t **children_create(void) {
-    int i;
-    thread_t **children = kmalloc(MAXCHILDREN * sizeof(thread_t*));
-    
-    for (i = 0; i < MAXCHILDREN; ++i) {
-        children[i] = kmalloc(sizeof(thread_t));
-    }
-    return children;
+static void place_children(thread_t *task) {
+    thread_t *parent_of_parent = task->parent;
+    list_head *node;
+    uint32_t flags;
+
+    spin_lock_irqsave(&tasklist_lock, flags);
+
+    list_for_each(node, &task->children)
+        list_entry(node, thread_t, sibling)->parent = parent_of_parent;
+
+    list_splice_tail_init(&task->children, &parent_of_parent->children);
+
+    spin_unlock_irqrestore(&tasklist_lock, flags);
 }
 
 
 
+/**
+ * @brief constructor of argv_t objects, points every argument 
+ * to its own storage
+ * 
+ * @param obj : a new argv_t
+ */
+static void argv_ctor(void *obj) {
+    argv_reset(((argv_t *)obj)->argv);
+}
+
 
 /**
- * @brief place task's children to init
+ * @brief allocate an argument vector
  * 
- * @param task : a thread
+ * @return int8_t** : MAXARGS argument buffers of ARGSIZE bytes, NULL on failure
+ */
+static inline int8_t **argv_alloc(void) {
+    argv_t *argv = kmem_cache_alloc(argv_cachep);
+    return argv ? argv->argv : NULL;
+}
+
+
+/**
+ * @brief point the arguments back to their storage
+ * (parsing stores NULL after the last argument)
+ * 
+ * @param argv : argument vector from argv_alloc
  */
-static inline void place_children(thread_t *task) {
+static inline void argv_reset(int8_t **argv) {
     int i;
-    thread_t *parent_of_parent = task->parent;
+    argv_t *a = (argv_t *)argv;
 
-    for (i = 0; i < task->n_children; ++i) {
-        overflow_children(parent_of_parent);
-        parent_of_parent->children[parent_of_parent->n_children++] = task->children[i];
-        task->children[i]->parent = parent_of_parent;
-    }
+    for (i = 0; i < MAXARGS; ++i)
+        a->argv[i] = a->buf[i];
+    a->argv[MAXARGS] = NULL;
 }
 
 
 /**
- * @brief reallocate children list when size reaches max_children
+ * @brief free an argument vector, in its constructed state
  * 
- * @param task : a thread
+ * @param argv : argument vector from argv_alloc
  */
-static inline void overflow_children(thread_t *task) {
-    thread_t **children; 
-
-    if (task->n_children == task->max_children) {
-        children = kmalloc(task->max_children * 2 * sizeof(thread_t*));
-        memcpy((void*)children, (void*)task->children, task->max_children * sizeof(thread_t *));
-        task->max_children *= 2;
-        kfree(task->children);
-        task->children = children;
-    } 
+static inline void argv_free(int8_t **argv) {
+    if (!argv) return;
+    argv_reset(argv);
+    kmem_cache_free(argv_cachep, argv);
 }
-
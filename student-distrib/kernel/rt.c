@@ -0,0 +1,232 @@
+/**
+ * @file rt.c
+ * @brief Real-time scheduling class (SCHED_FIFO and SCHED_RR).
+ * @overview:
+ * A runnable real-time task always runs before the CFS tasks of its
+ * processor, the one of the highest priority first. SCHED_FIFO tasks run
+ * until they block or a higher priority shows up, SCHED_RR tasks also
+ * give the processor to the next task of their priority every
+ * RR_TIMESLICE.
+ *
+ * Throttling keeps a runaway real-time task from locking out the shells:
+ * once real-time tasks have used RT_RUNTIME of a RT_PERIOD, the CFS tasks
+ * run until the period ends (if there is none, real-time tasks go on).
+ *
+ * All functions are called with the lock of the run queue of the
+ * processor held (see cfs.c).
+ *
+ */
+
+#include <pro/rt.h>
+#include <pro/process.h>
+#include <drivers/clocksource.h>
+#include <kmalloc.h>
+#include <lib.h>
+
+/* the real-time run queue of each processor */
+rt_rq *rt_runqueues[NR_CPUS];
+
+static void update_curr_rt(rt_rq *rt, thread_t *curr, uint64_t now);
+static inline uint32_t rt_index(uint32_t priority);
+
+
+/**
+ * @brief create the real-time run queue of every processor
+ *
+ */
+void rt_init(void) {
+    uint32_t cpu, i;
+    rt_rq *rt;
+
+    for (cpu = 0; cpu < NR_CPUS; ++cpu) {
+        if ((rt = kmalloc(sizeof(rt_rq))) == NULL)
+            panic("rt_init: out of memory");
+
+        for (i = 0; i < MAX_RT_PRIO; ++i)
+            INIT_LIST_HEAD(&rt->queue[i]);
+        rt->bitmap = 0;
+        rt->rt_nr_running = 0;
+        rt->rt_time = 0;
+        rt->period_start = 0;
+        rt->rt_throttled = 0;
+        rt_runqueues[cpu] = rt;
+    }
+}
+
+
+/**
+ * @brief put a task at the tail of the queue of its priority
+ *
+ * @param rt : real-time run queue
+ * @param task : a real-time task
+ */
+void enqueue_rt_task(rt_rq *rt, thread_t *task) {
+    sched_rt_t *s = &task->rt_info;
+    uint32_t i = rt_index(s->priority);
+
+    if (s->on_rq) return;
+
+    list_add_tail(&s->run_node, &rt->queue[i]);
+    rt->bitmap |= 1 << i;
+    rt->rt_nr_running++;
+    s->on_rq = 1;
+}
+
+
+/**
+ * @brief take a task off the run queue
+ *
+ * @param rt : real-time run queue
+ * @param task : a real-time task
+ */
+void dequeue_rt_task(rt_rq *rt, thread_t *task) {
+    sched_rt_t *s = &task->rt_info;
+    uint32_t i = rt_index(s->priority);
+
+    if (!s->on_rq) return;
+
+    list_del(&s->run_node);
+    if (list_empty(&rt->queue[i]))
+        rt->bitmap &= ~(1 << i);
+    rt->rt_nr_running--;
+    s->on_rq = 0;
+}
+
+
+/**
+ * @brief pick the first task of the highest priority. It stays on
+ * its queue while it runs.
+ *
+ * @param rt : real-time run queue
+ * @param nr_fair : number of CFS tasks waiting
+ * @return thread_t* : the task, NULL if there is none or the fair
+ * tasks have to run because of throttling
+ */
+thread_t *pick_next_rt_task(rt_rq *rt, uint32_t nr_fair) {
+    sched_rt_t *s;
+
+    if (!rt->bitmap) return NULL;
+
+    /* out of budget: the fair tasks get the rest of the period */
+    if (rt->rt_throttled && nr_fair) return NULL;
+
+    s = list_entry(rt->queue[ffs(rt->bitmap) - 1].next, sched_rt_t, run_node);
+    s->exec_start = sched_clock();
+
+    return rt_task_of(s);
+}
+
+
+/**
+ * @brief account the runtime of a real-time task giving up the processor
+ *
+ * @param rt : real-time run queue
+ * @param prev : the task
+ */
+void put_prev_rt_task(rt_rq *rt, thread_t *prev) {
+    update_curr_rt(rt, prev, sched_clock());
+}
+
+
+/**
+ * @brief called on every timer tick of the processor, whatever class the
+ * running task belongs to: the throttling period goes on in any case.
+ *
+ * @param rt : real-time run queue
+ * @param curr : running task
+ * @param nr_fair : number of CFS tasks waiting
+ * @return int32_t : 1 if curr has to be rescheduled
+ */
+int32_t task_tick_rt(rt_rq *rt, thread_t *curr, uint32_t nr_fair) {
+    sched_rt_t *s = &curr->rt_info;
+    uint64_t now = sched_clock();
+    uint32_t i;
+    int32_t resched = 0;
+
+    if (rt_task(curr))
+        update_curr_rt(rt, curr, now);
+
+    /* a new period gives the budget back */
+    if (now - rt->period_start >= RT_PERIOD) {
+        rt->period_start = now;
+        rt->rt_time = 0;
+        if (rt->rt_throttled) {
+            rt->rt_throttled = 0;
+            if (!rt_task(curr) && rt->bitmap)
+                resched = 1;
+        }
+    }
+
+    if (!rt_task(curr)) return resched;
+
+    /* budget used up: let the fair tasks run. Checked on every tick, a
+     * fair task may have come since the budget ran out */
+    if (!rt->rt_throttled && rt->rt_time > RT_RUNTIME)
+        rt->rt_throttled = 1;
+
+    if (rt->rt_throttled && nr_fair)
+        resched = 1;
+
+    /* a SCHED_FIFO task has no timeslice */
+    if (curr->policy != SCHED_RR || s->time_slice)
+        return resched;
+
+    s->time_slice = RR_TIMESLICE;
+
+    /* go behind the other tasks of the same priority, if any */
+    i = rt_index(s->priority);
+    if (rt->queue[i].next != rt->queue[i].prev) {
+        list_del(&s->run_node);
+        list_add_tail(&s->run_node, &rt->queue[i]);
+        resched = 1;
+    }
+
+    return resched;
+}
+
+
+/**
+ * @brief check if a woken real-time task should preempt the running one
+ *
+ * @param curr : running task
+ * @param task : woken real-time task
+ * @return int32_t : 1 if curr has to be rescheduled
+ */
+int32_t check_preempt_rt(thread_t *curr, thread_t *task) {
+    if (!rt_task(curr))
+        return 1;
+
+    return task->rt_info.priority > curr->rt_info.priority;
+}
+
+
+/**
+ * @brief charge the time since the last update to a running real-time task
+ *
+ * @param rt : real-time run queue
+ * @param curr : the task
+ * @param now : current time in nanoseconds
+ */
+static void update_curr_rt(rt_rq *rt, thread_t *curr, uint64_t now) {
+    sched_rt_t *s = &curr->rt_info;
+    uint64_t delta = now - s->exec_start;
+
+    if ((int64_t)delta <= 0) return;
+
+    s->exec_start = now;
+    curr->sched_info.sum_exec_time += delta;
+    rt->rt_time += delta;
+
+    s->time_slice = (delta < s->time_slice) ? s->time_slice - delta : 0;
+}
+
+
+/**
+ * @brief priority => index of its queue, the highest priority first
+ *
+ * @param priority : 1 .. MAX_RT_PRIO - 1
+ * @return uint32_t : index to the queue array
+ */
+static inline uint32_t rt_index(uint32_t priority) {
+    return MAX_RT_PRIO - 1 - priority;
+}
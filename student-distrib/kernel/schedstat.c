@@ -0,0 +1,183 @@
+/**
+ * @file schedstat.c
+ * @brief Scheduler statistics.
+ * @overview:
+ * Every task counts how long it waited on a run queue and how often it
+ * gave up the processor by itself (sleeping, exiting) or was preempted.
+ * Every processor keeps log2 histograms of the wakeup latency, of the
+ * time tasks wait on its run queue and of the time they run before a
+ * switch, and samples the depth of its run queue on every tick.
+ *
+ * All functions are called with the lock of the run queue of the
+ * processor held (see cfs.c), except do_schedstat().
+ *
+ */
+
+#include <pro/schedstat.h>
+#include <pro/process.h>
+#include <drivers/clocksource.h>
+#include <errno.h>
+#include <lib.h>
+
+/* the statistics of each processor */
+schedstat_t schedstats[NR_CPUS];
+
+static void hist_add(uint32_t *hist, uint64_t ns);
+
+
+/**
+ * @brief clear the statistics of a new task
+ *
+ * @param task : task
+ */
+void schedstat_init_task(thread_t *task) {
+    memset(&task->stats, 0, sizeof(sched_stat_t));
+
+    /* a task made current directly (init, the first shell) starts now */
+    task->stats.wait_start = task->stats.run_start = sched_clock();
+}
+
+
+/**
+ * @brief a new task is put on a run queue
+ *
+ * @param task : task
+ * @param now : current time in nanoseconds
+ */
+void schedstat_enqueue(thread_t *task, uint64_t now) {
+    task->stats.wait_start = now;
+    task->stats.woken = 0;
+}
+
+
+/**
+ * @brief a sleeping task is put back on a run queue
+ *
+ * @param task : task
+ * @param now : current time in nanoseconds
+ */
+void schedstat_wakeup(thread_t *task, uint64_t now) {
+    sched_stat_t *st = &task->stats;
+
+    st->wait_start = now;
+    st->woken = 1;
+    st->nr_wakeups++;
+    cpu_schedstat(task->cpu)->nr_wakeups++;
+}
+
+
+/**
+ * @brief account a switch from prev to next. prev goes on waiting if it
+ * was preempted, next stops waiting.
+ *
+ * @param cpu : processor
+ * @param prev : task giving up the processor
+ * @param next : task picked
+ * @param now : current time in nanoseconds
+ */
+void schedstat_switch(uint32_t cpu, thread_t *prev, thread_t *next, uint64_t now) {
+    schedstat_t *cs = cpu_schedstat(cpu);
+    sched_stat_t *st;
+    uint64_t delta;
+
+    /* prev keeps the processor */
+    if (prev == next && prev->state == RUNNING)
+        return;
+
+    cs->nr_switches++;
+
+    /* the idle thread of a processor (pid 0) is not accounted */
+    if (prev->pid) {
+        st = &prev->stats;
+        hist_add(cs->slice, now - st->run_start);
+
+        if (prev->state == RUNNING) {
+            st->nr_involuntary++;
+            cs->nr_involuntary++;
+            st->wait_start = now;
+        } else {
+            st->nr_voluntary++;
+            cs->nr_voluntary++;
+        }
+    }
+
+    st = &next->stats;
+    delta = now - st->wait_start;
+
+    st->wait_sum += delta;
+    if (delta > st->wait_max)
+        st->wait_max = delta;
+    st->nr_runs++;
+    st->run_start = now;
+
+    hist_add(cs->wait, delta);
+    if (st->woken) {
+        hist_add(cs->wakeup, delta);
+        st->woken = 0;
+    }
+}
+
+
+/**
+ * @brief sample the depth of a run queue
+ *
+ * @param cpu : processor
+ * @param depth : number of tasks waiting
+ */
+void schedstat_tick(uint32_t cpu, uint32_t depth) {
+    if (depth >= NR_DEPTH)
+        depth = NR_DEPTH - 1;
+
+    cpu_schedstat(cpu)->depth[depth]++;
+}
+
+
+/**
+ * @brief add up the statistics of all processors
+ *
+ * @param buf : the sum is stored here
+ * @return int32_t : 0 on success, -EFAULT if buf is NULL
+ */
+int32_t do_schedstat(schedstat_t *buf) {
+    uint32_t cpu, i;
+    uint32_t *sum, *cs;
+    uint32_t flags;
+
+    if (!buf)
+        return -EFAULT;
+
+    memset(buf, 0, sizeof(schedstat_t));
+    sum = (uint32_t *)buf;
+
+    /* schedstat_t is made of counters only */
+    for (cpu = 0; cpu < nr_cpus; ++cpu) {
+        cs = (uint32_t *)cpu_schedstat(cpu);
+
+        spin_lock_irqsave(&cpu_rq(cpu)->lock, flags);
+        for (i = 0; i < sizeof(schedstat_t) / sizeof(uint32_t); ++i)
+            sum[i] += cs[i];
+        spin_unlock_irqrestore(&cpu_rq(cpu)->lock, flags);
+    }
+
+    return 0;
+}
+
+
+/**
+ * @brief count a time in its log2 bucket
+ *
+ * @param hist : histogram of NR_HIST buckets
+ * @param ns : time in nanoseconds
+ */
+static void hist_add(uint32_t *hist, uint64_t ns) {
+    uint32_t us, i;
+
+    if ((int64_t)ns < 0) ns = 0;
+    do_div(&ns, 1000);
+    us = (ns >> 32) ? 0xffffffff : (uint32_t)ns;
+
+    for (i = 0; us > 1 && i < NR_HIST - 1; us >>= 1)
+        ++i;
+
+    hist[i]++;
+}
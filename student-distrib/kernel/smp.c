@@ -0,0 +1,226 @@
+/**
+ * @file smp.c
+ * @brief Bring up the application processors.
+ * @overview:
+ * The boot processor wakes every other processor with the INIT-SIPI-SIPI
+ * sequence of the local APIC. They start in real mode in a trampoline
+ * copied below 1 MB, load the GDT of the kernel, turn on paging with the
+ * kernel page directory and take a processor number. Each one then loads
+ * its own TSS, starts its local APIC timer and idles in the scheduler
+ * until its run queue gets a task (or it takes one from a busier queue).
+ *
+ * The device interrupts stay with the boot processor (through the 8259),
+ * the others only get their timer and the reschedule IPI.
+ *
+ */
+
+#include <boot/smp.h>
+#include <boot/apic.h>
+#include <boot/page.h>
+#include <drivers/clocksource.h>
+#include <pro/process.h>
+#include <access.h>
+#include <spinlock.h>
+#include <lib.h>
+
+volatile uint32_t nr_cpus = 1;              /* processors online */
+volatile uint32_t smp_started;              /* set by sched_init() */
+tss_t *cpu_tss[NR_CPUS] = { &tss };         /* the boot processor uses the TSS of x86_desc.S */
+uint8_t cpu_apic_id[NR_CPUS];
+
+static tss_t ap_tss[NR_CPUS - 1];           /* TSS of the application processors */
+static thread_t *ap_idle[NR_CPUS];          /* idle thread of each application processor */
+
+static thread_t *idle_create(uint32_t cpu);
+static void idle_free(thread_t *t);
+static void tss_init(uint32_t cpu);
+
+
+/**
+ * @brief start the other processors and wait until they are online
+ *
+ */
+void smp_init(void) {
+    uint32_t i;
+    uint32_t arrived;
+    uint8_t *trampoline;
+
+    if (apic_init() < 0) {
+        printf("smp: no local APIC, 1 CPU\n");
+        return;
+    }
+
+    cpu_apic_id[0] = apic_id();
+
+    /* a processor starts on the stack of its idle thread */
+    for (i = 1; i < NR_CPUS; ++i) {
+        if ((ap_idle[i] = idle_create(i)) == NULL)
+            panic("smp_init: out of memory");
+        ap_stacks[i] = get_esp0(ap_idle[i]);
+    }
+
+    /* copy the trampoline and the GDT descriptor below 1 MB */
+    trampoline = kmap(AP_TRAMPOLINE);
+    memcpy(trampoline, ap_trampoline, ap_trampoline_end - ap_trampoline);
+    memcpy(trampoline + (ap_gdtr - ap_trampoline), &gdt_desc, 6);
+    kunmap(trampoline);
+
+    /* INIT, then the startup IPI twice: it may be missed once */
+    apic_broadcast_ipi(ICR_INIT | ICR_LEVEL_ASSERT);
+    pit_delay(INIT_DELAY);
+    apic_broadcast_ipi(ICR_STARTUP | AP_SIPI_VECTOR);
+    pit_delay(SIPI_DELAY);
+    apic_broadcast_ipi(ICR_STARTUP | AP_SIPI_VECTOR);
+    pit_delay(INIT_DELAY);
+
+    /* wait (at most 20 ms) for the ones that took a number */
+    for (i = 0; i < 100 && nr_cpus < (ap_count < NR_CPUS ? ap_count : NR_CPUS); ++i)
+        pit_delay(SIPI_DELAY);
+
+    /* hand out no more numbers: a processor waking up later halts in
+     * the trampoline. One that took a number may not be online yet, 
+     * only the stacks of the numbers never taken are freed */
+    arrived = NR_CPUS;
+    asm volatile ("xchgl %0, %1" : "+r"(arrived), "+m"(ap_count) : : "memory");
+    if (arrived > NR_CPUS)
+        arrived = NR_CPUS;
+
+    for (i = arrived; i < NR_CPUS; ++i)
+        idle_free(ap_idle[i]);
+
+    for (i = 0; i < 100 && nr_cpus < arrived; ++i)
+        pit_delay(SIPI_DELAY);
+
+    printf("smp: %d CPUs online\n", nr_cpus);
+}
+
+
+/**
+ * @brief entry of an application processor, called by the trampoline
+ * on the stack of its idle thread
+ *
+ * @param cpu : processor number
+ */
+void ap_start(uint32_t cpu) {
+    thread_t *curr;
+
+    lidt(&idt_desc_ptr);
+    lldt(KERNEL_LDT);
+    tss_init(cpu);
+
+    cur_pgdir = page_directory;
+
+    apic_setup();
+    cpu_apic_id[cpu] = apic_id();
+
+    asm volatile ("lock incl %0" : "+m"(nr_cpus) : : "memory");
+
+    /* the run queues are created by sched_init() */
+    while (!smp_started)
+        cpu_relax();
+
+    /* idle until a task shows up, never comes back */
+    GETPRO(curr);
+    __schedule(curr);
+}
+
+
+/**
+ * @brief ask a processor to look at its run queue
+ *
+ * @param cpu : processor number
+ */
+void smp_send_reschedule(uint32_t cpu) {
+    if (apic_present)
+        apic_send_ipi(cpu_apic_id[cpu], ICR_FIXED | RESCHEDULE_INTR);
+}
+
+
+/**
+ * @brief create the idle thread of a processor. It is never on a
+ * run queue, a processor runs it only until it picks a task.
+ *
+ * @param cpu : processor number
+ * @return thread_t* : idle thread, NULL if out of memory
+ */
+static thread_t *idle_create(uint32_t cpu) {
+    process_t *p;
+    thread_t *t;
+
+    if ((p = (process_t *) alloc_kstack()) == NULL)
+        return NULL;
+
+    t = &p->thread;
+    t->pid = 0;
+    t->state = RUNNING;
+    t->flag = 0;
+    t->parent = NULL;
+    INIT_LIST_HEAD(&t->children);
+    t->kthread = 1;
+    t->argc = 0;
+    t->argv = NULL;
+    t->console_id = NTERMINAL;          /* not the task of any console */
+    t->vm.pgdir = page_directory;
+    t->sched_info.on_rq = 0;
+    t->sched_info.parent = NULL;
+    t->sched_info.cfs_rq = NULL;        /* on no queue */
+    t->sched_info.my_q = NULL;
+    t->cpu = cpu;
+    t->on_cpu = 1;
+    t->policy = SCHED_NORMAL;
+    t->rt_info.on_rq = 0;
+
+    if ((t->context = kmem_cache_alloc(context_cachep)) == NULL) {
+        free_kstack(t);
+        return NULL;
+    }
+
+    return t;
+}
+
+
+/**
+ * @brief free the idle thread of a processor that did not start
+ *
+ * @param t : idle thread, may be NULL
+ */
+static void idle_free(thread_t *t) {
+    if (!t) return;
+
+    kmem_cache_free(context_cachep, t->context);
+    free_kstack(t);
+}
+
+
+/**
+ * @brief construct the TSS entry of an application processor in the GDT
+ * and load it
+ *
+ * @param cpu : processor number
+ */
+static void tss_init(uint32_t cpu) {
+    seg_desc_t the_tss_desc;
+    tss_t *t = &ap_tss[cpu - 1];
+
+    the_tss_desc.granularity   = 0x0;
+    the_tss_desc.opsize        = 0x0;
+    the_tss_desc.reserved      = 0x0;
+    the_tss_desc.avail         = 0x0;
+    the_tss_desc.seg_lim_19_16 = TSS_SIZE & 0x000F0000;
+    the_tss_desc.present       = 0x1;
+    the_tss_desc.dpl           = 0x0;
+    the_tss_desc.sys           = 0x0;
+    the_tss_desc.type          = 0x9;
+    the_tss_desc.seg_lim_15_00 = TSS_SIZE & 0x0000FFFF;
+
+    SET_TSS_PARAMS(the_tss_desc, t, tss_size);
+
+    ap_tss_desc_ptr[cpu - 1] = the_tss_desc;
+
+    t->ldt_segment_selector = KERNEL_LDT;
+    t->ss0 = KERNEL_DS;
+    t->esp0 = get_esp0(ap_idle[cpu]);
+    cpu_tss[cpu] = t;
+
+    ltr(AP_TSS(cpu));
+}
@@ -2,6 +2,7 @@
 #include <pro/process.h>
 #include <vfs/vfs.h>
 #include <pro/sched.h>
+#include <pro/pid.h>
 #include <errno.h>
 #include <boot/x86_desc.h>
 #include <boot/page.h>
@@ -10,6 +11,8 @@
 #include <list.h>
 #include <kmalloc.h>
 #include <drivers/time.h>
+#include <drivers/timer.h>
+#include <drivers/clocksource.h>
 
 /**
  * @brief A system call service routine for exiting a process
@@ -26,6 +29,59 @@ asmlinkage void sys_exit(uint8_t status) {
     do_exit((uint32_t)status);
 }
 
+/**
+ * @brief A system call service routine for sleeping for some time.
+ * The task leaves the run queue until the time is over.
+ *
+ * @param req : time to sleep
+ * @param rem : time left if interrupted by an alarm (may be NULL)
+ * @return int32_t : 0 on success, -EINTR if interrupted by an alarm,
+ * -EINVAL if tv_nsec is not below one second, -EFAULT if req is NULL
+ */
+asmlinkage int32_t sys_nanosleep(const timespec *req, timespec *rem) {
+    uint64_t ns, left;
+    int32_t errno;
+
+    if (!req)
+        return -EFAULT;
+
+    if (req->tv_nsec >= NSEC_PER_SEC)
+        return -EINVAL;
+
+    ns = (uint64_t)req->tv_sec * NSEC_PER_SEC + req->tv_nsec;
+
+    if ((errno = do_nanosleep(ns, &left)) == -EINTR && rem) {
+        rem->tv_nsec = do_div(&left, NSEC_PER_SEC);
+        rem->tv_sec = (uint32_t)left;
+    }
+
+    return errno;
+}
+
+
+/**
+ * @brief A system call service routine for setting an alarm clock
+ *
+ * @param seconds : seconds until the alarm, 0 cancels the pending one
+ * @return uint32_t : seconds left of the previous alarm, 0 if none
+ */
+asmlinkage uint32_t sys_alarm(uint32_t seconds) {
+    return do_alarm(seconds);
+}
+
+
+/**
+ * @brief A system call service routine for reading a clock
+ *
+ * @param clock : CLOCK_REALTIME or CLOCK_MONOTONIC
+ * @param tp : the time is stored here
+ * @return int32_t : 0 on success, a negative value on error
+ */
+asmlinkage int32_t sys_clock_gettime(uint32_t clock, timespec *tp) {
+    return do_clock_gettime(clock, tp);
+}
+
+
 /**
  * @brief A system call service routine for creating a process
  * The calling convation of this function is to use the
@@ -39,16 +95,12 @@ asmlinkage int32_t sys_fork(void) {
     thread_t *curr, *child;
     uint32_t stack;
 
-    cli();
-
     /* get current process */
     GETPRO(curr);
 
     /* get pid of child */
-    pid = do_fork(curr, 0);
-
-    /* get child thread */
-    child = curr->children[curr->n_children-1];
+    if ((pid = do_fork(curr, 0, &child)) < 0)
+        return pid;
 
     /* copy ebp from parent to child */
     asm volatile("movl %%ebp, %0"
@@ -64,8 +116,9 @@ asmlinkage int32_t sys_fork(void) {
 
     /* copy esp from parent to child */
     child->context->esp = get_esp0(child) - stack;
-    
-    sti();
+
+    /* only now the child may run, on any processor */
+    wake_up_new_task(child);
         
     return pid;
 }
@@ -75,6 +128,9 @@ asmlinkage int32_t sys_execv(const int8_t *pathname, int8_t *const argv[]) {
     thread_t *curr;
     int32_t status;
 
+    /* the user space of the task is replaced: it must not be switched 
+     * out on this processor meanwhile. Nothing shared with the other
+     * processors is touched without a lock (frames, file table) */
     cli();
     GETPRO(curr);
 
@@ -100,6 +156,39 @@ asmlinkage int32_t sys_getppid(void) {
 }   
 
 
+/**
+ * @brief A system call service routine for changing the scheduling policy
+ * and the real-time priority of a process
+ *
+ * @param pid : process id, 0 for the calling process
+ * @param policy : SCHED_NORMAL, SCHED_FIFO or SCHED_RR
+ * @param priority : 1 .. 31 for a real-time policy, 0 for SCHED_NORMAL
+ * @return int32_t : 0 on success, -ESRCH if there is no such process,
+ * -EINVAL on invalid arguments
+ */
+asmlinkage int32_t sys_sched_setscheduler(pid_t pid, int32_t policy, int32_t priority) {
+    thread_t *task;
+    uint32_t flags;
+    int32_t errno;
+
+    if (policy < 0 || priority < 0)
+        return -EINVAL;
+
+    if (!pid) {
+        GETPRO(task);
+        return sched_setscheduler(task, policy, priority);
+    }
+
+    /* the task can not be freed while the list is locked */
+    spin_lock_irqsave(&tasklist_lock, flags);
+    task = find_task_by_pid(pid);
+    errno = task ? sched_setscheduler(task, policy, priority) : -ESRCH;
+    spin_unlock_irqrestore(&tasklist_lock, flags);
+
+    return errno;
+}
+
+
 /**
  * @brief A system call service routine for creating a process
  * The calling convation of this function is to use the
@@ -113,20 +202,26 @@ asmlinkage int32_t sys_execute(const int8_t *cmd) {
     thread_t *child;
     int32_t status;
 
+    /* a sleeping task must not be switched out by a tick on this processor
+     * before the child is started; the child runs and may exit on another
+     * processor, which only wakes us up (see sched_exit) */
     cli();
 
     GETPRO(curr);
 
-    status = do_execute(curr, cmd);
-    if (status < 0) 
+    /* the child may exit on another processor before we sleep */
+    curr->state = SLEEPING;
+
+    status = do_execute(curr, cmd, &child);
+    if (status < 0) {
+        curr->state = RUNNING;
+        sti();
         return status;
+    }
 
-    child = curr->children[curr->n_children-1];
-    consoles[child->console_id]->task = child;
     sched_sleep(curr);
 
     GETPRO(curr);
-    child = curr->children[curr->n_children-1];
     child->state = EXITED;
     process_free(child);
 
@@ -144,7 +239,11 @@ asmlinkage int32_t sys_execute(const int8_t *cmd) {
  * @return int32_t : positive or 0 denote success, negative values denote an error condition
  */
 asmlinkage int32_t sys_open(const int8_t *filename) {
-    fdcopy();
+    int32_t errno;
+
+    if ((errno = fdcopy()) < 0)
+        return errno;
+
     return do_open(filename);
 }
 
@@ -157,7 +256,11 @@ asmlinkage int32_t sys_open(const int8_t *filename) {
  * @return int32_t : positive or 0 denote success, negative values denote an error condition
  */
 asmlinkage int32_t sys_close(int32_t fd) {
-    fdcopy();
+    int32_t errno;
+
+    if ((errno = fdcopy()) < 0)
+        return errno;
+
     return do_close(fd);
 }
 
@@ -172,7 +275,11 @@ asmlinkage int32_t sys_close(int32_t fd) {
  * @return int32_t : positive or 0 denote success, negative values denote an error condition
  */
 asmlinkage int32_t sys_read(int32_t fd, void *buf, uint32_t nbytes) {
-    fdcopy();
+    int32_t errno;
+
+    if ((errno = fdcopy()) < 0)
+        return errno;
+
     return do_read(fd, buf, nbytes);
 }
 
@@ -187,7 +294,11 @@ asmlinkage int32_t sys_read(int32_t fd, void *buf, uint32_t nbytes) {
  * @return int32_t : positive or 0 denote success, negative values denote an error condition
  */
 asmlinkage int32_t sys_write(int32_t fd, const void *buf, uint32_t nbytes) {
-    fdcopy();
+    int32_t errno;
+
+    if ((errno = fdcopy()) < 0)
+        return errno;
+
     return do_write(fd, buf, nbytes);
 }
 
@@ -267,7 +378,9 @@ asmlinkage void *sys_sbrk(uint32_t size) {
         while (heap != 0) {
             if (heap->vmflag & VM_HEAP) {
 
-                if (vmalloc(heap, PAGE_SIZE, PTE_RW | PTE_US) == -1)
+                /* pages of the new break are populated on first touch */
+                if (brk + size > heap->vmend && 
+                    vmreserve(heap, brk + size - heap->vmend, PTE_RW | PTE_US) == -1)
                     return 0;
                 
                 curr->vm.brk += size;
@@ -311,11 +424,14 @@ asmlinkage int32_t sys_mmap(void *addr, uint32_t size) {
     pagesz = (((int)addr % PAGE_SIZE) + size + PAGE_SIZE - 1) / PAGE_SIZE;
     pageaddr = (int)addr % PAGE_SIZE;
 
-    area = kmalloc(sizeof(vm_area_t));
+    area = kmem_cache_alloc(vm_area_cachep);
     area->vmflag = VM_WRITE | VM_READ;
-    area->vmend = area->vmstart = (uint32_t)addr;
+    area->vmend = area->vmstart = ADDR_TO_PTE((uint32_t)addr);
     
-    vmalloc(area, pagesz, PTE_US | PTE_RW);
+    if (vmreserve(area, pagesz * PAGE_SIZE, PTE_US | PTE_RW) == -1) {
+        kmem_cache_free(vm_area_cachep, area);
+        return -1;
+    }
 
     t = curr->vm.map_list;
     if(t->vmstart > (uint32_t)addr) {
@@ -372,7 +488,7 @@ asmlinkage int32_t sys_munmap(void *addr) {
 
     size = area->vmend - area->vmstart;
     vmdealloc(area, size, 1);
-    kfree(area);
+    kmem_cache_free(vm_area_cachep, area);
     
     show_mmap(&curr->vm);
     return 0;
@@ -393,12 +509,15 @@ asmlinkage int32_t sys_stat(int8_t *info[]) {
     thread_t *thread;
     list_head *node;
     int8_t buf[128];
-    int count;
+    int count = 0;
+    uint32_t flags;
+    uint64_t runtime;
     const int size[6] = { 3, 4, 3, 4, 5, 7 };
     const char state[5][32] = {
         "unused", "running", "runnable", "sleeping", "exited", "zomibie"
     };
 
+    spin_lock_irqsave(&tasklist_lock, flags);
     list_for_each(node, &task_queue) {
         thread = list_entry(node, thread_t, task_node);
         strcat(*info, itoa(thread->pid, buf, 10));
@@ -410,12 +529,38 @@ asmlinkage int32_t sys_stat(int8_t *info[]) {
         strcat(*info, itoa(thread->nice, buf, 10));
         strcat(*info, ",");
         strcat(*info, state[thread->state]);
-        // strcat(*info, ",");
-        // strcat(*info, itoa((uint32_t)(thread->sched_info.sum_exec_time / TICKUNIT), buf, 10));
+        strcat(*info, ",");
+        /* runtime in microseconds */
+        runtime = thread->sched_info.sum_exec_time;
+        do_div(&runtime, 1000);
+        strcat(*info, itoa((uint32_t)runtime, buf, 10));
+        strcat(*info, ",");
+        /* time waiting on a run queue in microseconds */
+        runtime = thread->stats.wait_sum;
+        do_div(&runtime, 1000);
+        strcat(*info, itoa((uint32_t)runtime, buf, 10));
+        strcat(*info, ",");
+        strcat(*info, itoa(thread->stats.nr_voluntary, buf, 10));
+        strcat(*info, ",");
+        strcat(*info, itoa(thread->stats.nr_involuntary, buf, 10));
         info++;
         count++;
     }
+    spin_unlock_irqrestore(&tasklist_lock, flags);
 
     return count;
 }
 
+
+/**
+ * @brief A system call service routine for reading the scheduler 
+ * statistics of all processors: latency histograms, run queue depth 
+ * and switch counters
+ *
+ * @param buf : the statistics are stored here
+ * @return int32_t : 0 on success, -EFAULT if buf is NULL
+ */
+asmlinkage int32_t sys_schedstat(schedstat_t *buf) {
+    return do_schedstat(buf);
+}
+
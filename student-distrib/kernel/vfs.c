@@ -191,22 +191,35 @@ static int32_t validate_fname(const int8_t *filename) {
 
 
 /**
- * @brief Initialize the virtual file system.
+ * @brief Initialize the virtual file system. A table the process already
+ * has (execv) is cleared in place: a child may be copying it.
  * @param p init the fd for this process
  * 
  * @return int32_t : 0 on success, otherwise on failure.
  */
 int32_t fd_init(thread_t *curr) {
     int i;
+    uint32_t flags;
+    files *fds = curr->fds;
     
-    curr->fds = kmalloc(sizeof(files));
+    if (!fds) {
+        if ((fds = kmem_cache_alloc(files_cachep)) == NULL)
+            return -ENOMEM;
+        spin_lock_init(&fds->lock);
+    } else {
+        fd_release(fds);
+    }
     
-    curr->fds->count = 0;
-    curr->fds->max_fd = OPEN_MAX;
+    spin_lock_irqsave(&fds->lock, flags);
+    fds->count = 0;
+    fds->max_fd = OPEN_MAX;
 
     for (i = 0; i < OPEN_MAX; ++i) {
-        curr->fds->fd[i].f_count = 0;
+        fds->fd[i].f_count = 0;
     }
+    spin_unlock_irqrestore(&fds->lock, flags);
+
+    curr->fds = fds;
 
     return (__open(0, "stdin", TERMINAL, &terminal_op, curr)) + (__open(1, "stdout", TERMINAL, &terminal_op, curr));
 }
@@ -221,6 +234,7 @@ int32_t file_open(const int8_t *fname) {
     int32_t fd;    
     file_t file;
     dentry_t dentry; 
+    uint32_t flags;
 
     thread_t *curr;
 
@@ -228,11 +242,16 @@ int32_t file_open(const int8_t *fname) {
     
     /* Call read_dentry_by_name to get a new dentry */
     if (!(fd = read_dentry_by_name(fname, &dentry))) { 
+        spin_lock_irqsave(&curr->fds->lock, flags);
+
         /* Initialize the current file object. */
         fd = file_init(2, &file, &dentry, &f_op, curr); 
 
         /* Copy the file object into the vfs fd. */
-        memcpy((void*)&(curr->fds->fd[fd]), (void*)&file, sizeof(file_t));
+        if (fd >= 0)
+            memcpy((void*)&(curr->fds->fd[fd]), (void*)&file, sizeof(file_t));
+
+        spin_unlock_irqrestore(&curr->fds->lock, flags);
     }
     return fd;
 }
@@ -246,15 +265,19 @@ int32_t file_open(const int8_t *fname) {
  */
 int32_t file_close(int32_t fd) {
     thread_t *curr;
+    uint32_t flags;
+    int32_t ret = 0;
+
     GETPRO(curr);
 
-    if (!curr->fds->fd[fd].f_count) {
-        return -1;
-    }
+    spin_lock_irqsave(&curr->fds->lock, flags);
+    if (!curr->fds->fd[fd].f_count)
+        ret = -1;
+    else
+        curr->fds->fd[fd].f_count--;    /* Close the file. */
+    spin_unlock_irqrestore(&curr->fds->lock, flags);
 
-    /* Close the file. */
-    curr->fds->fd[fd].f_count--; 
-    return 0;
+    return ret;
 }
 
 
@@ -373,35 +396,81 @@ int32_t directory_write(int32_t fd, const void *buf, int32_t nbytes) {
 int32_t __open(int32_t fd, const int8_t *fname, file_type_t type, file_op *op, thread_t *curr) {
     file_t file;
     dentry_t dentry; 
+    uint32_t flags;
 
     memset((void*)&dentry, 0, sizeof(dentry));
     memcpy((void*)(&dentry.fname), (void*)fname, NAMESIZE);
     dentry.inode = 0;   /* ignored here. */
     dentry.type = type;
 
-    if ((fd = file_init(fd, &file, &dentry, op, curr)) < 0) {
-        return -1;
-    }
-    memcpy((void*)&(curr->fds->fd[fd]), (void*)&file, sizeof(file_t));
-    return fd;
+    spin_lock_irqsave(&curr->fds->lock, flags);
+    if ((fd = file_init(fd, &file, &dentry, op, curr)) >= 0)
+        memcpy((void*)&(curr->fds->fd[fd]), (void*)&file, sizeof(file_t));
+    spin_unlock_irqrestore(&curr->fds->lock, flags);
+
+    return (fd < 0) ? -1 : fd;
 }
 
 
 
 /**
  * @brief copy file descriptor only when a child process first accessing its
- * file descriptors
+ * file descriptors. The table is taken from the closest ancestor that has
+ * one: the parent may be a forked child that did not copy its own yet. 
+ * The task list lock keeps the ancestors from exiting meanwhile.
  * 
+ * @return int32_t : 0 on success, -ENOMEM if there is no memory for the copy
  */
-void fdcopy(void) {
-    thread_t *curr;
+int32_t fdcopy(void) {
+    thread_t *curr, *from;
+    files *fds;
+    uint32_t flags;
+    int32_t i;
+
     GETPRO(curr);
 
     /* copy file descriptor when it first tried to open a file */
-    if (!curr->fds) {
-        curr->fds = kmalloc(sizeof(files));
-        curr->fds->count = 0;
-        curr->fds->max_fd = OPEN_MAX;
-        memcpy((void*)curr->fds, (void*)curr->parent->fds, sizeof(files));
-    }
+    if (curr->fds)
+        return 0;
+
+    if ((fds = kmem_cache_alloc(files_cachep)) == NULL)
+        return -ENOMEM;
+
+    spin_lock_irqsave(&tasklist_lock, flags);
+    for (from = curr->parent; !from->fds; from = from->parent);
+
+    spin_lock(&from->fds->lock);
+    memcpy((void*)fds, (void*)from->fds, sizeof(files));
+    spin_unlock(&from->fds->lock);
+    spin_unlock_irqrestore(&tasklist_lock, flags);
+
+    /* the copy of the lock was held */
+    spin_lock_init(&fds->lock);
+
+    /* the copied RTC files are open twice now */
+    for (i = 0; i < OPEN_MAX; ++i)
+        if (fds->fd[i].f_count && fds->fd[i].f_dentry.type == RTC)
+            rtc_get();
+    fds->count = 0;
+    fds->max_fd = OPEN_MAX;
+    curr->fds = fds;
+
+    return 0;
+}
+
+
+/**
+ * @brief drop what the open files of a table hold, before the table is 
+ * freed or cleared: the RTC only interrupts while an RTC file is open.
+ * 
+ * @param fds : file table, NULL if the task never had its own
+ */
+void fd_release(files *fds) {
+    int32_t i;
+
+    if (!fds) return;
+
+    for (i = 0; i < OPEN_MAX; ++i)
+        if (fds->fd[i].f_count && fds->fd[i].f_dentry.type == RTC)
+            rtc_put();
 }
@@ -3,7 +3,9 @@
 #include <kmalloc.h>
 #include <lib.h>
 #include <pro/process.h>
+#include <spinlock.h>
 #include <io.h>
+#include <errno.h>
 
 /**
  * @brief Turn on paging related registers.
@@ -16,17 +18,19 @@
 //pd_descriptor_t pdd[ENTRY_NUM];
 
 //int vmalloc(vmem_t* vm, uint32_t start_addr, int oldsize, int newsize, int flags);
-pte_t* _walk(uint32_t va, uint32_t flag, int alloc);
-buddy* get_buddy(uint32_t addr);
 
 user_page_t u1, u2;
 user_page_t* upage_4mb;
 user_page_t* upage_4kb;
 
-free_area_t ufree_area[MAX_ORDER +1];
-buddy ufree_list[MAX_ORDER + 1];
+static zone_t user_zone;                    /* buddy allocator of the user frames */
 
-pd_descriptor_t pdesc[ENTRY_NUM];
+pagedir_t cpu_pgdir[NR_CPUS];               /* page directory currently loaded in CR3 of each processor */
+static uint8_t kmap_used[NR_CPUS][KMAP_NR];     /* busy slots of the window of each processor */
+static uint32_t kmap_flags[NR_CPUS][KMAP_NR];   /* interrupt flag saved by kmap(), restored by kunmap() */
+
+#define PAGE_REF(pa)    user_zone.mem_map[((pa) - user_zone.start) / PAGE_SIZE].count
+#define USER_FRAME(pa)  (((pa) - user_zone.start) / PAGE_SIZE < user_zone.nr_frames)
 
 void enable_paging()
 {
@@ -43,12 +47,19 @@ void enable_paging()
     "movl %%eax, %%cr4          ;"
 	:  : "r"(CR4_EXTENSION_FLAG): "eax" );
 
-    /* Turn on paging */
+    /* Turn on paging, kernel writes to read-only (COW) user pages fault too */
     asm volatile(
 	"movl %%cr0, %%eax          ;"
 	"orl %0, %%eax     ;"
 	"movl %%eax, %%cr0          ;"
-	:  : "r"(CR0_PAGE_FLAG): "eax" );
+	:  : "r"(CR0_PAGE_FLAG | CR0_WP_FLAG): "eax" );
+
+    /* Keep global (kernel) mappings in the TLB across CR3 loads */
+    asm volatile(
+    "movl %%cr4, %%eax          ;"
+    "orl %0, %%eax           ;"
+    "movl %%eax, %%cr4          ;"
+	:  : "r"(CR4_GLOBAL_FLAG): "eax" );
 }
 
 void flush_tlb()
@@ -59,6 +70,123 @@ void flush_tlb()
     : : : "eax" );
 }
 
+/**
+ * @brief Invalidate the TLB entry of a single virtual page.
+ * 
+ * @param va    Virtual address inside the page.
+ */
+void flush_tlb_page(uint32_t va)
+{
+    asm volatile("invlpg (%0)" : : "r"(va) : "memory");
+}
+
+/**
+ * @brief Load a page directory into CR3. Does nothing if it is
+ *        already the active one.
+ * 
+ * @param pgdir     Page directory to switch to.
+ */
+void set_pgdir(pagedir_t pgdir)
+{
+    if(pgdir == cur_pgdir)
+        return;
+    cur_pgdir = pgdir;
+    asm volatile(
+	"movl %0, %%cr3             ;"
+	:  : "r"(pgdir): "memory" );
+}
+
+/**
+ * @brief Create a page directory for a new address space.
+ *        The kernel mappings (0-64MB) and the shared vidmap
+ *        table are copied from the kernel page directory,
+ *        the rest of the user space is empty.
+ * 
+ * @return pagedir_t    New page directory, NULL if out of memory.
+ */
+pagedir_t pgdir_create(void)
+{
+    pagedir_t pgdir;
+
+    if((pgdir = get_page(0)) == NULL)
+        return NULL;
+    memcpy((void*)pgdir, (void*)page_directory, PAGE_SIZE);
+    return pgdir;
+}
+
+/**
+ * @brief Free a page directory and all page tables owned by it.
+ *        *Do not free the physical memory mapped by it.*
+ * 
+ * @param pgdir     Page directory created by pgdir_create().
+ */
+void pgdir_free(pagedir_t pgdir)
+{
+    int i;
+
+    if(pgdir == NULL || pgdir == page_directory)
+        return;
+
+    if(pgdir == cur_pgdir)                                      /* Never free the live directory. */
+        set_pgdir(page_directory);
+
+    for(i = KERNEL_PAGES; i < ENTRY_NUM; i++) {
+        /* Entries equal to the kernel's are shared tables (vidmap). */
+        if((pgdir[i] & PTE_PRESENT) && !(pgdir[i] & PDE_MB) && pgdir[i] != page_directory[i])
+            free_page((void*)ADDR_TO_PTE(pgdir[i]), 0);
+    }
+    free_page((void*)pgdir, 0);
+}
+
+/**
+ * @brief Map a user physical page into the kernel's temporary
+ *        mapping window so that it can be accessed without
+ *        touching any user address space. Each processor has
+ *        its own slots; interrupts stay off until kunmap() so
+ *        the task can not be preempted or moved while it holds
+ *        one. Mappings are released in reverse order.
+ * 
+ * @param pa        Physical address of the page.
+ * @return void*    Kernel virtual address of the page.
+ */
+void* kmap(uint32_t pa)
+{
+    uint32_t i, cpu, va, flags;
+
+    cli_and_save(flags);
+    cpu = smp_processor_id();
+
+    for(i = 0; i < KMAP_NR; i++) {
+        if(!kmap_used[cpu][i]) {
+            kmap_used[cpu][i] = 1;
+            kmap_flags[cpu][i] = flags;
+            va = KMAP_BEGIN + (cpu * KMAP_NR + i) * PAGE_SIZE;
+            page_table[va >> PDE_OFFSET_4KB] = PTE_PRESENT | PTE_RW | ADDR_TO_PTE(pa);
+            flush_tlb_page(va);                 /* Only this processor ever used the slot. */
+            return (void*)va;
+        }
+    }
+    panic("kmap: no free slot");
+    return NULL;
+}
+
+/**
+ * @brief Release a mapping created by kmap().
+ * 
+ * @param p     Address returned by kmap().
+ */
+void kunmap(void* p)
+{
+    uint32_t va = ADDR_TO_PTE((uint32_t)p);
+    uint32_t slot = (va - KMAP_BEGIN) / PAGE_SIZE;
+    uint32_t cpu = slot / KMAP_NR, i = slot % KMAP_NR;
+
+    page_table[va >> PDE_OFFSET_4KB] = PTE_RW;
+    flush_tlb_page(va);
+    kmap_used[cpu][i] = 0;
+    restore_flags(kmap_flags[cpu][i]);
+}
+
 /**
  * @brief Initialize page directory and page table.
  * 
@@ -72,11 +200,6 @@ void page_init()
     /* initialize 4MB-8MB directory */
     page_directory[1] = page_directory[1] | PTE_PRESENT | PTE_RW | PDE_MB | PTE_GLO | (1 << PDE_OFFSET_4MB);
 
-    /* Initialize page directory descriptors */
-    for(i = 0; i < ENTRY_NUM; i++) {
-        pdesc->flags = 0;
-        pdesc->count = 0;
-    }
     /* initialize 8MB-4GB page directories */
 
     for(i = 2; i < 16; i++) {
@@ -90,9 +213,9 @@ void page_init()
     /* initialize page tables */
     for(i = 0; i < ENTRY_NUM; i++)
     {
-        /* only video memory is initialized as present */
-        if(i == (VIDEO >> PDE_OFFSET_4KB) ) {
-            page_table[i] = page_table[i] | PTE_PRESENT | PTE_RW | ADDR_TO_PTE(VIDEO); 
+        /* only video memory (a screen per terminal and the scrollback view) is initialized as present */
+        if(i >= (VIDEO >> PDE_OFFSET_4KB) && i <= (VIDEO_VIEW >> PDE_OFFSET_4KB)) {
+            page_table[i] = page_table[i] | PTE_PRESENT | PTE_RW | ADDR_TO_PTE(i << PDE_OFFSET_4KB); 
         }
         else {
             page_table[i] = 0 | PTE_RW;  
@@ -101,18 +224,16 @@ void page_init()
 
     page_directory[VIR_VID_MEM / PAGE_SIZE_4MB] = PTE_PRESENT | PTE_RW | PTE_US | ADDR_TO_PTE((int)vidmap_table);
     for(i = 0; i < ENTRY_NUM; i++) {
-        if(i == (VIDEO >> PDE_OFFSET_4KB)) {
-            vidmap_table[i] = PTE_PRESENT | PTE_RW | PTE_US | ADDR_TO_PTE(VIDEO);
+        /* console k maps the screen of its own terminal, whether it is displayed or not */
+        if(i >= (VIDEO >> PDE_OFFSET_4KB) && i < (VIDEO >> PDE_OFFSET_4KB) + NTERMINAL) {
+            vidmap_table[i] = PTE_PRESENT | PTE_RW | PTE_US | ADDR_TO_PTE(i << PDE_OFFSET_4KB);
         }
         else {
             vidmap_table[i] = 0;
         }
     }
-        page_table[VIDEO_BUF_1 >> PDE_OFFSET_4KB] = PTE_PRESENT | PTE_RW | ADDR_TO_PTE(VIDEO_BUF_1); 
-        page_table[VIDEO_BUF_2 >> PDE_OFFSET_4KB] = PTE_PRESENT | PTE_RW | ADDR_TO_PTE(VIDEO_BUF_2);
-        page_table[VIDEO_BUF_3 >> PDE_OFFSET_4KB] = PTE_PRESENT | PTE_RW | ADDR_TO_PTE(VIDEO_BUF_3);
-
     /* turn on paging registers */
+    cur_pgdir = page_directory;
     enable_paging();
     return;
 }
@@ -122,21 +243,16 @@ void page_init()
 int32_t do_vidmap(uint8_t **screen_start)
 {
     // cli();
-    if(!(*(_walk((uint32_t)screen_start, 0, 0)) & PTE_US)) {
+    pte_t* pte;
+
+    if((pte = _walk(cur_pgdir, (uint32_t)screen_start, 0, 0)) == 0 || !(*pte & PTE_US)) {
         return -1;
     }
 
     thread_t* t;
     GETPRO(t);
 
-    *screen_start = current->vidmap;
-
-    // if(t == current->task) {
-    //     *screen_start = (uint8_t*) (VIR_VID_MEM + VIDEO);
-    // }
-    // else {
-    //     *screen_start = (uint8_t*) (t->terminal->saved_vidmem);
-    // }
+    *screen_start = consoles[t->console_id]->vidmap;
     // sti();
     return 0;
 }
@@ -145,53 +261,22 @@ int32_t do_vidmap(uint8_t **screen_start)
 
 
 /**
- * @brief Get the buddy object
- * 
- * @param addr Addresses to be allocated
- * @return buddy* buddy struct storing addr
- */
-buddy* get_buddy(uint32_t addr) 
-{
-    buddy* b = kmalloc(sizeof(buddy));
-    b->addr = addr;
-    return b;
-}
-
-
-/**
- * @brief Initialize user memory area
- *        (bitmaps & free lists), 
- *        index user memory
+ * @brief Initialize user memory area, index user memory.
+ *        All RAM above the kernel heap found by mem_detect() 
+ *        is used, the frame descriptors come from boot_alloc(),
+ *        so it must run before kmalloc_init().
  */
 void user_mem_init() 
 {
-    int i = 0;
-    buddy* p;
+    uint32_t first = KERNEL_PAGES * PAGE_SIZE_4MB / PAGE_SIZE;
+    uint32_t nr_frames = max_pfn > first ? max_pfn - first : 0;
+    page_t* map;
 
-    /* create space for bitmaps */
-    ufree_area[MAX_ORDER].bmsize = 0;
-    for(i = 0; i < MAX_ORDER; i++) {
-        ufree_area[i].bmsize = ((PAGE_SIZE_4MB * 2) / buddy_size(i) + 31) / 32;
-        ufree_area[i].bit_map = kmalloc(ufree_area[i].bmsize * sizeof(uint32_t));
-    }
-
-    /* Initialize user free lists */
-    for(i = 0; i <= MAX_ORDER; i++) {
-        buddy* fl = &ufree_list[i];
-        ufree_area[i].free_list = fl;
-        fl->last = fl;
-        fl->next = fl; 
-        memset(ufree_area[i].bit_map, 0, ufree_area[i].bmsize * sizeof(uint32_t)); /* All buddys are both free */
-        ufree_area[i].start_addr = KERNEL_PAGES * PAGE_SIZE_4MB;
-        ufree_area[i].user = 1;
-    }
+    while((map = boot_alloc(nr_frames * sizeof(page_t))) == NULL)
+        nr_frames -= PAGE_SIZE_4MB / PAGE_SIZE;     /* descriptors must fit into the kernel heap */
 
-    buddy* fl = ufree_area[MAX_ORDER].free_list;
-    /* index user memory and store in largest free list */
-    for(i = KERNEL_PAGES * PAGE_SIZE_4MB; i < MAX_PHYS_PAGES * PAGE_SIZE_4MB; i += buddy_size(MAX_ORDER - 1)) {
-        p = get_buddy(i);
-        free_list_push(fl, p);
-    }
+    zone_init(&user_zone, first * PAGE_SIZE, nr_frames, map);
+    zone_free_usable(&user_zone);
 }
 
 
@@ -205,22 +290,14 @@ void user_mem_init()
  */
 uint32_t get_user_page(int order)
 {
-    int i, rtn;
-    buddy* temp;
-    if(order >= MAX_ORDER || order < 0) return NULL;
-
-    for(i = order; i <= MAX_ORDER; i++) {
-        /* find the smallest order that has a free block */ 
-        if((temp = free_list_pop(ufree_area[i].free_list)) == NULL) {
-            continue;
-        }
-        temp = buddy_split(ufree_area, temp, i, order); /* reduce order with split */
-        rtn = temp->addr;
-        kfree(temp);
-        return rtn;
-    }
+    int i;
+    int32_t pfn;
 
-    return NULL;
+    if((pfn = __get_pages(&user_zone, order)) < 0)
+        return NULL;
+    for(i = 0; i < (1 << order); i++)
+        user_zone.mem_map[pfn + i].count = 1;           /* owned by the caller */
+    return user_zone.start + pfn * PAGE_SIZE;
 }
 
 /**
@@ -231,14 +308,136 @@ uint32_t get_user_page(int order)
  */
 void free_user_page(uint32_t addr, int order)
 {   
-    _free_page(ufree_area, get_buddy(addr), order);
+    __free_pages(&user_zone, (addr - user_zone.start) / PAGE_SIZE, order);
     return;
 }
 
+/**
+ * @brief       Add a mapping to a user frame, e.g. when fork shares it.
+ *              Kernel frames (file system blocks) are not counted.
+ *              The count is changed under the zone lock: processes
+ *              sharing a frame may fork or exit on two processors.
+ * 
+ * @param pa    Physical address of a frame from get_user_page(0).
+ */
+void user_page_dup(uint32_t pa)
+{
+    uint32_t flags;
+
+    pa = ADDR_TO_PTE(pa);
+    if(!USER_FRAME(pa))
+        return;
+
+    spin_lock_irqsave(&user_zone.lock, flags);
+    PAGE_REF(pa)++;
+    spin_unlock_irqrestore(&user_zone.lock, flags);
+}
+
+/**
+ * @brief       Drop a mapping of a user frame. The frame is
+ *              freed when its last mapping goes away.
+ * 
+ * @param pa    Physical address of a frame from get_user_page(0).
+ */
+void user_page_put(uint32_t pa)
+{
+    uint32_t flags, count;
+
+    pa = ADDR_TO_PTE(pa);
+    if(!USER_FRAME(pa))
+        return;
+
+    spin_lock_irqsave(&user_zone.lock, flags);
+    if(PAGE_REF(pa) == 0) {
+        spin_unlock_irqrestore(&user_zone.lock, flags);
+        panic("user_page_put: free frame");
+    }
+    count = --PAGE_REF(pa);
+    spin_unlock_irqrestore(&user_zone.lock, flags);
+
+    /* __free_pages() takes the zone lock itself */
+    if(count == 0)
+        free_user_page(pa, 0);
+}
+
+/**
+ * @brief       Number of mappings of a user frame.
+ * 
+ * @param pa    Physical address of the frame.
+ * @return int  Reference count, 0 if the frame is free or not a user frame.
+ */
+int user_page_count(uint32_t pa)
+{
+    uint32_t flags;
+    int count;
+
+    pa = ADDR_TO_PTE(pa);
+    if(!USER_FRAME(pa))
+        return 0;
+
+    spin_lock_irqsave(&user_zone.lock, flags);
+    count = PAGE_REF(pa);
+    spin_unlock_irqrestore(&user_zone.lock, flags);
+
+    return count;
+}
+
+/**
+ * @brief       Give up a mapping of a COW frame for a private copy, or
+ *              keep the frame if the caller maps it alone. Decided and
+ *              done under the zone lock, so two processes faulting on the
+ *              same frame never both keep it, and the frame is freed
+ *              exactly once. Frames outside the user pool (file system
+ *              blocks) are not counted and always copied.
+ * 
+ * @param pa    Physical address of the shared frame.
+ * @return uint32_t  pa if the frame is kept, the address of a copy
+ *              otherwise, 0 if out of memory (the mapping is kept).
+ */
+uint32_t user_page_unshare(uint32_t pa)
+{
+    uint32_t flags, npa, count;
+    char *from, *to;
+
+    pa = ADDR_TO_PTE(pa);
+
+    if(USER_FRAME(pa)) {
+        spin_lock_irqsave(&user_zone.lock, flags);
+        if(PAGE_REF(pa) == 1) {                 /* Nobody else maps it, reuse the frame. */
+            spin_unlock_irqrestore(&user_zone.lock, flags);
+            return pa;
+        }
+        spin_unlock_irqrestore(&user_zone.lock, flags);
+    }
+
+    /* our mapping keeps the frame alive while it is copied */
+    if((npa = get_user_page(0)) == 0)
+        return 0;
+    from = kmap(pa);
+    to = kmap(npa);
+    memcpy(to, from, PAGE_SIZE);                /* Private copy through the kernel window. */
+    kunmap(to);
+    kunmap(from);
+
+    if(!USER_FRAME(pa))
+        return npa;
+
+    spin_lock_irqsave(&user_zone.lock, flags);
+    count = --PAGE_REF(pa);
+    spin_unlock_irqrestore(&user_zone.lock, flags);
+
+    /* the others dropped it while we copied */
+    if(count == 0)
+        free_user_page(pa, 0);
+
+    return npa;
+}
+
 
 /**
  * @brief   Find the page table entry corresponding to a virtual address.
  * 
+ * @param pgdir     page directory to walk
  * @param va        target virtual address
  * @param flags     Used to create page directory entry
  * @param alloc     If the value of alloc is 1, _walk will create a page table
@@ -247,17 +446,18 @@ void free_user_page(uint32_t addr, int order)
  * @return pte_t*   pointer to target pte
  */
 pte_t*
-_walk(uint32_t va, uint32_t flags, int alloc)
+_walk(pagedir_t pgdir, uint32_t va, uint32_t flags, int alloc)
 {
     uint32_t pde_i = PDE_MB_ADDR(va);
-    pde_t* pde = &page_directory[pde_i];                        /* Get pde entry. */
+    pde_t* pde = &pgdir[pde_i];                                 /* Get pde entry. */
     uint32_t ptaddr;
 
     if(!(*pde & PTE_PRESENT)) {
         if(!alloc || (ptaddr = (uint32_t)get_page(0)) == 0)     /* Alloc a new page table if needed. */
             return 0;
         memset((void*)ptaddr, 0, PAGE_SIZE);
-        *pde = PTE_PRESENT | flags | ADDR_TO_PTE(ptaddr);
+        /* Access rights are enforced by each PTE, the PDE stays writable. */
+        *pde = PTE_PRESENT | PTE_RW | (flags & PTE_US) | ADDR_TO_PTE(ptaddr);
     }
 
     pte_t* pte = (pte_t*) ADDR_TO_PTE(*pde);
@@ -267,15 +467,16 @@ _walk(uint32_t va, uint32_t flags, int alloc)
 
 /**
  * @brief           Create a memory map between a virtual address and 
- *                  a physical address.
+ *                  a physical address in a page directory.
  * 
+ * @param pgdir     Page directory to modify.
  * @param va        Virtual address.
  * @param pa        Physical address.
  * @param size      Size of memory map. (# bytes)
  * @param flags     Flags to be set on PTE & PDE.
  * @return int      0 if succeed, -1 if failed.
  */
-int mmap(uint32_t va, uint32_t pa, int size, int flags)
+int __mmap(pagedir_t pgdir, uint32_t va, uint32_t pa, int size, int flags)
 {
     pte_t* pte;
     int i, addr, length;
@@ -285,53 +486,83 @@ int mmap(uint32_t va, uint32_t pa, int size, int flags)
 
     for(i = 0; i < length; i++ ){
 
-        if((pte = _walk(addr, flags, 1)) == 0)          /* Get the PTE position to map. */
+        if((pte = _walk(pgdir, addr, flags, 1)) == 0)   /* Get the PTE position to map. */
             panic("walk error");
 
         if((*pte) & PTE_PRESENT)                        /* Cannot remap an existing mmap. */
             return -1;
 
         *pte = PTE_PRESENT | flags | (ADDR_TO_PTE(pa) + i * PAGE_SIZE);     /* Create map. */
-        pdesc[PDE_MB_ADDR(addr)].count ++;
+
+        if(pgdir == cur_pgdir)                          /* Only the live directory is cached. */
+            flush_tlb_page(addr);
 
         addr += PAGE_SIZE;
     }
 
-    flush_tlb();
     return 0;
 }
 
 /**
- * @brief           Delete a memory map on a virtual address.
+ * @brief           Create a memory map in the current address space.
+ * 
+ * @param va        Virtual address.
+ * @param pa        Physical address.
+ * @param size      Size of memory map. (# bytes)
+ * @param flags     Flags to be set on PTE & PDE.
+ * @return int      0 if succeed, -1 if failed.
+ */
+int mmap(uint32_t va, uint32_t pa, int size, int flags)
+{
+    return __mmap(cur_pgdir, va, pa, size, flags);
+}
+
+/**
+ * @brief           Delete a memory map on a virtual address of a page directory.
  *                  *Do not free the physical memory.*
+ *                  Page tables are kept until the directory is freed.
  * 
+ * @param pgdir     Page directory to modify.
  * @param va        Virtual address.
  * @param size      Size of map to delete.
  * @return int      0 if succeed, -1 if failed.
  */
 int
-freemap(uint32_t va, int size)
+__freemap(pagedir_t pgdir, uint32_t va, int size)
 {
     pte_t* pte;
     uint32_t addr;
 
     for(addr = va; addr < va + size; addr += PAGE_SIZE) {
-        if((pte = _walk(addr, 0, 0)) == 0)              /* Find the PTE to free. */
+        if((pte = _walk(pgdir, addr, 0, 0)) == 0)       /* Find the PTE to free. */
             return -1;
 
         if(!((*pte) & PTE_PRESENT))
             return -1;
 
         *pte = 0;
-        if((pdesc[PDE_MB_ADDR(addr)].count--) == 0) {   /* If the page table became empty, free it. */
-            free_page((void*)ADDR_TO_PTE(page_directory[PDE_MB_ADDR(addr)]), 0);
-        }
+
+        if(pgdir == cur_pgdir)
+            flush_tlb_page(addr);
     }
 
-    flush_tlb();
     return 0;
 }
 
+/**
+ * @brief           Delete a memory map in the current address space.
+ *                  *Do not free the physical memory.*
+ * 
+ * @param va        Virtual address.
+ * @param size      Size of map to delete.
+ * @return int      0 if succeed, -1 if failed.
+ */
+int
+freemap(uint32_t va, int size)
+{
+    return __freemap(cur_pgdir, va, size);
+}
+
 
 /**
  * @brief       Initialize the virtual memory structure of a process.
@@ -341,10 +572,11 @@ freemap(uint32_t va, int size)
  */
 void process_vm_init(vmem_t* vm)
 {
-    vm_area_t *file = kmalloc(sizeof(vm_area_t));
-    vm_area_t *heap = kmalloc(sizeof(vm_area_t));
-    vm_area_t *stack = kmalloc(sizeof(vm_area_t));
+    vm_area_t *file = kmem_cache_alloc(vm_area_cachep);
+    vm_area_t *heap = kmem_cache_alloc(vm_area_cachep);
+    vm_area_t *stack = kmem_cache_alloc(vm_area_cachep);
 
+    vm->pgdir = pgdir_create();
     vm->size = 0;
     vm->file_length = 0;
     vm->start_brk = vm->brk = 0x8800000;
@@ -354,7 +586,7 @@ void process_vm_init(vmem_t* vm)
     file->vmend = PROGRAM_IMG_BEGIN + PAGE_SIZE * vm->file_length;
     file->vmstart = PROGRAM_IMG_BEGIN;
     // file->vmend = USER_MEM + PAGE_SIZE_4MB;
-    file->vmflag = VM_READ | VM_WRITE | VM_EXEC;
+    file->vmflag = VM_READ | VM_WRITE | VM_EXEC | VM_IMAGE;
     
     heap->vmstart = heap->vmend = vm->brk;
     heap->vmflag = VM_READ | VM_WRITE | VM_HEAP;
@@ -385,6 +617,7 @@ vmalloc(vm_area_t* vm, int incrsize, int flags)
     uint32_t startva, va, pa;
     int i = 0, length, incrlength;
     uint32_t* temp;
+    void* p;
 
     if(incrsize < 0) 
         return -1;
@@ -410,19 +643,221 @@ vmalloc(vm_area_t* vm, int incrsize, int flags)
     for(va = startva; va < vm->vmend; va += PAGE_SIZE) {
         if((pa = get_user_page(0)) == 0)                                    /* Alloc physical memory. */
             return -1;
+        p = kmap(pa);
+        memset(p, 0, PAGE_SIZE);                                            /* Never leak old frame contents. */
+        kunmap(p);
         if(mmap(va, pa, PAGE_SIZE, flags) == -1)                            /* Map it onto the virtual address. */
             panic("mmap error");
-        vm->mmap[i] = PTE_PRESENT | flags | (ADDR_TO_PTE(pa));              /* Store the mmap info into the process's structure. */
+        vm->mmap[length + i] = PTE_PRESENT | flags | (ADDR_TO_PTE(pa));     /* Store the mmap info into the process's structure. */
         i++;
     }
 
-    flush_tlb();
     return 0;
 }
 
 /**
- * @brief           Dealloc a virtual memory area. Dealloc the physical memory corresponding
- *                  to it. If it's mapped on current virtual memory, delete the memory map.
+ * @brief       Expand a virtual memory area without allocating physical
+ *              memory. The new pages are populated by do_no_page() when
+ *              they are touched for the first time.
+ *              Falls back to vmalloc() when DEMAND_PAGING is off.
+ * 
+ * @param vm        Virtual memory area.
+ * @param incrsize  Increase size.
+ * @param flags     Flags of memory map (only used by vmalloc()).
+ * @return int      0 if succeed, -1 if failed.
+ */
+int
+vmreserve(vm_area_t* vm, int incrsize, int flags)
+{
+#if DEMAND_PAGING
+    int length, incrlength;
+    uint32_t* temp;
+
+    if(incrsize < 0) 
+        return -1;
+    if(incrsize == 0)
+        return 0;
+
+    incrlength = (incrsize + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    length = (vm->vmend - vm->vmstart) / PAGE_SIZE;
+
+    if((temp = kmalloc((length + incrlength) * sizeof(uint32_t*))) == 0)
+        return -1;
+    if(length) {
+        memcpy(temp, vm->mmap, length * sizeof(uint32_t*));
+        kfree(vm->mmap);
+    }
+    memset(temp + length, 0, incrlength * sizeof(uint32_t*));              /* Nothing is populated yet. */
+    vm->mmap = temp;
+
+    vm->vmend = vm->vmend + incrlength * PAGE_SIZE;
+
+    return 0;
+#else
+    return vmalloc(vm, incrsize, flags);
+#endif
+}
+
+/**
+ * @brief       Expand a virtual memory area by one page backed by an
+ *              existing frame.
+ *              A shared frame (e.g. a file system data block) is never
+ *              written: a writable area gets it as a copy-on-write page,
+ *              see do_wp_page(). A private frame from get_user_page(0)
+ *              is handed over to the area with its reference.
+ * 
+ * @param vm        Virtual memory that owns the area.
+ * @param area      Memory area.
+ * @param pa        Physical address of the frame, page aligned.
+ * @param shared    1 if the frame is shared, 0 if private.
+ * @return int      0 if succeed, -1 if failed.
+ */
+int
+vmattach(vmem_t* vm, vm_area_t* area, uint32_t pa, int shared)
+{
+    int length;
+    uint32_t flags;
+    uint32_t* temp;
+
+    length = (area->vmend - area->vmstart) / PAGE_SIZE;
+
+    if((temp = kmalloc((length + 1) * sizeof(uint32_t*))) == 0)
+        return -1;
+    if(length) {
+        memcpy(temp, area->mmap, length * sizeof(uint32_t*));
+        kfree(area->mmap);
+    }
+    area->mmap = temp;
+
+    flags = PTE_US;
+    if(area->vmflag & VM_WRITE)
+        flags |= shared ? PTE_COW : PTE_RW;
+    if(__mmap(vm->pgdir, area->vmend, pa, PAGE_SIZE, flags) == -1)
+        panic("vmattach: page is mapped");
+
+    if(shared)
+        user_page_dup(pa);
+    area->mmap[length] = PTE_PRESENT | flags | ADDR_TO_PTE(pa);
+    area->vmend += PAGE_SIZE;
+
+    return 0;
+}
+
+/**
+ * @brief       Expand a virtual memory area downwards (stack) without
+ *              allocating physical memory.
+ * 
+ * @param vm        Virtual memory area.
+ * @param newstart  New start address, page aligned and below vm->vmstart.
+ * @return int      0 if succeed, -1 if failed.
+ */
+int
+vmgrow_down(vm_area_t* vm, uint32_t newstart)
+{
+    int length, incrlength;
+    uint32_t* temp;
+
+    if(newstart >= vm->vmstart)
+        return 0;
+
+    incrlength = (vm->vmstart - newstart) / PAGE_SIZE;
+    length = (vm->vmend - vm->vmstart) / PAGE_SIZE;
+
+    if((temp = kmalloc((length + incrlength) * sizeof(uint32_t*))) == 0)
+        return -1;
+    memset(temp, 0, incrlength * sizeof(uint32_t*));
+    if(length) {
+        memcpy(temp + incrlength, vm->mmap, length * sizeof(uint32_t*));   /* Old pages keep their records. */
+        kfree(vm->mmap);
+    }
+    vm->mmap = temp;
+    vm->vmstart = newstart;
+
+    return 0;
+}
+
+/**
+ * @brief       Give page i of an area a zero filled frame and map it.
+ * 
+ * @param vm        Virtual memory that owns the area.
+ * @param area      Memory area.
+ * @param i         Page index in the area.
+ * @return int      0 if succeed, -1 if out of memory.
+ */
+static int
+vm_populate(vmem_t* vm, vm_area_t* area, int i)
+{
+    uint32_t pa, va, flags;
+    void* p;
+
+    if((pa = get_user_page(0)) == 0)
+        return -1;
+
+    p = kmap(pa);
+    memset(p, 0, PAGE_SIZE);
+    kunmap(p);
+
+    va = area->vmstart + i * PAGE_SIZE;
+    flags = PTE_US | ((area->vmflag & VM_WRITE) ? PTE_RW : 0);
+
+    if(__mmap(vm->pgdir, va, pa, PAGE_SIZE, flags) == -1)
+        panic("vm_populate: page is mapped");
+
+    area->mmap[i] = PTE_PRESENT | flags | pa;
+    return 0;
+}
+
+/**
+ * @brief       Handle a fault on a reserved but not yet populated page.
+ *              Up to FAULT_AROUND_PAGES neighbours in the same aligned
+ *              window are populated as well.
+ * 
+ * @param vm        Virtual memory of the faulting process.
+ * @param va        Faulting virtual address.
+ * @return int      0 if the fault is handled, -1 otherwise.
+ */
+int do_no_page(vmem_t* vm, uint32_t va)
+{
+    vm_area_t* area;
+    int i;
+#if FAULT_AROUND_PAGES > 1
+    int n, start, end;
+#endif
+
+    va = ADDR_TO_PTE(va);
+
+    for(area = vm->map_list; area != 0; area = area->next) {
+        if(va >= area->vmstart && va < area->vmend)
+            break;
+    }
+    if(area == 0)
+        return -1;
+
+    i = (va - area->vmstart) / PAGE_SIZE;
+    if(area->mmap[i] & PTE_PRESENT)
+        return -1;
+
+    if(vm_populate(vm, area, i) == -1)
+        return -1;
+
+#if FAULT_AROUND_PAGES > 1
+    n = (area->vmend - area->vmstart) / PAGE_SIZE;
+    start = i - (PTE_ADDR(va) % FAULT_AROUND_PAGES);
+    end = start + FAULT_AROUND_PAGES;
+    for(start = (start < 0) ? 0 : start; start < end && start < n; start++) {
+        if(!(area->mmap[start] & PTE_PRESENT) && vm_populate(vm, area, start) == -1)
+            break;                              /* Best effort only. */
+    }
+#endif
+
+    return 0;
+}
+
+/**
+ * @brief           Dealloc a virtual memory area. Drop the physical frames of it
+ *                  (a frame shared by fork is only freed by its last user).
+ *                  If it's mapped on current virtual memory, delete the memory map.
  * 
  * @param vm        Virtual memory area.
  * @param decsize   Decrease size.
@@ -431,26 +866,31 @@ vmalloc(vm_area_t* vm, int incrsize, int flags)
 void vmdealloc(vm_area_t* vm, int decsize, int mapping)
 {
     uint32_t newend, va;
-    int i, pa;
+    int i;
     uint32_t* temp;
     
     i = (vm->vmend - vm->vmstart) / PAGE_SIZE;
 
-    newend = vm->vmend - decsize / PAGE_SIZE;
+    newend = vm->vmend - ADDR_TO_PTE(decsize + PAGE_SIZE - 1);
+    if(newend < vm->vmstart || newend > vm->vmend)
+        newend = vm->vmstart;
 
     /* Loop through all the virtual addresses need to be freed. */
     for(va = vm->vmend; va > newend; va -= PAGE_SIZE) {
+        --i;
+        if(!(vm->mmap[i] & PTE_PRESENT))    /* Never populated. */
+            continue;
 
         if(mapping)                         /* If the address if mapped on vm, delete it. */
-            freemap(va, PAGE_SIZE);     
+            freemap(va - PAGE_SIZE, PAGE_SIZE);     
         
-        pa = ADDR_TO_PTE(vm->mmap[--i]);    /* Fetch physical address from mmap structure. */
-        free_user_page(pa, 0);              /* Free the physical address. */
+        user_page_put(vm->mmap[i]);         /* Drop the physical frame. */
     }
 
     if(newend != vm->vmend) {               /* Shrink the mmap structure. */
-        temp = kmalloc(i * sizeof(uint32_t*));          
-        memcpy(temp, vm->mmap, i * sizeof(uint32_t*));
+        temp = i ? kmalloc(i * sizeof(uint32_t*)) : NULL;
+        if(temp)
+            memcpy(temp, vm->mmap, i * sizeof(uint32_t*));
         kfree(vm->mmap);   
 
         vm->mmap = temp;
@@ -460,24 +900,24 @@ void vmdealloc(vm_area_t* vm, int decsize, int mapping)
 }
 
 /**
- * @brief           Copy a virtual memory structure.
+ * @brief           Copy a virtual memory structure for fork. No frame is
+ *                  copied: both address spaces map the same frames and
+ *                  writable pages become read-only copy-on-write pages in
+ *                  both of them. The first write copies the page, see
+ *                  do_wp_page().
  * 
  * @param dest      Destination vm structure.
  * @param src       Source vm structure.
- * @return int      0 if succeed, -1 if failed.
+ * @return int      0 if succeed, -ENOMEM if out of memory. The areas
+ *                  copied so far stay linked to dest with their frames
+ *                  counted, free_vm() releases them.
  */
 int vmcopy(vmem_t* dest, vmem_t* src) 
 {
-    uint32_t i, length, pa, va, cachepa;
+    uint32_t i, length, pa, va, flags;
     pte_t* pte;
-    char *cache;
     vm_area_t* srcarea, *destarea, *nextarea;
-
-    /* Use a temp storage. It's a random address in user area. */
-    cachepa = get_user_page(0);
-    cache = (char*) 0x7F00000;
-    mmap((uint32_t)cache, cachepa, PAGE_SIZE, PTE_US | PTE_RW);
-
+    vm_area_t** tail;
 
     dest->size = src->size;                     /* Copy virtual memory attributes. */
     dest->start_brk = src->start_brk;
@@ -485,69 +925,107 @@ int vmcopy(vmem_t* dest, vmem_t* src)
     dest->brk = src->brk;
     //dest->count = ++src->count;
 
-    srcarea = src->map_list;                    /* Start from the first memory map area. */
-
     destarea = dest->map_list;
     while(destarea != 0) {
         nextarea = destarea->next;
-        kfree(destarea);                        /* Free destination mmap areas if it has existed. */
+        kmem_cache_free(vm_area_cachep, destarea);  /* Free destination mmap areas if it has existed. */
         destarea = nextarea;
     }
+    dest->map_list = 0;
+    tail = &dest->map_list;
 
-    destarea = kmalloc(sizeof(vm_area_t));      /* Create first destination mmap area. */
-    dest->map_list = destarea;
-
-    while(srcarea != 0) {
+    for(srcarea = src->map_list; srcarea != 0; srcarea = srcarea->next) {
         length = (srcarea->vmend - srcarea->vmstart) / PAGE_SIZE;
 
-        destarea->mmap = kmalloc(sizeof(uint32_t*) * length);
+        if((destarea = kmem_cache_alloc(vm_area_cachep)) == NULL)
+            return -ENOMEM;
+
+        destarea->mmap = NULL;
+        if(length && (destarea->mmap = kmalloc(sizeof(uint32_t*) * length)) == NULL) {
+            kmem_cache_free(vm_area_cachep, destarea);
+            return -ENOMEM;
+        }
+        if(length)
+            memset(destarea->mmap, 0, sizeof(uint32_t*) * length);   /* Nothing is mapped yet. */
 
         destarea->vmstart = srcarea->vmstart;
         destarea->vmend = srcarea->vmend;
         destarea->vmflag = srcarea->vmflag;
+        destarea->next = 0;
+
+        *tail = destarea;                       /* Linked before any frame is counted. */
+        tail = &destarea->next;
 
         /* For each mmap area to copy, loop through all pages. */
         i = 0;
-        for(va = srcarea->vmstart; va < srcarea->vmend; va += PAGE_SIZE) {
+        for(va = srcarea->vmstart; va < srcarea->vmend; va += PAGE_SIZE, i++) {
+            if(!(srcarea->mmap[i] & PTE_PRESENT))
+                continue;
 
-            if((pte = _walk(va, 0, 0)) == 0) {      /* Obtain PTE entry for current virtual address. */
-                panic("vmcopy: walk error");
-            }
-            if((*pte & PTE_PRESENT) == 0) {
-                panic("vmcopy: src not present");
-            }
-            
-            if((pa = get_user_page(0)) == 0) {      /* Alloc physical memory for dest. */
-                panic("vmcopy: get user page failed");
+            pa = ADDR_TO_PTE(srcarea->mmap[i]);
+            flags = GETBIT_12(srcarea->mmap[i]);
+
+            if(flags & PTE_RW) {                    /* Write protect the page on both sides. */
+                flags = (flags & ~PTE_RW) | PTE_COW;
+                srcarea->mmap[i] = flags | pa;
+                if((pte = _walk(src->pgdir, va, 0, 0)) != 0 && (*pte & PTE_PRESENT)) {
+                    *pte = flags | pa;
+                    if(src->pgdir == cur_pgdir)
+                        flush_tlb_page(va);
+                }
             }
-            
-            memcpy(cache, (char*)va, PAGE_SIZE);    /* Copy mapping data onto the temp storage. */
-            
-            freemap(va, PAGE_SIZE);                 /* Delete previous memory map. */
-
-            if(mmap(va, pa, PAGE_SIZE, GETBIT_12(srcarea->mmap[i])) == -1) {    /* Map new physical memory to the pagedir. */
-                free_user_page(pa, 0);
-                panic("vmcopy: remap failed");
-            }
-            
-            memcpy((char*)va, cache, PAGE_SIZE);    /* Copy data to current virtual memory. */
 
-            destarea->mmap[i] = PTE_PRESENT | GETBIT_12(srcarea->mmap[i]) | (ADDR_TO_PTE(pa));
-            i ++;
-        }
+            if(__mmap(dest->pgdir, va, pa, PAGE_SIZE, flags & ~PTE_PRESENT) == -1)
+                return -ENOMEM;                     /* No page table for dest. */
 
-        srcarea = srcarea->next;
-        if(srcarea != 0) {
-            nextarea = kmalloc(sizeof(vm_area_t));  /* Create next mmap area structure. */
-            destarea->next = nextarea;
-            destarea = nextarea;
+            user_page_dup(pa);                      /* The frame is shared now. */
+            destarea->mmap[i] = flags | pa;
         }
     }
 
-    destarea->next = 0;
+    return 0;
+}
+
+/**
+ * @brief           Handle a write to a copy-on-write page. The last user
+ *                  of a frame gets it back writable, the others get a
+ *                  private copy.
+ * 
+ * @param vm        Virtual memory of the faulting process.
+ * @param va        Faulting virtual address.
+ * @return int      0 if the fault is handled, -1 if it is not a COW page.
+ */
+int do_wp_page(vmem_t* vm, uint32_t va)
+{
+    vm_area_t* area;
+    uint32_t i, pa, npa, flags;
+    pte_t* pte;
+
+    va = ADDR_TO_PTE(va);
+
+    for(area = vm->map_list; area != 0; area = area->next) {
+        if(va >= area->vmstart && va < area->vmend)
+            break;
+    }
+    if(area == 0)
+        return -1;
+
+    i = (va - area->vmstart) / PAGE_SIZE;
+    if(!(area->mmap[i] & PTE_COW))
+        return -1;
+
+    pa = ADDR_TO_PTE(area->mmap[i]);
+    flags = (GETBIT_12(area->mmap[i]) & ~PTE_COW) | PTE_RW;
+
+    if((npa = user_page_unshare(pa)) == 0)      /* Reuse the frame or copy it (never a fs block). */
+        return -1;
+
+    if((pte = _walk(vm->pgdir, va, 0, 0)) == 0)
+        panic("do_wp_page: no page table");
 
-    freemap((uint32_t)cache, PAGE_SIZE);            /* Free the temp storage. */
-    free_user_page(cachepa, 0);
+    area->mmap[i] = flags | npa;
+    *pte = flags | npa;
+    flush_tlb_page(va);
 
     return 0;
 }
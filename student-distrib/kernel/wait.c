@@ -0,0 +1,62 @@
+#include <pro/wait.h>
+#include <pro/process.h>
+#include <access.h>
+#include <list.h>
+#include <lib.h>
+
+
+/**
+ * @brief initialize an empty wait queue
+ *
+ * @param q : wait queue head
+ */
+void init_waitqueue_head(wait_queue_head_t *q) {
+    INIT_LIST_HEAD(&q->task_list);
+    spin_lock_init(&q->lock);
+}
+
+
+/**
+ * @brief put the running task to sleep on q until a wake_up(q).
+ * Must be called with q->lock held and interrupts disabled (see 
+ * wait_event), the lock is dropped while sleeping.
+ *
+ * @param q : wait queue head
+ */
+void sleep_on(wait_queue_head_t *q) {
+    thread_t *curr;
+
+    GETPRO(curr);
+
+    list_add_tail(&curr->wait_node, &q->task_list);
+    curr->state = SLEEPING;
+
+    spin_unlock(&q->lock);
+    sched_sleep(curr);
+    spin_lock(&q->lock);
+
+    /* woken by someone else (e.g. a terminal switch): leave the queue */
+    if (curr->wait_node.next)
+        list_del(&curr->wait_node);
+}
+
+
+/**
+ * @brief wake up every task sleeping on q
+ *
+ * @param q : wait queue head
+ */
+void wake_up(wait_queue_head_t *q) {
+    thread_t *task;
+    uint32_t flags;
+
+    spin_lock_irqsave(&q->lock, flags);
+
+    while (!list_empty(&q->task_list)) {
+        task = list_entry(q->task_list.next, thread_t, wait_node);
+        list_del(&task->wait_node);
+        try_to_wake_up(task);
+    }
+
+    spin_unlock_irqrestore(&q->lock, flags);
+}
@@ -10,6 +10,9 @@
 int screen_x = 0;
 int screen_y = 0;
 
+/* the screen before the terminals boot */
+static DEFINE_SPINLOCK(boot_screen_lock);
+
 
 int32_t fputs(int32_t fd, const int8_t* s) {
     uint32_t size = strlen(s);
@@ -22,20 +25,25 @@ int32_t fputs(int32_t fd, const int8_t* s) {
 void clear(void) {
     thread_t *curr;
     terminal_t *terminal;
+    uint32_t flags;
 
     if (!terminal_boot) {
+        spin_lock_irqsave(&boot_screen_lock, flags);
         vga_clear(video_mem);
         screen_x = 0;
         screen_y = 0;
+        spin_unlock_irqrestore(&boot_screen_lock, flags);
         return;
     }
 
     curr = current->task;
     terminal = curr->terminal;
     
+    spin_lock_irqsave(&terminal->lock, flags);
     vga_clear(terminal->vidmem);
     terminal->screen_x = 0;
     terminal->screen_y = 0;
+    spin_unlock_irqrestore(&terminal->lock, flags);
 }
 
 
@@ -173,44 +181,95 @@ format_char_switch:
  * @return Number of bytes written.
  */
 int32_t puts(int8_t* s) {
-    register int32_t index = 0;
-    while (s[index] != '\0') {
-        putc(s[index]);
-        index++;
-    }
-    return index;
+    int32_t n = strlen(s);
+    putbuf(s, n);
+    return n;
 }
 
 void _putc(uint8_t c, terminal_t* terminal) {
-    int32_t x, y;
-    uint8_t *vidmem;
+    _putbuf((int8_t*)&c, 1, terminal);
+}
+
+/**
+ * @brief Output a buffer to a terminal, taking the lock of its screen.
+ * 
+ * @param buf : characters to print, '\n' and '\r' start a new line
+ * @param n : number of characters
+ * @param terminal : terminal to print to, unused before the terminals boot
+ */
+void _putbuf(const int8_t* buf, int32_t n, terminal_t* terminal) {
+    spinlock_t *lock = terminal_boot ? &terminal->lock : &boot_screen_lock;
+    uint32_t flags;
+
+    spin_lock_irqsave(lock, flags);
+    __putbuf(buf, n, terminal);
+    spin_unlock_irqrestore(lock, flags);
+}
+
+/**
+ * @brief Output a buffer to a terminal as one batch. The lines the batch 
+ * scrolls are counted first, the screen is scrolled once, then each run of 
+ * characters within a row is written to its final row. Characters that 
+ * would scroll off the screen are never written. The cursor is moved once.
+ * The lock of the screen must be held (see _putbuf()).
+ * 
+ * @param buf : characters to print, '\n' and '\r' start a new line
+ * @param n : number of characters
+ * @param terminal : terminal to print to, unused before the terminals boot
+ */
+void __putbuf(const int8_t* buf, int32_t n, terminal_t* terminal) {
+    int32_t i, end, x, y, vx, vy, lines;
+    char *vidmem, *line;
 
     if (!terminal_boot) {
         x = screen_x;
         y = screen_y;
-        vidmem = (uint8_t*)video_mem;
+        vidmem = video_mem;
     } else {  
         x = terminal->screen_x;
         y = terminal->screen_y;
         vidmem = terminal->vidmem;
     }
-     if(c == '\n' || c == '\r') {
-        if (y + 1 == NUM_ROWS) 
-            vga_scrolling(vidmem);
-        else
-           y++; 
-        x = 0;
-    } else {
-        vga_write(vidmem, x, y, c);
-        x++;
-        x %= NUM_COLS;
-        if (x == 0) {
-            if (y + 1 != NUM_ROWS)
-                y++;
-            else
-                vga_scrolling(vidmem);
+
+    /* Count the lines scrolled by the whole batch. */
+    for (i = 0, vx = x, vy = y; i < n; i++) {
+        if (buf[i] == '\n' || buf[i] == '\r' || ++vx == NUM_COLS) {
+            vx = 0;
+            vy++;
+        }
+    }
+    lines = (vy >= NUM_ROWS) ? vy - (NUM_ROWS - 1) : 0;
+    if (lines && terminal_boot) {
+        /* The old rows go to the scrollback, followed by blank lines for 
+         * the rows of this batch that never reach the screen. */
+        for (i = 0; i < lines; i++)
+            history_push(terminal, i < NUM_ROWS ? vidmem + i * LINE_SIZE : NULL);
+    }
+    if (lines)
+        vga_scroll(vidmem, lines);
+
+    /* Write the runs, rows are relative to the scrolled screen, 
+     * rows above it are in the scrollback. */
+    y -= lines;
+    for (i = 0; i < n; i = end) {
+        if (buf[i] == '\n' || buf[i] == '\r') {
+            x = 0;
+            y++;
+            end = i + 1;
+            continue;
+        }
+        for (end = i; end < n && end - i < NUM_COLS - x && buf[end] != '\n' && buf[end] != '\r'; end++);
+        if (y >= 0)
+            vga_write_run(vidmem, x, y, buf + i, end - i);
+        else if ((line = history_line(terminal_boot ? terminal : NULL, -y)) != NULL)
+            vga_write_run(line, x, 0, buf + i, end - i);
+        x += end - i;
+        if (x == NUM_COLS) {
+            x = 0;
+            y++;
         }
     }
+
     if (!terminal_boot) {
         screen_x = x;
         screen_y = y;
@@ -223,6 +282,21 @@ void _putc(uint8_t c, terminal_t* terminal) {
     }
 }
 
+/**
+ * @brief Output a buffer to the console of the current process.
+ * @param buf : characters to print.
+ * @param n : number of characters.
+ */
+void putbuf(const int8_t* buf, int32_t n) {
+    thread_t *curr;
+    terminal_t *terminal = NULL;
+    if(terminal_boot) {
+        GETPRO(curr);
+        terminal = curr->terminal;
+    }
+    _putbuf(buf, n, terminal);
+}
+
 /**
  * @brief Output a character to the console .
  * @param c : character to print.
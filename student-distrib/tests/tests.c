@@ -8,6 +8,8 @@
 #include <boot/syscall.h>
 #include <boot/page.h>
 #include <kmalloc.h>
+#include <errno.h>
+#include <pro/pid.h>
 
 	
 #define PASS 1
@@ -601,6 +603,218 @@ void test_kmalloc() {
 	// printf("umalloc 1MB: %x\n", get_user_page(8));
 }
 
+/* Allocator and pid tests */
+
+#define TEST_ZONE_FRAMES (1 << (MAX_ORDER - 1))    /* one block of the highest order */
+
+static page_t test_mem_map[TEST_ZONE_FRAMES];
+
+/**
+ * @brief count the nodes of a list
+ */
+static int list_count(list_head* head) {
+	list_head* node;
+	int n = 0;
+	list_for_each(node, head)
+		n++;
+	return n;
+}
+
+/**
+ * @brief a freed pid is not handed out again at once
+ * Coverage: alloc_pid, free_pid
+ * Files: pid.c
+ */
+int pid_reuse_test() {
+	TEST_HEADER;
+	int32_t a, b;
+	int result = PASS;
+
+	if ((a = alloc_pid()) < 0)
+		return FAIL;
+	free_pid(a);
+	if ((b = alloc_pid()) < 0)
+		return FAIL;
+	if (a == b)
+		result = FAIL;
+	free_pid(b);
+	return result;
+}
+
+/**
+ * @brief take every free pid: the search wraps around the bitmap, 
+ * skips the reserved pids and fails with -EAGAIN when all are in use
+ * Coverage: alloc_pid, free_pid
+ * Files: pid.c
+ */
+int pid_exhaust_test() {
+	TEST_HEADER;
+	int32_t* pids;
+	int32_t pid, first;
+	int i, n = 0;
+	int result = PASS;
+
+	if ((pids = kmalloc(PID_SIZE * sizeof(int32_t))) == NULL)
+		return FAIL;
+
+	/* the first pid is given back last: taking it again needs a wraparound */
+	if ((first = alloc_pid()) < 0) {
+		kfree(pids);
+		return FAIL;
+	}
+
+	while ((pid = alloc_pid()) >= 0) {
+		if (pid < RESERVED_PIDS || pid >= PID_SIZE || n >= PID_SIZE) {
+			result = FAIL;
+			break;
+		}
+		pids[n++] = pid;
+	}
+	if (pid != -EAGAIN)
+		result = FAIL;
+
+	/* the only free pid is found behind the cursor */
+	free_pid(first);
+	if (alloc_pid() != first)
+		result = FAIL;
+	if (alloc_pid() != -EAGAIN)
+		result = FAIL;
+
+	free_pid(first);
+	for (i = 0; i < n; i++)
+		free_pid(pids[i]);
+	kfree(pids);
+	return result;
+}
+
+/**
+ * @brief a task is found by its pid until it is detached
+ * Coverage: attach_pid, detach_pid, find_task_by_pid
+ * Files: pid.c
+ */
+int pid_hash_test() {
+	TEST_HEADER;
+	thread_t* task;
+	int32_t pid;
+	uint32_t flags;
+	int result = PASS;
+
+	if ((pid = alloc_pid()) < 0)
+		return FAIL;
+	if ((task = kmalloc(sizeof(thread_t))) == NULL) {
+		free_pid(pid);
+		return FAIL;
+	}
+	memset(task, 0, sizeof(thread_t));
+	task->state = SLEEPING;
+	task->pid = pid;
+
+	spin_lock_irqsave(&tasklist_lock, flags);
+	attach_pid(task);
+	if (find_task_by_pid(task->pid) != task)
+		result = FAIL;
+	detach_pid(task);
+	if (find_task_by_pid(task->pid) != NULL)
+		result = FAIL;
+	spin_unlock_irqrestore(&tasklist_lock, flags);
+
+	free_pid(pid);
+	kfree(task);
+	return result;
+}
+
+/**
+ * @brief blocks split down to the order asked for and merge back into 
+ * one block of the highest order, on a zone of its own
+ * Coverage: zone_init, zone_free_range, __get_pages, __free_pages
+ * Files: kmalloc.c
+ */
+int buddy_test() {
+	TEST_HEADER;
+	zone_t z;
+	int32_t a, b, c;
+	int result = PASS;
+
+	zone_init(&z, 0, TEST_ZONE_FRAMES, test_mem_map);
+	zone_free_range(&z, 0, TEST_ZONE_FRAMES);
+	if (z.free_mask != 1 << (MAX_ORDER - 1))
+		return FAIL;
+
+	/* the first frame splits the block: one free block of every lower order */
+	a = __get_pages(&z, 0);
+	if (a != 0 || z.free_mask != (1 << (MAX_ORDER - 1)) - 1)
+		result = FAIL;
+	b = __get_pages(&z, 0);
+	if (b != 1 || (z.free_mask & 1))
+		result = FAIL;
+	c = __get_pages(&z, 3);
+	if (c != 8 || (c & 7))
+		result = FAIL;
+
+	/* more than the zone holds */
+	if (__get_pages(&z, MAX_ORDER - 1) != -1 || __get_pages(&z, MAX_ORDER) != -1)
+		result = FAIL;
+
+	__free_pages(&z, b, 0);
+	__free_pages(&z, c, 3);
+	__free_pages(&z, a, 0);
+
+	if (z.free_mask != 1 << (MAX_ORDER - 1) ||
+		list_count(&z.free_list[MAX_ORDER - 1]) != 1 ||
+		z.mem_map[0].owner != PG_BUDDY || z.mem_map[0].order != MAX_ORDER - 1)
+		result = FAIL;
+	return result;
+}
+
+/**
+ * @brief a cache keeps one empty slab and gives the other empty ones 
+ * back to the buddy allocator
+ * Coverage: kmem_cache_create, kmem_cache_alloc, kmem_cache_free
+ * Files: kmalloc.c
+ */
+int slab_test() {
+	TEST_HEADER;
+	static kmem_cache_t* cache;
+	void** objs;
+	uint32_t i, n;
+	int result = PASS;
+
+	if (cache == NULL && (cache = kmem_cache_create("test", 200, 0, NULL)) == NULL)
+		return FAIL;
+
+	/* two full slabs */
+	n = 2 * cache->num;
+	if ((objs = kmalloc(n * sizeof(void*))) == NULL)
+		return FAIL;
+	for (i = 0; i < n; i++) {
+		if ((objs[i] = kmem_cache_alloc(cache)) == NULL) {
+			n = i;
+			result = FAIL;
+			break;
+		}
+	}
+	if (result == PASS && list_count(&cache->slabs_full) != 2)
+		result = FAIL;
+
+	for (i = 0; i < n; i++)
+		kmem_cache_free(cache, objs[i]);
+	kfree(objs);
+
+	if (list_count(&cache->slabs_full) != 0 ||
+		list_count(&cache->slabs_partial) != 0 ||
+		list_count(&cache->slabs_free) != 1)
+		result = FAIL;
+	return result;
+}
+
+void test_allocators() {
+	TEST_OUTPUT("pid_reuse_test", pid_reuse_test());
+	TEST_OUTPUT("pid_exhaust_test", pid_exhaust_test());
+	TEST_OUTPUT("pid_hash_test", pid_hash_test());
+	TEST_OUTPUT("buddy_test", buddy_test());
+	TEST_OUTPUT("slab_test", slab_test());
+}
+
 /* Test suite entry point */
 void launch_tests() {
 	printf("--------------------------------- Test begins ---------------------------------\n");
@@ -609,5 +823,6 @@ void launch_tests() {
 	//page_access_test();
 	//test_checkpoint3();
 	test_kmalloc();
+	test_allocators();
 	printf("---------------------------------- Test Ends ----------------------------------\n");
 }